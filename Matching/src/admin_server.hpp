@@ -0,0 +1,176 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/lexical_cast.hpp>
+#include <order_router.hpp>
+
+namespace matching_engine
+{
+namespace tcp
+{
+
+/*
+ * Administrative HTTP endpoint, apart from order entry so that its clients cannot reach it:
+ * it listens on the loopback interface only. Requests are
+ *   /MARKET/market/tick/lot  registers a market while running; answers {"id":N}
+ * Registration waits for a consumer to build the book, so it runs on a registrar thread of
+ * its own and the response is posted back to the connection once it completes.
+ */
+class admin_session
+    : public std::enable_shared_from_this<admin_session>
+{
+public:
+    admin_session(boost::asio::ip::tcp::socket socket,
+                  const std::shared_ptr<router::dispatcher> dispatcher,
+                  const std::shared_ptr<spdlog::logger> &console,
+                  boost::asio::thread_pool &registrar)
+        : socket_{std::move(socket)}, dispatcher_{dispatcher}, console_{console}, registrar_{registrar} {}
+    admin_session(const admin_session&) = delete;
+
+    void start()
+    {
+        read_();
+    }
+
+private:
+    using request_t = boost::beast::http::request<boost::beast::http::string_body>;
+    using response_t = boost::beast::http::response<boost::beast::http::string_body>;
+
+    void read_()
+    {
+        request_ = {};
+        boost::beast::http::async_read(socket_, buffer_, request_,
+        [this, self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+            if (ec == boost::beast::http::error::end_of_stream)
+                return;
+            if (ec) {
+                console_->error("admin_session::async_read: {}", ec.message());
+                return;
+            }
+            handle_();
+        });
+    }
+
+    void handle_()
+    {
+        std::vector<std::string> params;
+        const std::string_view target = request_.target();
+        for (std::size_t first = 0; first < target.size();) {
+            auto last = target.find('/', first);
+            if (last == std::string_view::npos)
+                last = target.size();
+            if (last != first)
+                params.emplace_back(target.substr(first, last - first));
+            first = last + 1;
+        }
+        if (params.size() != 4 || params[0] != "MARKET") {
+            console_->warn("admin_session::async_read: Invalid request {}", target);
+            reply_(boost::beast::http::status::bad_request, "");
+            return;
+        }
+        boost::asio::post(registrar_, [this, self = shared_from_this(), params = std::move(params)] {
+            std::optional<MarketId> id;
+            try {
+                id = dispatcher_->add_market(market_spec{params[1], params[2], params[3]});
+            } catch (const std::invalid_argument &) {
+                /* Malformed tick or lot size */
+            }
+            boost::asio::post(socket_.get_executor(), [this, self, id, market = params[1]] {
+                if (!id) {
+                    console_->warn("admin_session::add_market: Invalid market {}", market);
+                    reply_(boost::beast::http::status::bad_request, "");
+                    return;
+                }
+                reply_(boost::beast::http::status::ok, fmt::format("{{\"id\":{}}}", *id));
+            });
+        });
+    }
+
+    void reply_(const boost::beast::http::status status, std::string body)
+    {
+        response_ = response_t{status, request_.version()};
+        response_.set(boost::beast::http::field::server, BOOST_BEAST_VERSION_STRING);
+        response_.set(boost::beast::http::field::content_type, "application/json");
+        response_.keep_alive(request_.keep_alive());
+        response_.body() = std::move(body);
+        response_.prepare_payload();
+        boost::beast::http::async_write(socket_, response_,
+        [this, self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+            if (ec) {
+                console_->error("admin_session::async_write: {}", ec.message());
+                return;
+            }
+            if (response_.keep_alive())
+                read_();
+        });
+    }
+
+    boost::asio::ip::tcp::socket socket_;
+    boost::beast::flat_buffer buffer_;
+    request_t request_;
+    response_t response_;
+    std::shared_ptr<router::dispatcher> dispatcher_;
+    const std::shared_ptr<spdlog::logger> console_;
+    boost::asio::thread_pool &registrar_;
+};
+
+/* Acceptor of admin_session on the loopback interface, with a thread of its own */
+class admin_server
+{
+public:
+    /* Throws boost::system::system_error if the port cannot be bound */
+    admin_server(const std::shared_ptr<router::dispatcher> dispatcher,
+                 const std::shared_ptr<spdlog::logger> console,
+                 const unsigned short port = 8082)
+        : acceptor_{ioc_, {boost::asio::ip::address_v4::loopback(), port}}, dispatcher_{dispatcher},
+          console_{console}
+    {
+        console_->info("admin_server::start: started on {}",
+                       boost::lexical_cast<std::string>(acceptor_.local_endpoint()));
+        async_accept_();
+        boost::asio::post(thread_, [this] {
+            ioc_.run();
+        });
+    }
+    admin_server(const admin_server&) = delete;
+
+    ~admin_server()
+    {
+        ioc_.stop();
+        thread_.join();
+        registrar_.join();
+    }
+
+    /* The bound port, e.g. when constructed with port 0 */
+    unsigned short port() const
+    {
+        return acceptor_.local_endpoint().port();
+    }
+
+private:
+    void async_accept_()
+    {
+        acceptor_.async_accept([this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            if (ec)
+                console_->error("admin_server::async_accept: {}", ec.message());
+            else
+                std::make_shared<admin_session>(std::move(socket), dispatcher_, console_, registrar_)->start();
+            async_accept_();
+        });
+    }
+
+    boost::asio::io_context ioc_{1};
+    boost::asio::ip::tcp::acceptor acceptor_;
+    std::shared_ptr<router::dispatcher> dispatcher_;
+    const std::shared_ptr<spdlog::logger> console_;
+    boost::asio::thread_pool registrar_{1}; /* Runs registrations, which block until the book is built */
+    boost::asio::thread_pool thread_{1};    /* Runs ioc_ */
+};
+
+} // namespace tcp
+} // namespace matching_engine
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <binary_protocol.hpp>
+
+namespace matching_engine
+{
+namespace wire
+{
+
+/*
+ * Blocking client of the native order entry protocol. Requests are buffered until flush(),
+ * so that a burst of them goes out in as few segments as possible, and replies are read
+ * in batches. Not thread-safe; use one client per thread.
+ */
+class client
+{
+public:
+    /* Throws boost::system::system_error if the engine cannot be reached */
+    client(const std::string &host, const unsigned short port): socket_{ioc_}
+    {
+        boost::asio::ip::tcp::resolver resolver{ioc_};
+        boost::asio::connect(socket_, resolver.resolve(host, std::to_string(port)));
+        socket_.set_option(boost::asio::ip::tcp::no_delay(true));
+    }
+    client(const client &) = delete;
+    client& operator=(const client&) = delete;
+    /* Each request returns the client id its ack will carry */
+    uint64_t new_order(const MarketId market, const SIDE side, const Price price, const Quantity quantity)
+    {
+        const wire::new_order message{head_of<wire::new_order>(NEW_ORDER), market, side, 0, next_client_id_, price,
+                                      quantity};
+        append_(message);
+        return next_client_id_++;
+    }
+    uint64_t cancel(const MarketId market, const OrderId id)
+    {
+        const cancel_order message{head_of<cancel_order>(CANCEL_ORDER), market, 0, next_client_id_, id};
+        append_(message);
+        return next_client_id_++;
+    }
+    uint64_t amend(const MarketId market, const OrderId id, const Price price, const Quantity quantity)
+    {
+        const amend_order message{head_of<amend_order>(AMEND_ORDER), market, 0, next_client_id_, id, price, quantity};
+        append_(message);
+        return next_client_id_++;
+    }
+    /* Sends every buffered request */
+    void flush()
+    {
+        boost::asio::write(socket_, boost::asio::buffer(out_));
+        out_.clear();
+    }
+    /* Blocks until at least one ack arrives; the visitor gets every ack read. Returns their number */
+    template <typename visitor_type>
+    std::size_t read(visitor_type &&visitor)
+    {
+        std::size_t acks = 0;
+        while (acks == 0) {
+            receive_([&](const header &head) {
+                if (const auto reply = head.type == ACK ? view<ack>(head) : nullptr) {
+                    visitor(*reply);
+                    ++acks;
+                }
+            });
+        }
+        return acks;
+    }
+    /*
+     * Id of a market by name; nullopt if the engine does not know it. Flushes and waits for
+     * the reply, dropping acks read meanwhile, so look markets up before trading.
+     */
+    std::optional<MarketId> market(const std::string_view name)
+    {
+        market_request request{head_of<market_request>(MARKET_REQUEST), 0, next_client_id_++, {}};
+        if (!set_name(request, name))
+            return std::nullopt;
+        append_(request);
+        flush();
+        std::optional<market_reply> found;
+        while (!found) {
+            receive_([&](const header &head) {
+                const auto reply = head.type == MARKET_REPLY ? view<market_reply>(head) : nullptr;
+                if (reply != nullptr && reply->client_id == request.client_id)
+                    found = *reply;
+            });
+        }
+        if (found->status != ACCEPTED)
+            return std::nullopt;
+        return found->market;
+    }
+private:
+    template <typename message_type>
+    void append_(const message_type &message)
+    {
+        const auto bytes = reinterpret_cast<const char *>(&message);
+        out_.insert(out_.end(), bytes, bytes + sizeof(message));
+    }
+    /* One read off the socket, decoded in place; what is left of a message waits for the next */
+    template <typename visitor_type>
+    void receive_(visitor_type &&visitor)
+    {
+        filled_ += socket_.read_some(boost::asio::buffer(in_.data() + filled_, in_.size() - filled_));
+        const auto [consumed, valid] = decode(in_.data(), filled_, [&](const header &head) {
+            visitor(head);
+            return true;
+        });
+        if (!valid)
+            throw std::runtime_error("wire::client: malformed reply");
+        std::memmove(in_.data(), in_.data() + consumed, filled_ - consumed);
+        filled_ -= consumed;
+    }
+    boost::asio::io_context ioc_;
+    boost::asio::ip::tcp::socket socket_;
+    std::vector<char> out_;
+    alignas(8) std::array<char, 1 << 16> in_;
+    std::size_t filled_ = 0;
+    uint64_t next_client_id_ = 1;
+};
+
+} // namespace wire
+} // namespace matching_engine
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <orderbook.hpp>
+
+namespace matching_engine
+{
+namespace wire
+{
+
+/*
+ * Native order entry: length-prefixed messages of fixed layout, little-endian, with every
+ * field naturally aligned. Message lengths are multiples of 8, so a message starting at an
+ * 8-byte aligned offset of the read buffer is followed by one which is, and every message
+ * can be used in place without copying it out of the buffer.
+ */
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the wire format is the host layout");
+
+constexpr uint8_t protocol_version = 1;
+
+enum MESSAGE : uint8_t {
+    NEW_ORDER = 1,
+    CANCEL_ORDER = 2,
+    AMEND_ORDER = 3,
+    MARKET_REQUEST = 4, /* Market id of a name */
+    ACK = 0x81,
+    MARKET_REPLY = 0x82
+};
+
+enum ACK_STATUS : uint8_t {
+    ACCEPTED, /* Queued for matching */
+    REJECTED, /* Unknown market, malformed price, quantity or side */
+    BUSY      /* The market's consumer is saturated; retry later */
+};
+
+struct header {
+    uint16_t length; /* Of the whole message, header included */
+    uint8_t type;    /* MESSAGE */
+    uint8_t version; /* protocol_version */
+};
+
+/* Requests carry a client id which is echoed in their reply */
+struct new_order {
+    header head;
+    uint16_t market;
+    uint8_t side;     /* SIDE */
+    uint8_t reserved;
+    uint64_t client_id;
+    uint64_t price;    /* Ticks of the market */
+    uint64_t quantity; /* Lots of the market */
+};
+
+struct cancel_order {
+    header head;
+    uint16_t market;
+    uint16_t reserved;
+    uint64_t client_id;
+    uint64_t order_id;
+};
+
+/* New limit price and total quantity; see OrderBook::amend */
+struct amend_order {
+    header head;
+    uint16_t market;
+    uint16_t reserved;
+    uint64_t client_id;
+    uint64_t order_id;
+    uint64_t price;
+    uint64_t quantity;
+};
+
+struct market_request {
+    header head;
+    uint32_t reserved;
+    uint64_t client_id;
+    char name[32]; /* Zero padded */
+};
+
+struct ack {
+    header head;
+    uint8_t status;  /* ACK_STATUS */
+    uint8_t request; /* MESSAGE acknowledged */
+    uint16_t market;
+    uint64_t client_id;
+    uint64_t order_id; /* Engine id of a new order, which cancels and amends refer to */
+};
+
+struct market_reply {
+    header head;
+    uint8_t status; /* ACCEPTED, or REJECTED for an unknown name */
+    uint8_t reserved;
+    uint16_t market;
+    uint64_t client_id;
+};
+
+/* Longest message either side sends */
+constexpr std::size_t max_message = sizeof(market_request);
+
+template <typename message_type>
+constexpr bool well_formed()
+{
+    return std::is_trivially_copyable<message_type>::value && std::is_standard_layout<message_type>::value
+           && sizeof(message_type) % 8 == 0 && sizeof(message_type) <= max_message;
+}
+static_assert(well_formed<new_order>() && sizeof(new_order) == 32, "new_order layout");
+static_assert(well_formed<cancel_order>() && sizeof(cancel_order) == 24, "cancel_order layout");
+static_assert(well_formed<amend_order>() && sizeof(amend_order) == 40, "amend_order layout");
+static_assert(well_formed<market_request>() && sizeof(market_request) == 48, "market_request layout");
+static_assert(well_formed<ack>() && sizeof(ack) == 24, "ack layout");
+static_assert(well_formed<market_reply>() && sizeof(market_reply) == 16, "market_reply layout");
+
+/* Header of a message of the given type */
+template <typename message_type>
+constexpr header head_of(const MESSAGE type)
+{
+    return header{uint16_t(sizeof(message_type)), type, protocol_version};
+}
+
+/*
+ * Splits a buffer into messages and hands each header to the visitor in place, to be cast
+ * with view<>(). Returns the bytes consumed, i.e. up to the first incomplete message, and
+ * false if a header is malformed or the visitor returned false for its message; the stream
+ * cannot be resynchronised then. data must be 8-byte aligned.
+ */
+template <typename visitor_type>
+std::pair<std::size_t, bool> decode(const char *data, const std::size_t size, visitor_type &&visitor)
+{
+    std::size_t offset = 0;
+    while (size - offset >= sizeof(header)) {
+        const auto &head = *reinterpret_cast<const header *>(data + offset);
+        if (head.length < sizeof(header) || head.length > max_message || head.length % 8 != 0
+            || head.version != protocol_version)
+            return {offset, false};
+        if (size - offset < head.length)
+            break;
+        if (!visitor(head))
+            return {offset, false};
+        offset += head.length;
+    }
+    return {offset, true};
+}
+
+/* The message of a header handed out by decode(); nullptr if its length does not match */
+template <typename message_type>
+const message_type *view(const header &head)
+{
+    if (head.length != sizeof(message_type))
+        return nullptr;
+    return reinterpret_cast<const message_type *>(&head);
+}
+
+/* Fixed-size copy of a market name; false if it does not fit */
+inline bool set_name(market_request &request, const std::string_view name)
+{
+    if (name.size() >= sizeof(request.name))
+        return false;
+    std::memset(request.name, 0, sizeof(request.name));
+    std::memcpy(request.name, name.data(), name.size());
+    return true;
+}
+
+inline std::string_view name_of(const market_request &request)
+{
+    return std::string_view{request.name, strnlen(request.name, sizeof(request.name))};
+}
+
+} // namespace wire
+} // namespace matching_engine
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <boost/asio.hpp>
+#include <metrics.hpp>
+
+namespace matching_engine
+{
+namespace tcp
+{
+
+/* How an I/O thread waits for its sockets */
+enum IO_WAIT : uint8_t {
+    BLOCKING, /* Sleeps in the reactor until the kernel signals readiness */
+    POLLING,  /* Spins on non-blocking polls of the reactor; never leaves the core */
+    ADAPTIVE  /* Polls while traffic is above io_policy::poll_rate, blocks below it */
+};
+
+inline std::optional<IO_WAIT> parse_io_wait(const std::string_view name)
+{
+    if (name == "block")
+        return IO_WAIT::BLOCKING;
+    if (name == "poll")
+        return IO_WAIT::POLLING;
+    if (name == "adaptive")
+        return IO_WAIT::ADAPTIVE;
+    return std::nullopt;
+}
+
+/* Mode an I/O thread is in at a time */
+enum IO_MODE : uint8_t {
+    INTERRUPT,
+    POLL,
+    IO_MODES
+};
+
+struct io_policy {
+    IO_WAIT wait = IO_WAIT::BLOCKING;
+    /* Completions per second at which an adaptive thread starts polling ... */
+    double poll_rate = 20000;
+    /* ... and the fraction of it below which it blocks again */
+    double hysteresis = 0.5;
+    /* Traffic is measured, and the mode decided, per window */
+    std::chrono::milliseconds window{10};
+    /* SO_BUSY_POLL of accepted sockets unless blocking, so that their reads poll the device queue too; 0 leaves it */
+    unsigned busy_poll_us = 50;
+};
+
+/*
+ * Sets SO_BUSY_POLL on a socket as the policy asks; false if the kernel refused, which it
+ * does for values above net.core.busy_read without CAP_NET_ADMIN.
+ */
+template <typename socket_type>
+bool busy_poll(socket_type &socket, const io_policy &policy)
+{
+    if (policy.wait == IO_WAIT::BLOCKING || policy.busy_poll_us == 0)
+        return true;
+    const int usec = int(policy.busy_poll_us);
+    return setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == 0;
+}
+
+/*
+ * Runs an io_context on the calling thread in the mode of its policy. An adaptive loop counts
+ * the handlers it runs per window and switches to polling once their rate reaches poll_rate,
+ * back to blocking once it falls below poll_rate * hysteresis, so that traffic around the
+ * threshold does not flip it every window. Stats are written by the running thread only.
+ */
+class event_loop
+{
+public:
+    explicit event_loop(const io_policy &policy): policy_{policy}
+    {
+        mode_.store(policy_.wait == IO_WAIT::POLLING ? IO_MODE::POLL : IO_MODE::INTERRUPT,
+                    std::memory_order_relaxed);
+    }
+    event_loop(const event_loop &) = delete;
+    event_loop& operator=(const event_loop&) = delete;
+
+    /* Returns once the io_context is stopped or out of work */
+    void run(boost::asio::io_context &ioc)
+    {
+        run(ioc, [] {});
+    }
+
+    /* As above; after_round() follows every round of handlers, i.e. all those ready at a time */
+    template <typename round_type>
+    void run(boost::asio::io_context &ioc, round_type &&after_round)
+    {
+        if (policy_.wait == IO_WAIT::BLOCKING) {
+            block_(ioc, after_round);
+            return;
+        }
+        auto mode = mode_.load(std::memory_order_relaxed);
+        const std::chrono::duration<double> window = policy_.window;
+        while (!ioc.stopped()) {
+            const auto start = std::chrono::steady_clock::now();
+            const auto end = start + policy_.window;
+            std::size_t handlers = 0;
+            if (mode == IO_MODE::POLL) {
+                while (std::chrono::steady_clock::now() < end && !ioc.stopped()) {
+                    if (const auto ran = ioc.poll()) {
+                        handlers += ran;
+                        after_round();
+                    }
+                }
+            } else {
+                /* As block_(), but back every window to measure the traffic */
+                while (const auto first = ioc.run_one_until(end)) {
+                    handlers += first + ioc.poll();
+                    after_round();
+                }
+            }
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            mode_ns_[mode].add_local(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            handlers_.add_local(handlers);
+            if (policy_.wait != IO_WAIT::ADAPTIVE)
+                continue;
+            const auto rate = handlers / window.count();
+            const auto next = mode == IO_MODE::POLL ? (rate < policy_.poll_rate * policy_.hysteresis ? IO_MODE::INTERRUPT
+                              : IO_MODE::POLL) : (rate >= policy_.poll_rate ? IO_MODE::POLL : IO_MODE::INTERRUPT);
+            if (next != mode) {
+                mode = next;
+                mode_.store(mode, std::memory_order_relaxed);
+                switches_.add_local();
+            }
+        }
+    }
+
+    /* Exporter thread; the current mode and the time spent in each so far */
+    void report(metrics::line_writer &out, const std::size_t index, const unsigned core) const
+    {
+        out.meas("io_thread")
+        .tag("thread", std::to_string(index))
+        .tag("core", std::to_string(core))
+        .field("polling", uint64_t(mode_.load(std::memory_order_relaxed) == IO_MODE::POLL))
+        .field("poll_ns", mode_ns_[IO_MODE::POLL].value())
+        .field("interrupt_ns", mode_ns_[IO_MODE::INTERRUPT].value())
+        .field("switches", switches_.value())
+        .field("handlers", handlers_.value())
+        .end();
+    }
+
+    IO_MODE mode() const
+    {
+        return mode_.load(std::memory_order_relaxed);
+    }
+
+private:
+    /* Sleeps in the reactor with no deadline until a handler is ready, then runs every other one ready with it */
+    template <typename round_type>
+    void block_(boost::asio::io_context &ioc, round_type &after_round)
+    {
+        auto last = std::chrono::steady_clock::now();
+        while (const auto first = ioc.run_one()) {
+            handlers_.add_local(first + ioc.poll());
+            after_round();
+            const auto now = std::chrono::steady_clock::now();
+            mode_ns_[IO_MODE::INTERRUPT].add_local(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+            last = now;
+        }
+    }
+
+    const io_policy policy_;
+    std::atomic<IO_MODE> mode_;
+    std::array<metrics::counter, IO_MODES> mode_ns_;
+    metrics::counter switches_;
+    metrics::counter handlers_;
+};
+
+} // namespace tcp
+} // namespace matching_engine
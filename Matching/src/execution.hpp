@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+
+namespace matching_engine
+{
+
+/* Discards every event; matching compiles down to the sink-less path */
+struct NullExecutionSink {
+    template <typename report_type>
+    void operator()(const report_type &) const noexcept {}
+};
+
+/*
+ * Preallocated single-threaded ring of execution events, drained by the caller between
+ * matches. Never allocates; events beyond capacity are counted and dropped.
+ */
+template <typename report_type, std::size_t capacity = 4096>
+class ExecutionRing
+{
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+    static_assert(std::is_trivially_copyable<report_type>::value, "reports must be POD");
+private:
+    std::array<report_type, capacity> events_;
+    std::size_t head_ = 0;
+    std::size_t tail_ = 0;
+    std::size_t dropped_ = 0;
+public:
+    void operator()(const report_type &report) noexcept
+    {
+        if (tail_ - head_ == capacity) {
+            ++dropped_;
+            return;
+        }
+        events_[tail_++ & (capacity - 1)] = report;
+    }
+    /* Hand every buffered event to the consumer in order and empty the ring */
+    template <typename consumer_type>
+    void drain(consumer_type &&consumer)
+    {
+        for (; head_ != tail_; ++head_)
+            consumer(events_[head_ & (capacity - 1)]);
+    }
+    std::size_t size() const
+    {
+        return tail_ - head_;
+    }
+    bool empty() const
+    {
+        return head_ == tail_;
+    }
+    std::size_t dropped() const
+    {
+        return dropped_;
+    }
+};
+
+} // namespace matching_engine
@@ -0,0 +1,335 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <spsc_ring.hpp>
+
+namespace matching_engine
+{
+namespace router
+{
+
+/* How an idle consumer waits for work */
+enum WAIT : uint8_t {
+    BUSY_SPIN,  /* Never leaves the core; lowest latency */
+    SPIN_YIELD, /* Spins for a while, then yields the core between polls */
+    BLOCK       /* Spins for a while, then sleeps until a producer wakes it */
+};
+
+inline std::optional<WAIT> parse_wait(const std::string_view name)
+{
+    if (name == "spin")
+        return WAIT::BUSY_SPIN;
+    if (name == "yield")
+        return WAIT::SPIN_YIELD;
+    if (name == "block")
+        return WAIT::BLOCK;
+    return std::nullopt;
+}
+
+/*
+ * Producer slot of a thread: a dense index into the rings of every ingress, handed back
+ * when the thread exits. The next new thread takes the lowest index free, and with it the
+ * rings, which it continues where the exited thread left off; the registry mutex orders
+ * its pushes after the others'. The id is never reused, so that per-thread state kept
+ * by index can tell the new owner from the old one.
+ */
+class producer_slot
+{
+public:
+    producer_slot()
+    {
+        auto &slots = registry_();
+        std::lock_guard<std::mutex> lock{slots.mutex};
+        if (slots.free.empty()) {
+            index = slots.next++;
+        } else {
+            std::pop_heap(slots.free.begin(), slots.free.end(), std::greater<std::size_t>());
+            index = slots.free.back();
+            slots.free.pop_back();
+        }
+        id = ++slots.ids;
+    }
+    producer_slot(const producer_slot &) = delete;
+    producer_slot& operator=(const producer_slot&) = delete;
+    ~producer_slot()
+    {
+        auto &slots = registry_();
+        std::lock_guard<std::mutex> lock{slots.mutex};
+        slots.free.push_back(index);
+        std::push_heap(slots.free.begin(), slots.free.end(), std::greater<std::size_t>());
+    }
+    std::size_t index;
+    uint64_t id;
+private:
+    struct registry {
+        std::mutex mutex;
+        std::vector<std::size_t> free; /* Min-heap of indices of exited threads */
+        std::size_t next = 0;
+        uint64_t ids = 0;
+    };
+    static registry &registry_()
+    {
+        static registry slots;
+        return slots;
+    }
+};
+
+/* Slot of the calling thread, taken on first use */
+inline const producer_slot &this_producer()
+{
+    thread_local const producer_slot slot;
+    return slot;
+}
+
+/* Dense index of the calling thread among the threads alive which ever pushed into an ingress */
+inline std::size_t producer_index()
+{
+    return this_producer().index;
+}
+
+/*
+ * Multi-producer ingress of one consumer built from single-producer rings, one per
+ * producer thread, so that producers never contend with each other. The consumer drains
+ * the rings round-robin, one element at a time, which keeps producers fair. Each producer
+ * also has a small priority ring which is drained ahead of all the others.
+ */
+template <typename T, std::size_t capacity = 4096, std::size_t max_producers = 256,
+          std::size_t priority_capacity = 1024>
+class ingress
+{
+public:
+    /* Polls before SPIN_YIELD and BLOCK give the core away */
+    static constexpr std::size_t spin_rounds = 1024;
+    static constexpr std::size_t max_producer_threads = max_producers;
+    static constexpr std::size_t ring_capacity = capacity;
+    explicit ingress(const WAIT wait = WAIT::BLOCK): wait_{wait} {}
+    ingress(const ingress &) = delete;
+    ingress& operator=(const ingress&) = delete;
+    ~ingress();
+    /*
+     * Producer threads; false rather than waiting if the ring of the calling thread holds
+     * `limit` elements. Without `wake` a BLOCKed consumer may sleep through the element
+     * until the next notify().
+     */
+    bool try_push(const T &value, std::size_t limit = capacity, bool wake = true);
+    /* Producer threads; popped ahead of everything pushed with try_push(). False if the priority ring is full */
+    bool try_push_priority(const T &value, bool wake = true);
+    /* Producer threads; wakes the consumer if it sleeps, e.g. once after a batch of pushes */
+    void notify();
+    /* Consumer thread; false if every ring is empty */
+    bool pop(T &value);
+    /* Consumer thread; idles according to the wait strategy after `idle` empty polls */
+    void wait(std::size_t idle);
+    /* Any thread; wakes a blocked consumer, e.g. on shutdown */
+    void wake();
+    /* Total of the ring depths */
+    std::size_t size_approx() const;
+    /* Visits (producer index, ring depth) of every producer seen so far */
+    template <typename visitor_type>
+    void for_each_ring(visitor_type &&visitor) const;
+    /* Any thread; push position of every ring of both lanes, i.e. a cut through everything pushed so far */
+    std::vector<std::size_t> positions() const;
+    /* Consumer thread; true once every element before the cut has been popped */
+    bool passed(const std::vector<std::size_t> &positions) const;
+private:
+    struct lanes {
+        SpscRing<T, capacity> normal;
+        SpscRing<T, priority_capacity> priority;
+    };
+    lanes &ring_(std::size_t producer);
+    bool pop_priority_(T &value);
+    std::array<std::atomic<lanes *>, max_producers> rings_{};
+    std::atomic<std::size_t> producers_{0}; /* Highest producer index + 1 */
+    std::atomic<std::size_t> priorities_{0}; /* Elements in the priority rings */
+    std::size_t cursor_ = 0;
+    const WAIT wait_;
+    std::atomic_bool sleeping_{false};
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+};
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+ingress<T, capacity, max_producers, priority_capacity>::~ingress()
+{
+    for (auto &ring : rings_)
+        delete ring.load(std::memory_order_relaxed);
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+typename ingress<T, capacity, max_producers, priority_capacity>::lanes &ingress<T, capacity, max_producers, priority_capacity>::ring_(const std::size_t producer)
+{
+    if (producer >= max_producers)
+        throw std::length_error("ingress: too many live producer threads");
+    /* Only the owning producer thread ever writes its slot */
+    auto ring = rings_[producer].load(std::memory_order_relaxed);
+    if (ring == nullptr) {
+        ring = new lanes;
+        rings_[producer].store(ring, std::memory_order_release);
+        auto producers = producers_.load(std::memory_order_relaxed);
+        while (producers < producer + 1
+               && !producers_.compare_exchange_weak(producers, producer + 1, std::memory_order_release));
+    }
+    return *ring;
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+void ingress<T, capacity, max_producers, priority_capacity>::notify()
+{
+    if (wait_ == WAIT::BLOCK) {
+        /* Pairs with the fence in wait(): either the consumer sees the element or we see it asleep */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed))
+            wake();
+    }
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+bool ingress<T, capacity, max_producers, priority_capacity>::try_push(const T &value, const std::size_t limit,
+        const bool wake)
+{
+    if (!ring_(producer_index()).normal.push(value, limit))
+        return false;
+    if (wake)
+        notify();
+    return true;
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+bool ingress<T, capacity, max_producers, priority_capacity>::try_push_priority(const T &value, const bool wake)
+{
+    if (!ring_(producer_index()).priority.push(value))
+        return false;
+    priorities_.fetch_add(1, std::memory_order_release);
+    if (wake)
+        notify();
+    return true;
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+bool ingress<T, capacity, max_producers, priority_capacity>::pop_priority_(T &value)
+{
+    const auto producers = producers_.load(std::memory_order_acquire);
+    for (std::size_t index = 0; index < producers; ++index) {
+        auto ring = rings_[index].load(std::memory_order_acquire);
+        if (ring == nullptr)
+            continue;
+        if (auto front = ring->priority.front()) {
+            value = *front;
+            ring->priority.pop();
+            priorities_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+bool ingress<T, capacity, max_producers, priority_capacity>::pop(T &value)
+{
+    if (priorities_.load(std::memory_order_acquire) != 0 && pop_priority_(value))
+        return true;
+    const auto producers = producers_.load(std::memory_order_acquire);
+    if (cursor_ >= producers)
+        cursor_ = 0;
+    for (std::size_t step = 0; step < producers; ++step) {
+        auto index = cursor_ + step;
+        if (index >= producers)
+            index -= producers;
+        auto ring = rings_[index].load(std::memory_order_acquire);
+        if (ring == nullptr)
+            continue;
+        if (auto front = ring->normal.front()) {
+            value = *front;
+            ring->normal.pop();
+            cursor_ = index + 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+void ingress<T, capacity, max_producers, priority_capacity>::wait(const std::size_t idle)
+{
+    if (wait_ == WAIT::BUSY_SPIN || idle < spin_rounds) {
+        __builtin_ia32_pause();
+    } else if (wait_ == WAIT::SPIN_YIELD) {
+        std::this_thread::yield();
+    } else {
+        std::unique_lock<std::mutex> lock{mutex_};
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        /* The timeout only bounds a wake() which raced with falling asleep */
+        if (size_approx() == 0)
+            wakeup_.wait_for(lock, std::chrono::milliseconds(10));
+        sleeping_.store(false, std::memory_order_relaxed);
+    }
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+void ingress<T, capacity, max_producers, priority_capacity>::wake()
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    wakeup_.notify_one();
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+std::size_t ingress<T, capacity, max_producers, priority_capacity>::size_approx() const
+{
+    std::size_t size = 0;
+    for_each_ring([&](std::size_t, const std::size_t depth) {
+        size += depth;
+    });
+    return size;
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+template <typename visitor_type>
+void ingress<T, capacity, max_producers, priority_capacity>::for_each_ring(visitor_type &&visitor) const
+{
+    const auto producers = producers_.load(std::memory_order_acquire);
+    for (std::size_t index = 0; index < producers; ++index) {
+        if (auto ring = rings_[index].load(std::memory_order_acquire))
+            visitor(index, ring->normal.size() + ring->priority.size());
+    }
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+std::vector<std::size_t> ingress<T, capacity, max_producers, priority_capacity>::positions() const
+{
+    std::vector<std::size_t> positions(2 * producers_.load(std::memory_order_acquire), 0);
+    for (std::size_t index = 0; index < positions.size() / 2; ++index) {
+        if (auto ring = rings_[index].load(std::memory_order_acquire)) {
+            positions[2 * index] = ring->normal.pushed();
+            positions[2 * index + 1] = ring->priority.pushed();
+        }
+    }
+    return positions;
+}
+
+template <typename T, std::size_t capacity, std::size_t max_producers, std::size_t priority_capacity>
+bool ingress<T, capacity, max_producers, priority_capacity>::passed(const std::vector<std::size_t> &positions) const
+{
+    for (std::size_t index = 0; index < positions.size() / 2; ++index) {
+        auto ring = rings_[index].load(std::memory_order_acquire);
+        if (ring != nullptr && (ring->normal.popped() < positions[2 * index]
+                                || ring->priority.popped() < positions[2 * index + 1]))
+            return false;
+    }
+    return true;
+}
+
+} // namespace router
+} // namespace matching_engine
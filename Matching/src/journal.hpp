@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <ingress.hpp>
+#include <metrics.hpp>
+
+namespace matching_engine
+{
+
+/*
+ * Hands records, e.g. depth deltas or execution reports, from the matching threads to a
+ * writer thread of its own, so that formatting and I/O never run on a consumer or stall
+ * it. Each producer thread gets its own ring; a record which finds it full is counted and
+ * dropped rather than waited for. Records still queued are written before destruction.
+ */
+template <typename record_type, std::size_t capacity = 1 << 14>
+class journal
+{
+public:
+    /* The writer runs on the journal's thread, which inherits the affinity of its creator */
+    explicit journal(std::function<void(const record_type &)> writer):
+        writer_{std::move(writer)}, thread_{[this] {
+            run_();
+        }} {}
+    journal(const journal &) = delete;
+    journal& operator=(const journal&) = delete;
+    ~journal()
+    {
+        stop_.store(true, std::memory_order_release);
+        thread_.join();
+    }
+    /* Producer threads; never blocks */
+    void operator()(const record_type &record)
+    {
+        if (!records_.try_push(record, capacity, false))
+            dropped_.add();
+    }
+    /* Records dropped so far because the writer was behind */
+    uint64_t dropped() const
+    {
+        return dropped_.value();
+    }
+private:
+    void run_()
+    {
+        record_type record;
+        for (;;) {
+            const auto stopping = stop_.load(std::memory_order_acquire);
+            auto written = false;
+            while (records_.pop(record)) {
+                writer_(record);
+                written = true;
+            }
+            if (stopping)
+                return;
+            if (!written)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    const std::function<void(const record_type &)> writer_;
+    router::ingress<record_type, capacity> records_;
+    metrics::counter dropped_;
+    std::atomic_bool stop_{false};
+    std::thread thread_;
+};
+
+} // namespace matching_engine
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <orderbook.hpp>
+
+namespace matching_engine
+{
+
+/*
+ * Exact decimal step such as a tick (0.00001) or lot (0.01) size: mantissa * 10^-exponent.
+ *
+ * Decimal text is converted into a whole number of steps without ever going through
+ * floating point; values which are not a multiple of the step are rejected.
+ */
+class decimal_scale
+{
+public:
+    static constexpr unsigned max_exponent = 9;
+    explicit decimal_scale(std::string_view step);
+    /* Number of steps in the decimal text */
+    std::optional<uint64_t> steps(std::string_view text) const;
+    /* Decimal value of the number of steps */
+    double value(uint64_t steps) const;
+    uint64_t mantissa() const;
+    unsigned exponent() const;
+private:
+    static constexpr std::array<uint64_t, max_exponent + 1> pow10_ = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+    template <unsigned decimals>
+    static std::optional<uint64_t> parse_(std::string_view text);
+    static std::optional<uint64_t> parse_(std::string_view text, unsigned decimals);
+    uint64_t mantissa_;
+    unsigned exponent_;
+};
+
+/* Static description of a tradable market */
+struct market_spec {
+    market_spec(std::string_view name, std::string_view tick_size, std::string_view lot_size):
+        name{name}, tick{tick_size}, lot{lot_size} {}
+    std::string_view name;
+    decimal_scale tick;
+    decimal_scale lot;
+    MarketId id = 0; /* Assigned on registration */
+    std::optional<Price> ticks(std::string_view price) const
+    {
+        return tick.steps(price);
+    }
+    std::optional<Quantity> lots(std::string_view quantity) const
+    {
+        return lot.steps(quantity);
+    }
+};
+
+decimal_scale::decimal_scale(const std::string_view step):
+    mantissa_{0}, exponent_{0}
+{
+    const auto dot = step.find('.');
+    exponent_ = dot == std::string_view::npos ? 0 : step.size() - dot - 1;
+    const auto mantissa = exponent_ <= max_exponent ? parse_(step, exponent_) : std::nullopt;
+    if (!mantissa || *mantissa == 0)
+        throw std::invalid_argument("decimal_scale: invalid step " + std::string(step));
+    mantissa_ = *mantissa;
+    /* Normalise 0.010 into 1 * 10^-2 so that the exponent stays minimal */
+    while (exponent_ > 0 && mantissa_ % 10 == 0) {
+        mantissa_ /= 10;
+        --exponent_;
+    }
+}
+
+template <unsigned decimals>
+std::optional<uint64_t> decimal_scale::parse_(const std::string_view text)
+{
+    if (text.empty())
+        return std::nullopt;
+    uint64_t value = 0;
+    std::size_t index = 0;
+    for (; index < text.size() && text[index] != '.'; ++index) {
+        const unsigned digit = text[index] - '0';
+        /* 18 significant digits always fit into 64 bits */
+        if (digit > 9 || index + decimals >= 18)
+            return std::nullopt;
+        value = value * 10 + digit;
+    }
+    unsigned fraction = 0;
+    if (index < text.size()) {
+        for (++index; index < text.size(); ++index) {
+            const unsigned digit = text[index] - '0';
+            if (digit > 9)
+                return std::nullopt;
+            if (fraction < decimals) {
+                value = value * 10 + digit;
+                ++fraction;
+            } else if (digit != 0) { /* Finer than the step */
+                return std::nullopt;
+            }
+        }
+    }
+    return value * pow10_[decimals - fraction];
+}
+
+std::optional<uint64_t> decimal_scale::parse_(const std::string_view text, const unsigned decimals)
+{
+    /* Common tick and lot sizes get a parser with the scale folded in at compile time */
+    switch (decimals) {
+    case 0: return parse_<0>(text);
+    case 1: return parse_<1>(text);
+    case 2: return parse_<2>(text);
+    case 3: return parse_<3>(text);
+    case 4: return parse_<4>(text);
+    case 5: return parse_<5>(text);
+    case 6: return parse_<6>(text);
+    case 7: return parse_<7>(text);
+    case 8: return parse_<8>(text);
+    case 9: return parse_<9>(text);
+    default: return std::nullopt;
+    }
+}
+
+std::optional<uint64_t> decimal_scale::steps(const std::string_view text) const
+{
+    const auto scaled = parse_(text, exponent_);
+    if (!scaled || mantissa_ == 1)
+        return scaled;
+    if (*scaled % mantissa_ != 0) /* Off the tick/lot grid */
+        return std::nullopt;
+    return *scaled / mantissa_;
+}
+
+double decimal_scale::value(const uint64_t steps) const
+{
+    return double(steps * mantissa_) / pow10_[exponent_];
+}
+
+uint64_t decimal_scale::mantissa() const
+{
+    return mantissa_;
+}
+
+unsigned decimal_scale::exponent() const
+{
+    return exponent_;
+}
+
+} // namespace matching_engine
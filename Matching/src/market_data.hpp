@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <boost/container/map.hpp>
+#include <orderbook.hpp>
+#include <spsc_ring.hpp>
+
+namespace matching_engine
+{
+
+/*
+ * Subscriber-side copy of a book's depth, kept up to date from the DepthDelta stream
+ * instead of periodic full copies of the book.
+ */
+class DepthMirror
+{
+public:
+    struct level {
+        Quantity quantity;
+        uint32_t count;
+    };
+    using bid_levels = boost::container::map<Price, level, std::greater<Price>>;
+    using ask_levels = boost::container::map<Price, level>;
+    /* Returns false on a sequence gap; resync() before applying further deltas */
+    bool apply(const DepthDelta &delta);
+    /* Replace the depth with a full snapshot taken at the given book sequence */
+    template <typename snapshot_type>
+    void resync(const snapshot_type &snapshot, uint64_t sequence);
+    uint64_t sequence() const;
+    const bid_levels &bids() const;
+    const ask_levels &asks() const;
+private:
+    template <typename levels_type>
+    static void update_(levels_type &levels, const DepthDelta &delta);
+    bid_levels bids_;
+    ask_levels asks_;
+    uint64_t sequence_ = 0;
+};
+
+template <typename levels_type>
+void DepthMirror::update_(levels_type &levels, const DepthDelta &delta)
+{
+    if (delta.quantity == 0)
+        levels.erase(delta.price);
+    else
+        levels[delta.price] = level{delta.quantity, delta.count};
+}
+
+bool DepthMirror::apply(const DepthDelta &delta)
+{
+    if (delta.sequence <= sequence_) /* Already part of the last snapshot */
+        return true;
+    if (delta.sequence != sequence_ + 1)
+        return false;
+    if (delta.side == SIDE::BUY)
+        update_(bids_, delta);
+    else
+        update_(asks_, delta);
+    sequence_ = delta.sequence;
+    return true;
+}
+
+template <typename snapshot_type>
+void DepthMirror::resync(const snapshot_type &snapshot, const uint64_t sequence)
+{
+    bids_.clear();
+    asks_.clear();
+    for (const auto &point : snapshot) {
+        const level depth{point.cumulative_quantity, uint32_t(point.size)};
+        if (point.side == SIDE::BUY)
+            bids_.emplace(point.price, depth);
+        else
+            asks_.emplace(point.price, depth);
+    }
+    sequence_ = sequence;
+}
+
+/*
+ * Point-in-time depth of a book for readers on other threads.
+ *
+ * The matching thread pushes every publication of deltas into a ring and then commits
+ * its sequence; readers replay committed deltas into a private mirror under a reader-side
+ * lock, so they only ever see whole publications. The matching thread never takes the
+ * lock and never waits: a publication which does not fit is deferred while the book
+ * keeps coalescing its dirty levels.
+ */
+class DepthReplica
+{
+public:
+    static constexpr std::size_t capacity = 1 << 14;
+    DepthReplica() = default;
+    DepthReplica(const DepthReplica &) = delete;
+    DepthReplica& operator=(const DepthReplica&) = delete;
+    /* Matching thread; publishes the book's deltas into the ring and to the consumer */
+    template <typename book_type, typename consumer_type>
+    bool publish(book_type &book, consumer_type &&consumer);
+    /* Any thread; replays committed deltas into the mirror */
+    void drain();
+    /* Any thread; the visitor gets a consistent DepthMirror as of its sequence() */
+    template <typename visitor_type>
+    void read(visitor_type &&visitor);
+private:
+    void drain_();
+    SpscRing<DepthDelta, capacity> deltas_;
+    std::atomic<uint64_t> committed_{0};
+    std::mutex mutex_;
+    DepthMirror mirror_;
+};
+
+template <typename book_type, typename consumer_type>
+bool DepthReplica::publish(book_type &book, consumer_type &&consumer)
+{
+    if (deltas_.free() < book.pending()) /* Readers are behind; try again later */
+        return false;
+    book.publish([&](const DepthDelta &delta) {
+        deltas_.push(delta);
+        consumer(delta);
+    });
+    committed_.store(book.sequence(), std::memory_order_release);
+    return true;
+}
+
+void DepthReplica::drain()
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    drain_();
+}
+
+template <typename visitor_type>
+void DepthReplica::read(visitor_type &&visitor)
+{
+    std::lock_guard<std::mutex> lock{mutex_};
+    drain_();
+    visitor(static_cast<const DepthMirror &>(mirror_));
+}
+
+void DepthReplica::drain_()
+{
+    const auto committed = committed_.load(std::memory_order_acquire);
+    for (auto delta = deltas_.front(); delta != nullptr && delta->sequence <= committed;
+         delta = deltas_.front()) {
+        mirror_.apply(*delta);
+        deltas_.pop();
+    }
+}
+
+uint64_t DepthMirror::sequence() const
+{
+    return sequence_;
+}
+
+const DepthMirror::bid_levels &DepthMirror::bids() const
+{
+    return bids_;
+}
+
+const DepthMirror::ask_levels &DepthMirror::asks() const
+{
+    return asks_;
+}
+
+} // namespace matching_engine
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fmt/format.h>
+#include <placement.hpp>
+
+namespace matching_engine
+{
+namespace metrics
+{
+
+/* Monotonic count; add() from any thread, add_local() only from a single owning thread */
+class counter
+{
+public:
+    void add(const uint64_t count = 1)
+    {
+        value_.fetch_add(count, std::memory_order_relaxed);
+    }
+    void add_local(const uint64_t count = 1)
+    {
+        value_.store(value_.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+    uint64_t value() const
+    {
+        return value_.load(std::memory_order_relaxed);
+    }
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+/*
+ * Log-linear histogram in the manner of HdrHistogram: values below 2^precision are exact,
+ * above that every power of two is split into 2^precision buckets, so a recorded value is
+ * off by less than 1/2^precision. Recording is a few instructions on the owning thread
+ * without any locked instruction; other threads take snapshots and diff them per interval.
+ */
+class histogram
+{
+public:
+    static constexpr unsigned precision = 4;
+    static constexpr std::size_t sub_buckets = std::size_t(1) << precision;
+    static constexpr std::size_t buckets = (64 - precision + 1) * sub_buckets;
+    struct snapshot {
+        std::array<uint64_t, buckets> counts{};
+        uint64_t count = 0;
+        /* Counts recorded since an earlier snapshot of the same histogram */
+        snapshot since(const snapshot &earlier) const;
+        /* Upper bound of the bucket holding the given quantile (0..1); 0 if empty */
+        uint64_t quantile(double quantile) const;
+        uint64_t max() const;
+    };
+    /* Owning thread only */
+    void record(uint64_t value);
+    /* Any thread; counts are read one by one, so it may miss values recorded meanwhile */
+    snapshot take() const;
+    static std::size_t bucket(uint64_t value);
+    static uint64_t highest(std::size_t bucket);
+private:
+    std::array<std::atomic<uint64_t>, buckets> counts_{};
+};
+
+std::size_t histogram::bucket(const uint64_t value)
+{
+    if (value < sub_buckets)
+        return value;
+    const unsigned magnitude = 63 - __builtin_clzll(value); /* >= precision */
+    const auto shift = magnitude - precision;
+    return (shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+}
+
+uint64_t histogram::highest(const std::size_t bucket)
+{
+    if (bucket < sub_buckets)
+        return bucket;
+    const auto shift = bucket / sub_buckets - 1;
+    const auto low = (sub_buckets + bucket % sub_buckets) << shift;
+    return low + ((uint64_t(1) << shift) - 1);
+}
+
+void histogram::record(const uint64_t value)
+{
+    auto &count = counts_[bucket(value)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+histogram::snapshot histogram::take() const
+{
+    snapshot taken;
+    for (std::size_t index = 0; index < buckets; ++index) {
+        taken.counts[index] = counts_[index].load(std::memory_order_relaxed);
+        taken.count += taken.counts[index];
+    }
+    return taken;
+}
+
+histogram::snapshot histogram::snapshot::since(const snapshot &earlier) const
+{
+    snapshot interval;
+    for (std::size_t index = 0; index < buckets; ++index) {
+        interval.counts[index] = counts[index] - earlier.counts[index];
+        interval.count += interval.counts[index];
+    }
+    return interval;
+}
+
+uint64_t histogram::snapshot::quantile(const double quantile) const
+{
+    if (count == 0)
+        return 0;
+    const auto rank = std::max<uint64_t>(1, uint64_t(quantile * count + 0.5));
+    uint64_t seen = 0;
+    for (std::size_t index = 0; index < buckets; ++index) {
+        seen += counts[index];
+        if (seen >= rank)
+            return highest(index);
+    }
+    return max();
+}
+
+uint64_t histogram::snapshot::max() const
+{
+    for (auto index = buckets; index > 0; --index) {
+        if (counts[index - 1] != 0)
+            return highest(index - 1);
+    }
+    return 0;
+}
+
+/* Appends InfluxDB line protocol: meas().tag()...field()...end() per point */
+class line_writer
+{
+public:
+    line_writer(std::string &buffer, const int64_t timestamp): buffer_{buffer}, timestamp_{timestamp} {}
+    line_writer &meas(const std::string_view measurement)
+    {
+        escape_(measurement);
+        fields_ = 0;
+        return *this;
+    }
+    line_writer &tag(const std::string_view key, const std::string_view value)
+    {
+        buffer_ += ',';
+        escape_(key);
+        buffer_ += '=';
+        escape_(value);
+        return *this;
+    }
+    line_writer &field(const std::string_view key, const uint64_t value)
+    {
+        fmt::format_to(std::back_inserter(buffer_), "{}{}={}i", separator_(), key, value);
+        return *this;
+    }
+    line_writer &field(const std::string_view key, const double value)
+    {
+        fmt::format_to(std::back_inserter(buffer_), "{}{}={}", separator_(), key, value);
+        return *this;
+    }
+    /* Histogram as <key>_count, _p50, _p90, _p99, _p999 and _max */
+    line_writer &field(const std::string_view key, const histogram::snapshot &values)
+    {
+        fmt::format_to(std::back_inserter(buffer_), "{}{}_count={}i,{}_p50={}i,{}_p90={}i,{}_p99={}i,{}_p999={}i,{}_max={}i",
+                       separator_(), key, values.count, key, values.quantile(0.5), key, values.quantile(0.9),
+                       key, values.quantile(0.99), key, values.quantile(0.999), key, values.max());
+        return *this;
+    }
+    void end()
+    {
+        fmt::format_to(std::back_inserter(buffer_), " {}\n", timestamp_);
+    }
+private:
+    char separator_()
+    {
+        return fields_++ == 0 ? ' ' : ',';
+    }
+    void escape_(const std::string_view text)
+    {
+        for (const auto ch : text) {
+            if (ch == ' ' || ch == ',' || ch == '=')
+                buffer_ += '\\';
+            buffer_ += ch;
+        }
+    }
+    std::string &buffer_;
+    const int64_t timestamp_;
+    unsigned fields_ = 0;
+};
+
+/*
+ * Collects every source on its own thread at a fixed interval and ships the points as
+ * InfluxDB line protocol in batched datagrams over one connected UDP socket. Sending never
+ * blocks; points are dropped when the socket buffer is full or the endpoint is down.
+ */
+class exporter
+{
+public:
+    using source = std::function<void(line_writer &)>;
+    /* Keeps datagrams within a typical MTU */
+    static constexpr std::size_t max_datagram = 1400;
+    /* endpoint is "host:port"; the thread runs on the given cores */
+    exporter(const std::string_view endpoint, const std::chrono::milliseconds interval,
+             std::vector<unsigned> cores = {}):
+        interval_{interval}, cores_{std::move(cores)}
+    {
+        socket_ = connect_(endpoint);
+        thread_ = std::thread([this] {
+            run_();
+        });
+    }
+    exporter(const exporter &) = delete;
+    exporter& operator=(const exporter&) = delete;
+    ~exporter()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            should_exit_ = true;
+        }
+        wakeup_.notify_one();
+        thread_.join();
+        if (socket_ >= 0)
+            close(socket_);
+    }
+    /* False if the endpoint did not resolve; points are then only counted */
+    bool connected() const
+    {
+        return socket_ >= 0;
+    }
+    void add(source collect)
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        sources_.push_back(std::move(collect));
+    }
+    /* Datagrams which could not be sent */
+    uint64_t dropped() const
+    {
+        return dropped_.value();
+    }
+private:
+    static int connect_(const std::string_view endpoint)
+    {
+        const auto colon = endpoint.rfind(':');
+        if (colon == std::string_view::npos)
+            return -1;
+        const std::string host{endpoint.substr(0, colon)};
+        const std::string port{endpoint.substr(colon + 1)};
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        addrinfo *addresses = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+            return -1;
+        int fd = -1;
+        for (auto address = addresses; address != nullptr && fd < 0; address = address->ai_next) {
+            fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+            if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        return fd;
+    }
+    void run_()
+    {
+        if (!cores_.empty())
+            pin_thread(cores_);
+        std::string buffer;
+        std::unique_lock<std::mutex> lock{mutex_};
+        while (!wakeup_.wait_for(lock, interval_, [this] { return should_exit_; })) {
+            buffer.clear();
+            const auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::system_clock::now().time_since_epoch()).count();
+            line_writer writer{buffer, now};
+            for (const auto &collect : sources_)
+                collect(writer);
+            send_(buffer);
+        }
+    }
+    /* Cuts the batch at line boundaries into datagrams */
+    void send_(const std::string_view batch)
+    {
+        for (std::size_t first = 0; first < batch.size();) {
+            auto last = std::min(batch.size(), first + max_datagram);
+            if (last < batch.size()) {
+                const auto line_end = batch.rfind('\n', last - 1);
+                last = line_end != std::string_view::npos && line_end >= first ? line_end + 1 : last;
+            }
+            if (socket_ < 0 || ::send(socket_, batch.data() + first, last - first, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+                dropped_.add();
+            first = last;
+        }
+    }
+    const std::chrono::milliseconds interval_;
+    const std::vector<unsigned> cores_;
+    int socket_ = -1;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    bool should_exit_ = false;
+    std::vector<source> sources_;
+    counter dropped_;
+    std::thread thread_;
+};
+
+} // namespace metrics
+} // namespace matching_engine
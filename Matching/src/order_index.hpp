@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace matching_engine
+{
+
+/*
+ * Open-addressing id -> value table with linear probing; a lookup usually touches one
+ * cache line. Sequential ids are scattered by Fibonacci hashing, otherwise runs of
+ * consecutive ids merge into long probe clusters.
+ * Id 0 marks an empty slot and is never handed out by the sequence.
+ */
+template <typename Value>
+class OrderIndex
+{
+private:
+    struct entry {
+        uint64_t id;
+        Value value;
+    };
+    std::vector<entry> entries_;
+    std::size_t mask_;
+    unsigned shift_;
+    std::size_t size_;
+    std::size_t home_(uint64_t id) const
+    {
+        return (id * UINT64_C(0x9E3779B97F4A7C15)) >> shift_;
+    }
+    void grow_();
+    static std::size_t round_up_(std::size_t capacity)
+    {
+        std::size_t size = 16;
+        while (size < capacity)
+            size <<= 1;
+        return size;
+    }
+public:
+    explicit OrderIndex(const std::size_t capacity = 1 << 16):
+        entries_(round_up_(capacity)), mask_{entries_.size() - 1},
+        shift_{64u - __builtin_ctzll(entries_.size())}, size_{0} {}
+    OrderIndex(const OrderIndex &) = delete;
+    OrderIndex& operator=(const OrderIndex&) = delete;
+    Value *find(uint64_t id);
+    const Value *find(uint64_t id) const;
+    void insert(uint64_t id, const Value &value);
+    bool erase(uint64_t id);
+    /* Pull the home slot of the id into cache ahead of an insert or erase */
+    void prefetch(uint64_t id) const;
+    std::size_t size() const;
+};
+
+template <typename Value>
+Value *OrderIndex<Value>::find(const uint64_t id)
+{
+    for (auto slot = home_(id);; slot = (slot + 1) & mask_) {
+        auto &entry = entries_[slot];
+        if (entry.id == id)
+            return &entry.value;
+        if (entry.id == 0)
+            return nullptr;
+    }
+}
+
+template <typename Value>
+const Value *OrderIndex<Value>::find(const uint64_t id) const
+{
+    return const_cast<OrderIndex *>(this)->find(id);
+}
+
+template <typename Value>
+void OrderIndex<Value>::insert(const uint64_t id, const Value &value)
+{
+    /* Keep the load under one half so that probe sequences stay short */
+    if ((size_ + 1) * 2 > entries_.size())
+        grow_();
+    auto slot = home_(id);
+    for (; entries_[slot].id != 0 && entries_[slot].id != id; slot = (slot + 1) & mask_);
+    if (entries_[slot].id == 0)
+        ++size_;
+    entries_[slot] = {id, value};
+}
+
+template <typename Value>
+bool OrderIndex<Value>::erase(const uint64_t id)
+{
+    auto slot = home_(id);
+    for (; entries_[slot].id != id; slot = (slot + 1) & mask_) {
+        if (entries_[slot].id == 0)
+            return false;
+    }
+    /* Backward-shift deletion; no tombstones */
+    for (auto next = (slot + 1) & mask_; entries_[next].id != 0; next = (next + 1) & mask_) {
+        const auto home = home_(entries_[next].id);
+        const auto displaced = slot <= next
+                               ? (home <= slot || home > next)
+                               : (home <= slot && home > next);
+        if (displaced) {
+            entries_[slot] = entries_[next];
+            slot = next;
+        }
+    }
+    entries_[slot].id = 0;
+    --size_;
+    return true;
+}
+
+template <typename Value>
+void OrderIndex<Value>::prefetch(const uint64_t id) const
+{
+    __builtin_prefetch(&entries_[home_(id)], 1);
+}
+
+template <typename Value>
+std::size_t OrderIndex<Value>::size() const
+{
+    return size_;
+}
+
+template <typename Value>
+void OrderIndex<Value>::grow_()
+{
+    std::vector<entry> entries(entries_.size() * 2);
+    entries.swap(entries_);
+    mask_ = entries_.size() - 1;
+    shift_ = 64u - __builtin_ctzll(entries_.size());
+    size_ = 0;
+    for (const auto &entry : entries) {
+        if (entry.id != 0)
+            insert(entry.id, entry.value);
+    }
+}
+
+} // namespace matching_engine
@@ -1,143 +1,1016 @@
 #pragma once
 
 #include <orderbook.hpp>
-#include "influxdb.hpp"
+#include <market.hpp>
+#include <market_data.hpp>
+#include <ingress.hpp>
+#include <placement.hpp>
+#include <deque>
+#include <future>
+#include <condition_variable>
+#include <unordered_map>
+#include <functional>
+#include <metrics.hpp>
+#include <trace.hpp>
 #include "spdlog/spdlog.h"
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <linux/membarrier.h>
 #include <pthread.h>
 #include <map>
 #include <boost/asio.hpp>
 #include <boost/asio/thread_pool.hpp>
-#include <tbb/concurrent_queue.h>
-#include <moodycamel/blockingconcurrentqueue.h>
+#include <boost/container/small_vector.hpp>
 
 
 namespace matching_engine
 {
 namespace router
 {
+enum COMMAND : uint8_t { NEW, CANCEL, AMEND, RESYNC };
+
+/* Unit of work for a consumer; CANCEL and AMEND refer to a resting order by id */
+struct command {
+    COMMAND type;
+    SIDE side;
+    MarketId market;
+    OrderId id;
+    Price price;
+    Quantity quantity;
+    trace::origin origin; /* Transport stamps if traced */
+};
+
+/*
+ * Market data of the books, called on their consumer thread. Deltas of a market are
+ * handed out in sequence; a snapshot is sent on request (see dispatcher::resync).
+ * Execution reports are handed out as the book produces them; without `execution` the
+ * books match without recording them.
+ */
+struct depth_feed {
+    std::function<void(MarketId, const DepthDelta &)> delta;
+    std::function<void(MarketId, const std::vector<OrderBook::snapshot_point> &, uint64_t)> snapshot;
+    std::function<void(const ExecutionReport &)> execution;
+};
+
+/* Book of one market together with its replica for readers on other threads */
+struct market_book {
+    explicit market_book(const std::string_view name): book{name} {}
+    OrderBook book;
+    DepthReplica depth;
+    /* Load counters; written by the owning consumer only */
+    metrics::counter commands;
+    metrics::counter busy_ns;
+};
+
+class consumer;
+
+/* Ownership of a book on its way between consumers; see dispatcher::migrate */
+struct handoff {
+    MarketId market;
+    consumer *target;
+    std::vector<std::size_t> positions; /* Cut through the source ingress after which the market gets no commands */
+    std::unique_ptr<market_book> state; /* Set once the source let go of the book */
+    std::vector<OrderId> early_cancels; /* Of the market, still waiting for their orders at the source */
+    std::promise<void> done;
+};
+
 class consumer
 {
-    using ms = std::chrono::milliseconds;
     using ns = std::chrono::nanoseconds;
 public:
-    consumer(std::shared_ptr<spdlog::logger> console):
-        should_exit_{false}, console_(console) {}
+    /* Pending deltas are coalesced, and admission rechecked, every this many commands while the queue is busy */
+    static constexpr unsigned publish_interval = 64;
+    /* Queued commands at which new orders are refused */
+    static constexpr std::size_t default_admission_limit = 4096;
+    struct admission_stats {
+        uint64_t shed;            /* New orders, amends and cancels refused so far */
+        std::size_t backlog;      /* Commands queued now */
+        std::size_t peak_backlog; /* Highest backlog seen */
+        bool saturated;           /* Refusing new orders */
+    };
+    consumer(std::shared_ptr<spdlog::logger> console, depth_feed feed = {}, const WAIT wait = WAIT::BLOCK,
+             const std::size_t admission_limit = default_admission_limit, trace::tracer *tracer = nullptr):
+        ingress_{wait}, should_exit_{false}, console_(console), feed_{std::move(feed)},
+        admission_limit_{admission_limit}, tracer_{tracer} {}
     consumer(const consumer&) = delete;
     consumer() = delete;
     void shutdown()
     {
         should_exit_ = true;
+        ingress_.wake();
+    }
+    /*
+     * Any producer thread; each gets its own ring and never waits for it. Cancels jump the
+     * queue and are taken unless the calling thread's priority ring is full; new orders and
+     * amends are refused while the consumer is saturated, or while the calling thread alone
+     * has the admission limit queued (until the consumer gets to run and notices, this
+     * bounds the backlog). Without `wake`, call notify() after a batch.
+     */
+    bool push(const command &task, const bool wake = true)
+    {
+        switch (task.type) {
+        case COMMAND::CANCEL:
+            if (ingress_.try_push_priority(task, wake))
+                return true;
+            shed_.add();
+            return false;
+        case COMMAND::RESYNC:
+            return ingress_.try_push(task, ingress<command>::ring_capacity, wake);
+        default:
+            if (!saturated_.load(std::memory_order_relaxed) && ingress_.try_push(task, admission_limit_, wake))
+                return true;
+            shed_.add();
+            return false;
+        }
+    }
+    void notify()
+    {
+        ingress_.notify();
+    }
+    admission_stats admission() const
+    {
+        return {shed_.value(), ingress_.size_approx(),
+                peak_backlog_.load(std::memory_order_relaxed), saturated_.load(std::memory_order_relaxed)};
+    }
+    /* Commands waiting in all rings */
+    std::size_t size_approx() const
+    {
+        return ingress_.size_approx();
     }
-    void push(OrderPtr order)
+    /* Visits (producer index, ring depth) */
+    template <typename visitor_type>
+    void for_each_ring(visitor_type &&visitor) const
     {
-        queue_.enqueue(std::move(order));
+        ingress_.for_each_ring(std::forward<visitor_type>(visitor));
     }
-    void register_market(std::string_view market)
+    /* Cut through everything pushed so far; see ingress::positions */
+    std::vector<std::size_t> positions() const
     {
-        markets.emplace(market, market);
+        return ingress_.positions();
+    }
+    /* Call from the consumer's own thread, so that the book is first touched on its NUMA node */
+    market_book &register_market(const market_spec &market)
+    {
+        return adopt_(market.id, std::make_unique<market_book>(market.name));
+    }
+    /* Any thread; registers the market on the consumer's own thread once it picks up its mail */
+    std::future<market_book *> add(const market_spec &market)
+    {
+        auto registered = std::make_shared<std::promise<market_book *>>();
+        post_([this, market, registered] {
+            registered->set_value(&register_market(market));
+        });
+        return registered->get_future();
+    }
+    /* Any thread; the book is passed on to the target once the ingress is past transfer.positions */
+    void release(handoff transfer)
+    {
+        auto leaving = std::make_shared<handoff>(std::move(transfer));
+        post_([this, leaving] {
+            leaving_.push_back(std::move(*leaving));
+        });
     }
     void listen()
     {
         if (console_ != nullptr) {
-            for (const auto& [name, _] : markets) {
-                console_->info("Consumer of {} started @{}", name, (pid_t) syscall (SYS_gettid));
+            const auto core = sched_getcpu();
+            for (const auto market : owned_) {
+                console_->info("Consumer of {} started @{} on core {} (NUMA node {})", markets[market]->book.market_name(),
+                               (pid_t) syscall (SYS_gettid), core, core < 0 ? -1 : numa_node(core));
             }
         }
-        OrderPtr order;
-        auto last_log = Time::now();
+        command task{};
+        unsigned unpublished = 0;
+        std::size_t idle = 0;
         while(should_consume_()) {
-            queue_.wait_dequeue(order);
-            auto &ob = markets.at(order->market_name());
-            const auto start = Time::now();
-            ob.match(std::move(order));
-            auto elapsed = Time::now() - start;
-            /* Post consumer stats */
-            if (std::chrono::duration_cast<ms>(start.time_since_epoch()).count()
-                - std::chrono::duration_cast<ms>(last_log.time_since_epoch()).count() >= 250) {
-                std::async(std::launch::async,[&,market=ob.market_name(),elapsed] {
-                    /* NOTE Does it actually make sense to use async here?*/
-                    influxdb_cpp::builder()
-                    .meas("order_matcher")
-                    .tag("market", market.data())
-                    .field("execution_duration", std::chrono::duration_cast<ns>(elapsed).count())
-                    .field("consumer_queue_length", static_cast<long>(queue_.size_approx()))
-                    .timestamp(std::chrono::duration_cast<ns>(Time::now().time_since_epoch()).count())
-                    .send_udp("172.17.0.1", 8089);
-                });
-                last_log = start;
+            if (mail_.load(std::memory_order_acquire))
+                collect_mail_();
+            if (!leaving_.empty())
+                hand_off_();
+            if (!ingress_.pop(task)) {
+                if (unpublished != 0) {
+                    /* Drained; publish at once, and the backlog is known without walking the rings */
+                    admit_(0);
+                    publish_();
+                    expire_cancels_();
+                    unpublished = 0;
+                }
+                ingress_.wait(idle++);
+                continue;
             }
-
+            const auto dequeued = trace::clock::now();
+            idle = 0;
+            if (task.market >= markets.size() || markets[task.market] == nullptr) {
+                /* The market is on its way from another consumer; keep its commands in order until it arrives */
+                parked_[task.market].push_back(task);
+                continue;
+            }
+            auto &market = *markets[task.market];
+            const auto start = trace::clock::now();
+            execute_(market, task);
+            const auto executed = trace::clock::now();
+            if (++unpublished == publish_interval) {
+                /* Sums the rings of every producer, so only once per interval */
+                admit_(ingress_.size_approx());
+                publish_();
+                expire_cancels_();
+                unpublished = 0;
+            }
+            if (tracer_ != nullptr && task.origin.enqueued != 0)
+                tracer_->record_stages(task.id, task.market, task.type, {task.origin.read, task.origin.parsed,
+                                       task.origin.enqueued, dequeued, start, executed, 0});
+            const auto elapsed = trace::clock::ns(trace::clock::now() - start);
+            market.commands.add_local();
+            market.busy_ns.add_local(elapsed);
+            commands_.add_local();
+            execution_ns_.record(elapsed);
         }
     }
+    /* Exporter thread; one point per consumer, latencies over the interval since the last call */
+    void report(metrics::line_writer &out, const std::size_t index)
+    {
+        std::size_t deepest_ring = 0;
+        ingress_.for_each_ring([&](std::size_t, const std::size_t depth) {
+            deepest_ring = std::max(deepest_ring, depth);
+        });
+        const auto execution_ns = execution_ns_.take();
+        out.meas("order_matcher")
+        .tag("consumer", std::to_string(index))
+        .field("commands", commands_.value())
+        .field("shed", shed_.value())
+        .field("queue_length", uint64_t(ingress_.size_approx()))
+        .field("max_ring_length", uint64_t(deepest_ring))
+        .field("queue_high_watermark", uint64_t(high_watermark_.exchange(0, std::memory_order_relaxed)))
+        .field("execution_ns", execution_ns.since(reported_execution_ns_))
+        .end();
+        reported_execution_ns_ = execution_ns;
+    }
 private:
     bool should_consume_() const
     {
-        return !should_exit_ or queue_.size_approx() > 0;
+        return !should_exit_ or ingress_.size_approx() > 0;
+    }
+    void execute_(market_book &market, const command &task)
+    {
+        /* Reports go out as they happen, so that a sweep of any number of makers loses none */
+        if (feed_.execution)
+            execute_(market, task, feed_.execution);
+        else
+            execute_(market, task, NullExecutionSink{});
+    }
+    template <typename sink_type>
+    void execute_(market_book &market, const command &task, sink_type &&sink)
+    {
+        auto &ob = market.book;
+        switch (task.type) {
+        case COMMAND::NEW:
+            if (cancelled_early_(task.id))
+                sink(ExecutionReport{EXECUTION::CANCEL_ACK, task.side, task.market, task.id, 0,
+                                     task.price, task.quantity, 0, 0});
+            else
+                ob.match(Order{task.market, task.side, task.price, task.quantity, task.id}, OrderInfo{}, sink);
+            break;
+        case COMMAND::CANCEL:
+            if (!ob.cancel(task.id, sink))
+                early_cancels_.emplace(task.id, task.market);
+            break;
+        case COMMAND::AMEND:
+            ob.amend(task.id, task.price, task.quantity, sink);
+            break;
+        case COMMAND::RESYNC:
+            publish_();
+            if (feed_.snapshot)
+                feed_.snapshot(task.market, ob.snapshot(OrderBook::full_depth), ob.sequence());
+            break;
+        }
+    }
+    /* Saturates at the admission limit and recovers at half of it, so that admission does not flap */
+    void admit_(const std::size_t backlog)
+    {
+        if (backlog > high_watermark_.load(std::memory_order_relaxed))
+            high_watermark_.store(backlog, std::memory_order_relaxed);
+        if (backlog > peak_backlog_.load(std::memory_order_relaxed))
+            peak_backlog_.store(backlog, std::memory_order_relaxed);
+        const auto saturated = saturated_.load(std::memory_order_relaxed);
+        if (!saturated && backlog >= admission_limit_)
+            saturated_.store(true, std::memory_order_relaxed);
+        else if (saturated && backlog <= admission_limit_ / 2)
+            saturated_.store(false, std::memory_order_relaxed);
     }
-    std::unordered_map<std::string_view, OrderBook> markets;
-    moodycamel::BlockingConcurrentQueue<OrderPtr> queue_;
+    /* True if a cancel which found no order overtook this one on the priority lane */
+    bool cancelled_early_(const OrderId id)
+    {
+        if (early_cancels_.empty() && expiring_cancels_.empty())
+            return false;
+        return early_cancels_.erase(id) != 0 || expiring_cancels_.erase(id) != 0;
+    }
+    /*
+     * A cancel which found no order is kept until the rings have passed a cut taken after
+     * it: by then its order has either arrived or was never queued (e.g. already filled),
+     * and the cancel is rejected; its side, price and quantity are not known.
+     */
+    void expire_cancels_()
+    {
+        if (!expiring_cancels_.empty()) {
+            if (!ingress_.passed(expiry_))
+                return;
+            if (feed_.execution) {
+                for (const auto &cancel : expiring_cancels_)
+                    feed_.execution(ExecutionReport{EXECUTION::CANCEL_REJECT, SIDE::BUY, cancel.second,
+                                                    cancel.first, 0, 0, 0, 0, 0});
+            }
+            expiring_cancels_.clear();
+        }
+        if (!early_cancels_.empty()) {
+            expiring_cancels_.swap(early_cancels_);
+            expiry_ = ingress_.positions();
+        }
+    }
+    void publish_()
+    {
+        for (const auto market : owned_) {
+            auto &state = *markets[market];
+            state.depth.publish(state.book, [&, market](const DepthDelta &delta) {
+                if (feed_.delta)
+                    feed_.delta(market, delta);
+            });
+        }
+    }
+    market_book &adopt_(const MarketId id, std::unique_ptr<market_book> state)
+    {
+        if (id >= markets.size())
+            markets.resize(id + 1);
+        markets[id] = std::move(state);
+        owned_.push_back(id);
+        return *markets[id];
+    }
+    /* Any thread; the task runs on the consumer's own thread between two commands */
+    void post_(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock{mail_mutex_};
+            mailbox_.push_back(std::move(task));
+            mail_.store(true, std::memory_order_release);
+        }
+        ingress_.wake();
+    }
+    void collect_mail_()
+    {
+        std::vector<std::function<void()>> mail;
+        {
+            std::lock_guard<std::mutex> lock{mail_mutex_};
+            mail.swap(mailbox_);
+            mail_.store(false, std::memory_order_relaxed);
+        }
+        for (auto &task : mail)
+            task();
+    }
+    /* Takes over a book released by another consumer and replays what was parked meanwhile */
+    void arrive_(handoff &transfer)
+    {
+        auto &market = adopt_(transfer.market, std::move(transfer.state));
+        /* The orders of cancels which overtook them may be among the parked commands, or still to come */
+        for (const auto id : transfer.early_cancels)
+            early_cancels_.emplace(id, transfer.market);
+        auto parked = parked_.find(transfer.market);
+        if (parked != parked_.end()) {
+            for (const auto &task : parked->second)
+                execute_(market, task);
+            parked_.erase(parked);
+            publish_();
+        }
+        transfer.done.set_value();
+    }
+    /* Passes on the books whose last commands have been worked off */
+    void hand_off_()
+    {
+        for (auto transfer = leaving_.begin(); transfer != leaving_.end();) {
+            if (!ingress_.passed(transfer->positions)) {
+                ++transfer;
+                continue;
+            }
+            publish_();
+            transfer->state = std::move(markets[transfer->market]);
+            take_cancels_(transfer->market, early_cancels_, transfer->early_cancels);
+            take_cancels_(transfer->market, expiring_cancels_, transfer->early_cancels);
+            owned_.erase(std::find(owned_.begin(), owned_.end(), transfer->market));
+            auto arriving = std::make_shared<handoff>(std::move(*transfer));
+            arriving->target->post_([target = arriving->target, arriving] {
+                target->arrive_(*arriving);
+            });
+            transfer = leaving_.erase(transfer);
+        }
+    }
+    /* Moves the early cancels of a market which is leaving */
+    static void take_cancels_(const MarketId market, std::unordered_map<OrderId, MarketId> &cancels,
+                              std::vector<OrderId> &taken)
+    {
+        for (auto cancel = cancels.begin(); cancel != cancels.end();) {
+            if (cancel->second != market) {
+                ++cancel;
+                continue;
+            }
+            taken.push_back(cancel->first);
+            cancel = cancels.erase(cancel);
+        }
+    }
+    std::vector<std::unique_ptr<market_book>> markets; /* By market id; empty where owned by another consumer */
+    std::vector<MarketId> owned_;
+    ingress<command> ingress_;
     std::atomic_bool should_exit_;
     std::shared_ptr<spdlog::logger> console_;
+    depth_feed feed_;
+    /* Admission control */
+    const std::size_t admission_limit_;
+    std::atomic_bool saturated_{false};
+    metrics::counter shed_;
+    std::atomic<std::size_t> peak_backlog_{0};
+    std::atomic<std::size_t> high_watermark_{0}; /* Since the last report */
+    /* Metrics */
+    metrics::counter commands_;
+    metrics::histogram execution_ns_;                     /* Per command, including publication */
+    metrics::histogram::snapshot reported_execution_ns_; /* Exporter thread */
+    trace::tracer *tracer_;
+    std::unordered_map<OrderId, MarketId> early_cancels_; /* Cancels which found no order, by the order's id */
+    std::unordered_map<OrderId, MarketId> expiring_cancels_;
+    std::vector<std::size_t> expiry_;
+    /* Market migration */
+    std::atomic_bool mail_{false};
+    std::mutex mail_mutex_;
+    std::vector<std::function<void()>> mailbox_;
+    std::vector<handoff> leaving_;
+    std::unordered_map<MarketId, std::vector<command>> parked_;
 };
 
 class dispatcher
 {
 public:
+    /* Load of a market over the last rebalance interval */
+    struct market_load {
+        double orders_per_second;
+        double busy;             /* Fraction of a core spent on its commands */
+        std::size_t queue_depth; /* Commands queued ahead of its consumer */
+    };
+    static constexpr std::chrono::milliseconds rebalance_interval{1000};
+    /* Gap in busy fraction between the busiest and the idlest consumer which moves a market */
+    static constexpr double rebalance_threshold = 0.2;
+    /* Capacity of the routing table, which never moves so that it can grow under producers */
+    static constexpr std::size_t max_markets = 1024;
     dispatcher() = default;
     dispatcher(const dispatcher&) = delete;
-    dispatcher(std::vector<std::string_view> markets,
+    dispatcher(std::vector<market_spec> markets,
                std::shared_ptr<spdlog::logger> console = nullptr,
-               const uint64_t available_cores = std::max(1u, std::thread::hardware_concurrency() - 1)):
-        pool_{available_cores},
-        console_{console}
+               const depth_feed &feed = {},
+               const WAIT wait = WAIT::BLOCK,
+               const thread_placement &placement = default_placement(),
+               const std::size_t admission_limit = consumer::default_admission_limit,
+               std::shared_ptr<trace::tracer> tracer = nullptr):
+        pool_{placement.consumer_cores.size()},
+        console_{console}, tracer_{std::move(tracer)}
     {
+        const auto available_cores = placement.consumer_cores.size();
+        /* Intern market names into dense ids */
+        for (auto& market : markets) {
+            if (specs_.size() == max_markets)
+                throw std::length_error("dispatcher: too many markets");
+            market = intern_(market);
+        }
         const auto markets_per_core = uint64_t(markets.size() / available_cores);
         auto reminder = markets.size() % available_cores;
-        std::vector<std::shared_ptr<consumer>> consumer_pool;
+        std::vector<std::future<void>> started;
         for (unsigned int core = 0; core < available_cores; core++) {
-            consumer_pool.emplace_back(std::make_shared<consumer>(console_));
-            auto& market_consumer = consumer_pool.back();
+            auto market_consumer = consumers_.emplace_back(std::make_shared<consumer>(console_, feed, wait, admission_limit,
+                                      tracer_.get()));
+            std::vector<market_spec> assigned;
             if (reminder > 0) {
-                auto market = markets.back();
-                market_registry_[market] = market_consumer;
-                market_consumer->register_market(market);
+                assigned.push_back(markets.back());
                 markets.pop_back();
                 --reminder;
             }
             /* Costruct consumer for N markets distributed evenly across logical cores */
             for (auto index = markets_per_core; index > 0; --index) {
-                auto market = markets.back();
-                market_registry_[market] = market_consumer;
-                market_consumer->register_market(market);
+                assigned.push_back(markets.back());
                 markets.pop_back();
             }
+            /* Pin first, then build the books on that thread; routes are ready once it reports back */
+            auto ready = std::make_shared<std::promise<void>>();
+            started.push_back(ready->get_future());
+            boost::asio::post(pool_, [this, market_consumer, assigned, ready, core = placement.consumer_cores[core]] {
+                if (!pin_thread(core) && console_ != nullptr)
+                    console_->warn("dispatcher: failed to pin consumer to core {}", core);
+                for (const auto& market : assigned)
+                    bind_(market.id, market_consumer.get(), market_consumer->register_market(market));
+                ready->set_value();
+                market_consumer->listen();
+            });
+        }
+        for (auto& consumer_started : started)
+            consumer_started.wait();
+        names_index_ = std::make_unique<name_index>();
+        for (const auto &spec : specs_)
+            names_index_->emplace(spec.name, spec.id);
+        market_ids_.store(names_index_.get(), std::memory_order_release);
+        market_count_.store(specs_.size(), std::memory_order_release);
+        barrier_ = barrier_command_();
+        if (barrier_ == 0 && console_ != nullptr)
+            console_->warn("dispatcher: membarrier(2) is unavailable, markets stay on their consumers");
+        /* Keeps replicas current, so that matching never defers publications for long, and rebalances */
+        boost::asio::post(replica_pool_, [this, cores = placement.service_cores] {
+            pin_thread(cores);
+            auto last_sample = Time::now();
+            while (!should_exit_) {
+                const auto markets = market_count_.load(std::memory_order_acquire);
+                for (MarketId market = 0; market < markets; ++market)
+                    routes_[market].state->depth.drain();
+                const auto now = Time::now();
+                if (now - last_sample >= rebalance_interval) {
+                    rebalance_(std::chrono::duration<double>(now - last_sample).count());
+                    last_sample = now;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+    /*
+     * False if the market's consumer is overloaded and refused the order. A traced command
+     * comes with the stamps of the transport, to which ENQUEUED is added; see tracer().
+     */
+    bool send(OrderPtr order, trace::origin *origin = nullptr)
+    {
+        return send(order->market(), order->side(), order->price(), order->quantity(), order->id(), origin);
+    }
+    /* As above, for a transport which does not build the order; id from next_order_id() */
+    bool send(const MarketId market, const SIDE side, const Price price, const Quantity quantity, const OrderId id,
+              trace::origin *origin = nullptr)
+    {
+        return dispatch_({COMMAND::NEW, side, market, id, price, quantity, {}}, origin);
+    }
+    /* False if the consumer has too many cancels of the calling thread queued */
+    bool cancel(const MarketId market, const OrderId id, trace::origin *origin = nullptr)
+    {
+        return dispatch_({COMMAND::CANCEL, SIDE::BUY, market, id, 0, 0, {}}, origin);
+    }
+    /* Ask for a full snapshot of the market on the depth feed, e.g. after a sequence gap; false if refused */
+    bool resync(const MarketId market)
+    {
+        return dispatch_({COMMAND::RESYNC, SIDE::BUY, market, 0, 0, 0, {}});
+    }
+    /* New limit price and total quantity of a resting order; see OrderBook::amend. False if refused like send() */
+    bool amend(const MarketId market, const OrderId id, const Price price, const Quantity quantity,
+               trace::origin *origin = nullptr)
+    {
+        return dispatch_({COMMAND::AMEND, SIDE::BUY, market, id, price, quantity, {}}, origin);
+    }
+    /* Any command; false if refused like send() */
+    bool dispatch(const command &task, trace::origin *origin = nullptr)
+    {
+        return dispatch_(task, origin);
+    }
+    /*
+     * Many commands in one pass, e.g. of a batch request, notifying each consumer once.
+     * admitted gets whether each was taken, as send() would return; false for unknown markets.
+     * Traced commands carry their transport stamps, to which ENQUEUED is added.
+     */
+    void dispatch(const std::vector<command> &tasks, std::vector<bool> &admitted)
+    {
+        admitted.assign(tasks.size(), false);
+        boost::container::small_vector<consumer *, 8> notified;
+        auto &producer = producer_();
+        auto &dispatches = producer.dispatches;
+        const auto count = dispatches.load(std::memory_order_relaxed);
+        dispatches.store(count + 1, std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        const auto markets = market_count_.load(std::memory_order_acquire);
+        for (std::size_t index = 0; index < tasks.size(); ++index) {
+            auto task = tasks[index];
+            if (task.market >= markets)
+                continue;
+            if (task.origin.read != 0)
+                task.origin.enqueued = trace::clock::now();
+            const auto target = routes_[task.market].market_consumer.load(std::memory_order_acquire);
+            admitted[index] = target->push(task, false);
+            if (std::find(notified.begin(), notified.end(), target) == notified.end())
+                notified.push_back(target);
         }
-        for (auto& c : consumer_pool) {
-            boost::asio::post(pool_, std::bind(&consumer::listen, c));
+        dispatches.store(count + 2, std::memory_order_release);
+        for (const auto target : notified) {
+            if (producer.deferred)
+                unwoken_(producer, target);
+            else
+                target->notify();
         }
     }
-    void send(OrderPtr order)
+    /*
+     * For transport threads which run handlers in rounds, e.g. of an event loop: from now on
+     * the commands of the calling thread do not wake their consumers one by one, flush() does,
+     * once per round. Together with its own ring into each consumer, the thread then shares
+     * nothing with other producers on the way to matching.
+     */
+    void defer_wakeups()
+    {
+        producer_().deferred = true;
+    }
+    /* Wakes the consumers the calling thread pushed to since its last flush(); call at the end of every round */
+    void flush()
+    {
+        auto &producer = producer_();
+        for (const auto target : producer.unwoken)
+            target->notify();
+        producer.unwoken.clear();
+    }
+    /* Stage tracing, or nullptr if commands are not traced */
+    trace::tracer *tracer() const
+    {
+        return tracer_.get();
+    }
+    /*
+     * Consistent full depth of a market as of the last publication; safe from any thread.
+     * The visitor gets a DepthMirror; matching is never stalled by it.
+     */
+    template <typename visitor_type>
+    void depth(const MarketId market, visitor_type &&visitor) const
+    {
+        route_(market).state->depth.read(std::forward<visitor_type>(visitor));
+    }
+    /* Commands queued ahead of the market's consumer over all producer rings */
+    std::size_t ingress_depth(const MarketId market) const
+    {
+        return route_(market).market_consumer.load(std::memory_order_acquire)->size_approx();
+    }
+    /* Latest top of book; lock-free and safe from any thread */
+    TopOfBook top_of_book(const MarketId market) const
     {
-        auto& market_consumer = market_registry_.at(order->market_name());
-        market_consumer->push(std::move(order));
+        return route_(market).state->book.top_of_book().load();
     }
-    std::string_view registered_market_name(const std::string_view market) const
+    /* Admission counters of the consumer which currently runs the market */
+    consumer::admission_stats admission(const MarketId market) const
     {
-        return market_registry_.find(market)->first;
+        return route_(market).market_consumer.load(std::memory_order_acquire)->admission();
+    }
+    /* Exporter thread; a point per consumer, per market and per traced stage */
+    void report(metrics::line_writer &out) const
+    {
+        if (tracer_ != nullptr)
+            tracer_->report(out);
+        for (std::size_t index = 0; index < consumers_.size(); ++index)
+            consumers_[index]->report(out, index);
+        const auto markets = market_count_.load(std::memory_order_acquire);
+        std::lock_guard<std::mutex> lock{loads_mutex_};
+        for (MarketId market = 0; market < markets; ++market) {
+            const auto &route = routes_[market];
+            out.meas("market")
+            .tag("market", route.spec->name)
+            .field("commands", route.state->commands.value())
+            .field("busy_ns", route.state->busy_ns.value())
+            .field("orders_per_second", route.load.orders_per_second)
+            .field("busy", route.load.busy)
+            .end();
+        }
+    }
+    /* Load of the market as of the last rebalance interval */
+    market_load load(const MarketId market) const
+    {
+        std::lock_guard<std::mutex> lock{loads_mutex_};
+        return route_(market).load;
+    }
+    /*
+     * Tick/lot specification and id of a registered market; nullptr if unknown. Resolve
+     * names once at the protocol edge, everything past it takes the id.
+     */
+    const market_spec *market(const std::string_view market) const
+    {
+        /* Marked like a dispatch, so that add_market() can tell when an index it replaced is unused */
+        auto &dispatches = producer_().dispatches;
+        const auto count = dispatches.load(std::memory_order_relaxed);
+        dispatches.store(count + 1, std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        const auto &index = *market_ids_.load(std::memory_order_acquire);
+        const auto id = index.find(market);
+        const auto spec = id != index.end() ? routes_[id->second].spec : nullptr;
+        dispatches.store(count + 2, std::memory_order_release);
+        return spec;
+    }
+    /* Markets routable so far; ids below it are valid */
+    std::size_t market_count() const
+    {
+        return market_count_.load(std::memory_order_acquire);
+    }
+    /* Specification of a registered market by id; throws std::out_of_range if unknown */
+    const market_spec &market(const MarketId market) const
+    {
+        return *route_(market).spec;
+    }
+    /*
+     * Registers a market while running. The book is built on the least busy consumer,
+     * and the market is routable once this returns its id; nullopt if the name is taken,
+     * the table is full or the dispatcher is shutting down.
+     */
+    std::optional<MarketId> add_market(const market_spec &market)
+    {
+        const market_spec *spec = nullptr;
+        consumer *target = nullptr;
+        {
+            std::lock_guard<std::mutex> lock{registry_mutex_};
+            if (stopped_ || taken_(market.name) || specs_.size() == max_markets)
+                return std::nullopt;
+            spec = &intern_(market);
+            target = least_busy_(spec->id);
+            ++registering_;
+        }
+        /* Neither lookups nor other registrations wait while the consumer builds the book */
+        auto &state = *target->add(*spec).get();
+        std::unique_lock<std::mutex> lock{registry_mutex_};
+        bind_(spec->id, target, state);
+        auto replaced = publish_routes_();
+        --registering_;
+        registered_.notify_all();
+        /* Ids become routable in order; a registration ahead of this one may still be building its book */
+        registered_.wait(lock, [&] {
+            return market_count_.load(std::memory_order_relaxed) > spec->id;
+        });
+        lock.unlock();
+        retire_(std::move(replaced));
+        if (console_ != nullptr)
+            console_->info("dispatcher: added market {} as {}", spec->name, spec->id);
+        return spec->id;
+    }
+    /*
+     * Moves a market to another consumer without reordering its commands: the route is
+     * switched, dispatches which may have read the old route are waited for, and the old
+     * consumer hands the book over once it has worked off everything sent to it before.
+     * Meanwhile the new consumer parks the market's commands. False if the market is there
+     * already, another migration is in flight or membarrier(2) is unavailable.
+     */
+    bool migrate(const MarketId market, const std::size_t consumer_index)
+    {
+        std::lock_guard<std::mutex> lock{migration_mutex_};
+        if (barrier_ == 0 || should_exit_
+            || (migration_.valid() && migration_.wait_for(std::chrono::seconds(0)) != std::future_status::ready))
+            return false;
+        auto &route = route_(market);
+        const auto source = route.market_consumer.load(std::memory_order_relaxed);
+        const auto target = consumers_.at(consumer_index).get();
+        if (source == target)
+            return false;
+        route.market_consumer.store(target, std::memory_order_release);
+        quiesce_();
+        handoff transfer{market, target, source->positions(), nullptr, {}, {}};
+        migration_ = transfer.done.get_future();
+        source->release(std::move(transfer));
+        return true;
     }
     void shutdown()
     {
-        for (auto const& [_, c] : market_registry_) {
-            c->shutdown();
+        {
+            /* Books of registrations in flight are built by the consumers, which must still be running */
+            std::unique_lock<std::mutex> lock{registry_mutex_};
+            stopped_ = true;
+            registered_.wait(lock, [this] {
+                return registering_ == 0;
+            });
+        }
+        for (auto const& market_consumer : consumers_) {
+            market_consumer->shutdown();
         }
         pool_.join();
+        should_exit_ = true;
+        replica_pool_.join();
     }
 private:
-    std::unordered_map<std::string_view, std::shared_ptr<consumer>> market_registry_;
+    /*
+     * Name to id of the routable markets. Immutable: registrations replace it as a whole, so
+     * that lookups never take registry_mutex_.
+     */
+    using name_index = std::unordered_map<std::string_view, MarketId>;
+    /* Entry of the flat routing table; filled in before market_count_ covers it */
+    struct market_route {
+        const market_spec *spec = nullptr;
+        std::atomic<consumer *> market_consumer{nullptr}; /* Switched by migrate() */
+        market_book *state = nullptr;                     /* Stays put across migrations */
+        uint64_t sampled_commands = 0;                    /* Replica thread */
+        uint64_t sampled_busy_ns = 0;
+        market_load load{};                               /* Under loads_mutex_ */
+    };
+    /* Per producer thread count of dispatches, odd while one is in progress, and its deferred wakeups */
+    struct alignas(64) producer_marker {
+        std::atomic<uint64_t> dispatches{0};
+        uint64_t owner = 0;                                     /* producer_slot::id of the owning thread */
+        bool deferred = false;                                  /* Owning thread only, as is unwoken */
+        boost::container::small_vector<consumer *, 8> unwoken; /* Pushed to since the last flush() */
+    };
+    /* Copies the name, assigns the next id and reserves its route; under registry_mutex_ or in the constructor */
+    const market_spec &intern_(market_spec market)
+    {
+        market.name = names_.emplace_back(market.name);
+        market.id = specs_.size();
+        const auto &spec = specs_.emplace_back(market);
+        routes_[spec.id].spec = &spec;
+        return spec;
+    }
+    /* Registered or being registered; under registry_mutex_ */
+    bool taken_(const std::string_view name) const
+    {
+        if (names_index_->count(name) != 0)
+            return true;
+        for (auto id = market_count_.load(std::memory_order_relaxed); id < specs_.size(); ++id) {
+            if (specs_[id].name == name)
+                return true;
+        }
+        return false;
+    }
+    /* Least busy consumer as of the last sample, with the fewest markets on a tie */
+    consumer *least_busy_(const std::size_t markets) const
+    {
+        std::unordered_map<consumer *, std::pair<double, std::size_t>> load;
+        for (const auto& market_consumer : consumers_)
+            load[market_consumer.get()] = {0, 0};
+        {
+            std::lock_guard<std::mutex> loads_lock{loads_mutex_};
+            for (MarketId id = 0; id < std::min(markets, market_count_.load(std::memory_order_relaxed)); ++id) {
+                auto &owner = load[routes_[id].market_consumer.load(std::memory_order_acquire)];
+                owner.first += routes_[id].load.busy;
+                ++owner.second;
+            }
+        }
+        return std::min_element(load.begin(), load.end(), [](const auto& a, const auto& b) {
+            return a.second < b.second;
+        })->first;
+    }
+    /*
+     * Extends market_count_ over the bound routes which follow it and swaps in a name index
+     * covering them; under registry_mutex_. Returns the index replaced, if any.
+     */
+    std::unique_ptr<name_index> publish_routes_()
+    {
+        const auto first = market_count_.load(std::memory_order_relaxed);
+        auto count = first;
+        while (count < specs_.size() && routes_[count].state != nullptr)
+            ++count;
+        if (count == first)
+            return nullptr;
+        auto index = std::make_unique<name_index>(*names_index_);
+        for (auto id = first; id < count; ++id)
+            index->emplace(specs_[id].name, id);
+        /* Count first, so that a lookup which finds a new name finds its route too */
+        market_count_.store(count, std::memory_order_release);
+        market_ids_.store(index.get(), std::memory_order_release);
+        return std::exchange(names_index_, std::move(index));
+    }
+    /* Frees a replaced name index once no lookup can still read it; kept for good without membarrier(2) */
+    void retire_(std::unique_ptr<name_index> index)
+    {
+        if (index == nullptr)
+            return;
+        if (barrier_ != 0) {
+            quiesce_();
+            return;
+        }
+        std::lock_guard<std::mutex> lock{registry_mutex_};
+        retired_indexes_.push_back(std::move(index));
+    }
+    void bind_(const MarketId market, consumer *market_consumer, market_book &state)
+    {
+        auto &route = routes_[market];
+        route.state = &state;
+        route.market_consumer.store(market_consumer, std::memory_order_release);
+    }
+    market_route &route_(const MarketId market) const
+    {
+        if (market >= market_count_.load(std::memory_order_acquire))
+            throw std::out_of_range("dispatcher: unknown market " + std::to_string(market));
+        return routes_[market];
+    }
+    bool dispatch_(command task, trace::origin *origin = nullptr)
+    {
+        auto &route = route_(task.market);
+        if (origin != nullptr) {
+            origin->enqueued = trace::clock::now();
+            task.origin = *origin;
+        }
+        /* Odd while the route may be stale to a migration; see quiesce_ */
+        auto &producer = producer_();
+        auto &dispatches = producer.dispatches;
+        const auto count = dispatches.load(std::memory_order_relaxed);
+        dispatches.store(count + 1, std::memory_order_relaxed);
+        /* No fence on this side: membarrier(2) in quiesce_ orders the store before the route load */
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        const auto target = route.market_consumer.load(std::memory_order_acquire);
+        const auto admitted = target->push(task, !producer.deferred);
+        dispatches.store(count + 2, std::memory_order_release);
+        if (producer.deferred)
+            unwoken_(producer, target);
+        return admitted;
+    }
+    /* Marker of the calling thread; what an exited thread with the same index left behind is reset */
+    producer_marker &producer_() const
+    {
+        const auto &slot = this_producer();
+        auto &producer = markers_.at(slot.index);
+        if (producer.owner != slot.id) {
+            producer.owner = slot.id;
+            producer.deferred = false;
+            for (const auto target : producer.unwoken)
+                target->notify();
+            producer.unwoken.clear();
+        }
+        return producer;
+    }
+    static void unwoken_(producer_marker &producer, consumer *target)
+    {
+        if (std::find(producer.unwoken.begin(), producer.unwoken.end(), target) == producer.unwoken.end())
+            producer.unwoken.push_back(target);
+    }
+    /* Returns once no producer can still push to a consumer it read from a replaced route */
+    void quiesce_()
+    {
+        syscall(SYS_membarrier, barrier_, 0, 0);
+        for (auto &marker : markers_) {
+            const auto dispatches = marker.dispatches.load(std::memory_order_acquire);
+            if (dispatches & 1) {
+                while (marker.dispatches.load(std::memory_order_acquire) == dispatches)
+                    std::this_thread::yield();
+            }
+        }
+    }
+    /* Cheapest membarrier(2) command the kernel offers, or 0 */
+    static int barrier_command_()
+    {
+        if (syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0)
+            return MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+        const auto supported = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+        return supported > 0 && (supported & MEMBARRIER_CMD_GLOBAL) ? MEMBARRIER_CMD_GLOBAL : 0;
+    }
+    /* Samples the load of every market and moves one from the busiest to the idlest consumer if it narrows the gap */
+    void rebalance_(const double seconds)
+    {
+        std::unordered_map<const consumer *, double> busy;
+        for (const auto& market_consumer : consumers_)
+            busy[market_consumer.get()] = 0;
+        const auto markets = market_count_.load(std::memory_order_acquire);
+        {
+            std::lock_guard<std::mutex> lock{loads_mutex_};
+            for (MarketId market = 0; market < markets; ++market) {
+                auto &route = routes_[market];
+                const auto owner = route.market_consumer.load(std::memory_order_acquire);
+                const auto commands = route.state->commands.value();
+                const auto busy_ns = route.state->busy_ns.value();
+                route.load = {(commands - route.sampled_commands) / seconds,
+                              (busy_ns - route.sampled_busy_ns) / seconds / 1e9, owner->size_approx()};
+                route.sampled_commands = commands;
+                route.sampled_busy_ns = busy_ns;
+                busy[owner] += route.load.busy;
+            }
+        }
+        const auto by_load = [](const auto& a, const auto& b) {
+            return a.second < b.second;
+        };
+        const auto [idlest, busiest] = std::minmax_element(busy.begin(), busy.end(), by_load);
+        const auto gap = busiest->second - idlest->second;
+        if (gap < rebalance_threshold)
+            return;
+        /* Any market lighter than the gap narrows it; the best leaves the smallest one */
+        const market_route *candidate = nullptr;
+        for (MarketId market = 0; market < markets; ++market) {
+            const auto &route = routes_[market];
+            if (route.market_consumer.load(std::memory_order_relaxed) != busiest->first
+                || route.load.busy <= 0 || route.load.busy >= gap)
+                continue;
+            if (candidate == nullptr || std::abs(gap - 2 * route.load.busy) < std::abs(gap - 2 * candidate->load.busy))
+                candidate = &route;
+        }
+        if (candidate == nullptr)
+            return;
+        const auto target = std::find_if(consumers_.begin(), consumers_.end(), [&](const auto& market_consumer) {
+            return market_consumer.get() == idlest->first;
+        }) - consumers_.begin();
+        if (migrate(candidate->spec->id, target) && console_ != nullptr)
+            console_->info("dispatcher: moving {} ({:.0f}% of a core) from a consumer at {:.0f}% to one at {:.0f}%",
+                           candidate->spec->name, candidate->load.busy * 100, busiest->second * 100, idlest->second * 100);
+    }
+    std::unique_ptr<market_route[]> routes_{new market_route[max_markets]};
+    std::atomic<std::size_t> market_count_{0};
+    std::vector<std::shared_ptr<consumer>> consumers_;
+    /* Registry of names, only consulted at the protocol edge */
+    std::mutex registry_mutex_;
+    std::condition_variable registered_; /* A registration bound its route */
+    std::size_t registering_ = 0;        /* Registrations whose books are being built */
+    std::deque<std::string> names_;
+    std::deque<market_spec> specs_;
+    std::atomic<const name_index *> market_ids_{nullptr};
+    std::unique_ptr<name_index> names_index_; /* Owns the index market_ids_ points to */
+    std::vector<std::unique_ptr<name_index>> retired_indexes_;
+    bool stopped_ = false;
+    mutable std::array<producer_marker, ingress<command>::max_producer_threads> markers_;
+    int barrier_ = 0;
+    std::mutex migration_mutex_;
+    std::future<void> migration_;
+    mutable std::mutex loads_mutex_;
     boost::asio::thread_pool pool_;
+    boost::asio::thread_pool replica_pool_{1};
+    std::atomic_bool should_exit_{false};
     std::shared_ptr<spdlog::logger> console_;
+    std::shared_ptr<trace::tracer> tracer_;
 };
 } // namespace router
 } // namespace matching_engine
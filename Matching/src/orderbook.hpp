@@ -6,84 +6,96 @@
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <ostream>
 #include <memory>
 #include <numeric>
 #include <queue>
 #include <vector>
 #include <string_view>
-#include "tbb/parallel_reduce.h"
-#include "tbb/blocked_range.h"
 #include <boost/container/map.hpp>
-#include <boost/container/deque.hpp>
+#include <boost/intrusive/list.hpp>
 #include <boost/container/adaptive_pool.hpp>
 #include <boost/container/allocator.hpp>
 #include <boost/container/node_allocator.hpp>
 #include <boost/align/aligned_allocator.hpp>
 #include <boost/align/aligned_delete.hpp>
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_generators.hpp>
+#include <atomic>
+#include <slab_pool.hpp>
+#include <order_index.hpp>
+#include <execution.hpp>
+#include <seqlock.hpp>
 
 namespace matching_engine
 {
 
+/* Integer ticks and lots; decimal conversion happens once at ingress (see market.hpp) */
 using Price = unsigned long;
-using Quantity = double;
+using Quantity = unsigned long;
 using Time = std::chrono::high_resolution_clock;
 using TimePoint = std::chrono::time_point<Time>;
-using UUID = boost::uuids::uuid;
+using OrderId = uint64_t;
+using ClientOrderId = uint64_t;
+using MarketId = uint16_t;
 
-enum SIDE { BUY, SELL };
+enum SIDE : uint8_t { BUY, SELL };
 
-enum STATE { INACTIVE, ACTIVE, CANCELLED, FULFILLED };
+enum STATE : uint8_t { INACTIVE, ACTIVE, CANCELLED, FULFILLED };
 
-enum TIF { GTC };
+enum TIF : uint8_t { GTC };
 
-class Order
+/* Engine-wide monotonic order sequence; also defines time priority */
+inline OrderId next_order_id()
+{
+    static std::atomic<OrderId> sequence{1};
+    return sequence.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Time-priority link of a resting order inside its price level */
+using order_hook = boost::intrusive::list_base_hook<boost::intrusive::link_mode<boost::intrusive::normal_link>>;
+
+/* Hot matching state; exactly one cache line */
+class alignas(64) Order
+    : public order_hook
 {
 private:
-    const std::string_view market_name_; /* TODO Replace with std::string_view */
+    const OrderId id_;
+    Price price_;
+    Quantity quantity_;
+    Quantity executed_quantity_;
+    const MarketId market_;
     const SIDE side_;
-    const Price price_;
-    const Quantity quantity_;
-    const UUID uuid_;
-    const TIF tif_;
     STATE state_;
-    Quantity executed_quantity_;
-    const TimePoint created_;
 public:
-    Order(const std::string_view &market_name,
-          const SIDE &side,
-          const Price &price,
-          const Quantity &quantity,
-          const UUID uuid = boost::uuids::random_generator()(),
-          const TIF &tif = TIF::GTC,
-          const STATE &state = STATE::INACTIVE,
-          const Quantity &executed_quantity = 0,
-          const TimePoint &created = Time::now()):
-        market_name_{market_name},
-        side_{side},
+    Order(const MarketId market,
+          const SIDE side,
+          const Price price,
+          const Quantity quantity,
+          const OrderId id = next_order_id(),
+          const STATE state = STATE::INACTIVE,
+          const Quantity executed_quantity = 0):
+        id_{id},
         price_{price},
         quantity_{quantity},
-        uuid_{uuid},
-        tif_{tif},
-        state_{state},
         executed_quantity_{executed_quantity},
-        created_{created} {}
+        market_{market},
+        side_{side},
+        state_{state} {}
     Order() = delete;
-    Order(const Order &) = delete;
+    Order(const Order &) = default; /* Copy is never linked into a level */
     Order& operator=(const Order&) = delete;
     ~Order() = default;
 
-    std::string_view market_name() const;
-    UUID uuid() const;
-    void uuid(UUID);
+    MarketId market() const;
+    OrderId id() const;
     Quantity quantity() const;
     Price price() const;
     SIDE side() const;
     void execute(const Quantity &quantity);
+    /* New limit price and total quantity; the id and executed quantity are kept */
+    void amend(const Price &price, const Quantity &quantity);
     Quantity leftover() const;
-    TIF tif() const;
+    STATE state() const;
     void state(STATE state);
     bool is_buy() const;
     /* Price/Time priority */
@@ -91,30 +103,88 @@ public:
     bool operator==(const Order &rhs) const;
 };
 
+static_assert(sizeof(Order) == 64, "Order must fit one cache line");
+
+/* Cold order attributes; kept out of the matching path */
+struct OrderInfo {
+    ClientOrderId client_id = 0;
+    TIF tif = TIF::GTC;
+    TimePoint created = {};
+};
+
+/*
+ * FILL and PARTIAL_FILL are trades seen from the incoming (taker) order: the taker is
+ * complete after a FILL and still has leftover after a PARTIAL_FILL. The maker's
+ * remaining quantity travels along, so its status is known without a lookup.
+ * CANCEL_REJECT is a cancel whose order never showed up, e.g. because it was filled.
+ */
+enum EXECUTION : uint8_t { FILL, PARTIAL_FILL, REST, CANCEL_ACK, AMEND_ACK, CANCEL_REJECT };
+
+struct ExecutionReport {
+    EXECUTION type;
+    SIDE side;               /* Taker side for trades; order side otherwise */
+    MarketId market;
+    OrderId taker;           /* Incoming, rested or cancelled order */
+    OrderId maker;           /* Resting counterparty of a trade; 0 otherwise */
+    Price price;             /* Maker price for trades; order price otherwise */
+    Quantity quantity;       /* Traded, rested, cancelled or amended open quantity */
+    Quantity taker_leftover;
+    Quantity maker_leftover;
+};
+
+/* Absolute state of one price level after a change; quantity 0 means the level is gone */
+struct DepthDelta {
+    uint64_t sequence;       /* Per book, without gaps */
+    Price price;
+    Quantity quantity;
+    uint32_t count;
+    SIDE side;
+};
+
+/* Best levels and last trade; 0 prices stand for an empty side or no trade yet */
+struct TopOfBook {
+    Price bid;
+    Quantity bid_quantity;
+    Price ask;
+    Quantity ask_quantity;
+    Price last_price;
+    Quantity last_quantity;
+    uint64_t sequence;       /* Bumped on every change of the above */
+};
+
 using OrderPtr = std::unique_ptr<Order>;
 
-using queue_allocator = boost::container::allocator<OrderPtr>;
-using order_queue_type = boost::container::deque<OrderPtr, queue_allocator>;
+/* Orders are owned by the book's slab pool; the queue only links them in time priority */
+using order_queue_type = boost::intrusive::list<Order, boost::intrusive::constant_time_size<true>>;
 
+/* Price level; keeps its open quantity up to date so that depth queries never walk orders */
 class OrderQueue
     : public order_queue_type
 {
+private:
+    Quantity quantity_ = 0;
+    bool dirty_ = false;
 public:
     OrderQueue() = default;
     OrderQueue(const OrderQueue &) = delete;
     OrderQueue& operator=(const OrderQueue&) = delete;
-    template <typename order_type>
-    OrderQueue(order_type order);
-    template <typename order_type, typename... args>
-    OrderQueue(order_type order, args... rest);
-    bool remove(UUID uuid);
-    Quantity accumulate() const;
+    void push_back(Order &order);
+    void erase(Order &order);
+    void execute(Order &order, const Quantity &quantity);
+    /* Change the total quantity of a linked order in place; its position is kept */
+    void resize(Order &order, const Quantity &quantity);
+    void swap(OrderQueue &other);
+    /* Total open quantity; the order count is size() */
+    Quantity quantity() const;
+    /* Changed since the last depth publication */
+    bool dirty() const;
+    void dirty(bool dirty);
 };
 
-class OrderBook
+/* Red-black tree of price levels ordered by priority (best price first) */
+class TreeLevels
 {
 private:
-    const std::string_view market_name_;
     struct Comp {
         enum compare_type { less, greater };
         explicit Comp(compare_type t) : type(t) {}
@@ -127,25 +197,102 @@ private:
     };
     using map_allocator = boost::container::adaptive_pool<std::pair<const Price, OrderQueue>>;
     using order_tree_type = boost::container::map<Price, OrderQueue, Comp, map_allocator>;
-    order_tree_type buy_tree_;
-    order_tree_type sell_tree_;
+    order_tree_type tree_;
 public:
-    OrderBook(const std::string_view market_name):
+    explicit TreeLevels(const SIDE side):
+        tree_{Comp{side == SIDE::BUY ? Comp::greater : Comp::less}} {}
+    TreeLevels(const TreeLevels &) = delete;
+    TreeLevels& operator=(const TreeLevels&) = delete;
+    bool empty() const;
+    Price best_price() const;
+    OrderQueue &best();
+    void erase_best();
+    OrderQueue *find(Price price);
+    OrderQueue &emplace(Price price);
+    void erase(Price price);
+    void prefetch(Price price) const;
+    template <typename visitor_type>
+    void for_each(visitor_type &&visitor, std::size_t limit) const;
+};
+
+template <typename Levels>
+class BasicOrderBook
+{
+private:
+    const std::string_view market_name_;
+    /* Storage of resting orders; levels link into it */
+    SlabPool<Order> pool_;
+    Levels buy_tree_;
+    Levels sell_tree_;
+    struct resting_order {
+        Order *order;
+        OrderInfo info;
+    };
+    OrderIndex<resting_order> orders_;
+    /* Levels changed since the last publish(); a level is listed once while its flag is set */
+    struct dirty_level {
+        SIDE side;
+        Price price;
+    };
+    std::vector<dirty_level> dirty_;
+    uint64_t sequence_ = 0;
+    /* Written after every match, cancel and amend; read from any thread */
+    TopOfBook top_{};
+    bool traded_ = false;
+    Seqlock<TopOfBook> top_cell_;
+    void publish_top_();
+    void touch_(SIDE side, Price price, OrderQueue &queue);
+    void compact_();
+    template <typename Sink>
+    void cross_(Order &src, Sink &sink);
+    void prefetch_(const Order &order);
+public:
+    template <typename... level_args>
+    BasicOrderBook(const std::string_view market_name, const level_args &... args):
         market_name_{market_name},
-        buy_tree_{OrderBook::Comp{OrderBook::Comp::greater}},
-        sell_tree_{OrderBook::Comp{OrderBook::Comp::less}}
+        buy_tree_{SIDE::BUY, args...},
+        sell_tree_{SIDE::SELL, args...}
     {
     }
-    OrderBook(const OrderBook &) = delete;
-    OrderBook& operator=(const OrderBook&) = delete;
-    OrderBook() = delete;
-    ~OrderBook() = default;
-    bool cancel(const UUID uuid, SIDE side, Price price_node_hint);
-    bool match(OrderPtr);
+    BasicOrderBook(const BasicOrderBook &) = delete;
+    BasicOrderBook& operator=(const BasicOrderBook&) = delete;
+    BasicOrderBook() = delete;
+    ~BasicOrderBook() = default;
+    /* Execution events are handed to the sink as they happen; see execution.hpp */
+    template <typename Sink>
+    bool cancel(const OrderId id, Sink &&sink);
+    bool cancel(const OrderId id);
+    /*
+     * Change the limit price and total quantity of a resting order. A reduction at the
+     * same price keeps time priority and is O(1); anything else moves the same order object
+     * to the back of its new level, matching it first if the new price crosses.
+     * Returns false if the order is not resting or nothing would be left open.
+     */
+    template <typename Sink>
+    bool amend(const OrderId id, const Price price, const Quantity quantity, Sink &&sink);
+    bool amend(const OrderId id, const Price price, const Quantity quantity);
+    template <typename Sink>
+    bool match(Order src, const OrderInfo &info, Sink &&sink);
+    bool match(Order src, const OrderInfo &info = {});
+    bool match(OrderPtr src);
+    /*
+     * Match a run of orders of this book in arrival order; same outcome as calling match()
+     * for each of them, but memory the next order will touch is prefetched while the
+     * current one is being matched. Returns the number of fulfilled orders.
+     */
+    template <typename Iterator, typename Sink>
+    std::size_t match_batch(Iterator first, Iterator last, Sink &&sink);
+    template <typename Iterator>
+    std::size_t match_batch(Iterator first, Iterator last);
+    /* Cold attributes of a resting order; nullptr if it is not in the book */
+    const OrderInfo *info(const OrderId id) const;
     Price best_buy() const;
     Price best_sell() const;
     Price quote() const;
-    Price spread() const;
+    /* Percent of the best ask: (ask - bid) / ask * 100 */
+    double spread() const;
+    /* Safe to read from any thread, unlike the accessors above */
+    const Seqlock<TopOfBook> &top_of_book() const;
     std::string_view market_name() const;
     struct snapshot_point {
         Price price;
@@ -153,20 +300,37 @@ public:
         unsigned long size;
         SIDE side;
     };
-    std::vector<snapshot_point> snapshot() const;
+    static constexpr std::size_t full_depth = std::numeric_limits<std::size_t>::max();
+    /* Top levels of both sides */
+    std::vector<snapshot_point> snapshot(std::size_t depth = 20) const;
+    /*
+     * Hand a DepthDelta for every level changed since the previous call to the consumer,
+     * ordered by side and price. Call from the matching thread.
+     */
+    template <typename Consumer>
+    void publish(Consumer &&consumer);
+    /* Upper bound of the number of deltas the next publish() hands out */
+    std::size_t pending() const;
+    /*
+     * Sequence of the last published delta. A snapshot(full_depth) taken together with it
+     * is a resync point for mirrors: deltas up to that sequence are already reflected.
+     */
+    uint64_t sequence() const;
 };
 
-std::string_view Order::market_name() const
+using OrderBook = BasicOrderBook<TreeLevels>;
+
+MarketId Order::market() const
 {
-    return market_name_;
+    return market_;
 }
 Quantity Order::quantity() const
 {
     return quantity_;
 }
-UUID Order::uuid() const
+OrderId Order::id() const
 {
-    return uuid_;
+    return id_;
 }
 Price Order::price() const
 {
@@ -180,13 +344,18 @@ void Order::execute(const Quantity &quantity)
 {
     executed_quantity_ += quantity;
 }
+void Order::amend(const Price &price, const Quantity &quantity)
+{
+    price_ = price;
+    quantity_ = quantity;
+}
 Quantity Order::leftover() const
 {
     return quantity_ - executed_quantity_;
 }
-TIF Order::tif() const
+STATE Order::state() const
 {
-    return tif_;
+    return state_;
 }
 void Order::state(STATE state)
 {
@@ -200,187 +369,461 @@ bool Order::is_buy() const
 bool Order::operator>=(const Order &rhs) const
 {
     return side_ == rhs.side_ && price_ == rhs.price_ &&
-           created_ <= rhs.created_ && quantity_ >= rhs.quantity_;
+           id_ <= rhs.id_ && quantity_ >= rhs.quantity_;
 }
 bool Order::operator==(const Order &rhs) const
 {
-    return uuid_ == rhs.uuid_ && side_ == rhs.side_ && price_ == rhs.price_ &&
+    return id_ == rhs.id_ && side_ == rhs.side_ && price_ == rhs.price_ &&
            quantity_ == rhs.quantity_;
 }
 
-template <typename order_type>
-OrderQueue::OrderQueue(order_type order)
+void OrderQueue::push_back(Order &order)
 {
-    emplace_back(std::move(order));
+    quantity_ += order.leftover();
+    order_queue_type::push_back(order);
 }
 
-template <typename order_type, typename... args>
-OrderQueue::OrderQueue(order_type order, args... rest)
+void OrderQueue::erase(Order &order)
 {
-    emplace_back(std::move(order));
-    OrderQueue(rest...);
+    quantity_ -= order.leftover();
+    order_queue_type::erase(iterator_to(order));
 }
 
-bool OrderQueue::remove(const UUID uuid)
+void OrderQueue::execute(Order &order, const Quantity &quantity)
 {
-    auto order =
-    std::find_if(cbegin(), cend(), [&](const auto& it) {
-        return it->uuid() == uuid;
-    });
-    if (order != cend()) {
-        erase(order, cend());
-        return true;
+    quantity_ -= quantity;
+    order.execute(quantity);
+}
+
+void OrderQueue::resize(Order &order, const Quantity &quantity)
+{
+    quantity_ -= order.leftover();
+    order.amend(order.price(), quantity);
+    quantity_ += order.leftover();
+}
+
+void OrderQueue::swap(OrderQueue &other)
+{
+    std::swap(quantity_, other.quantity_);
+    std::swap(dirty_, other.dirty_);
+    order_queue_type::swap(other);
+}
+
+Quantity OrderQueue::quantity() const
+{
+    return quantity_;
+}
+
+bool OrderQueue::dirty() const
+{
+    return dirty_;
+}
+
+void OrderQueue::dirty(const bool dirty)
+{
+    dirty_ = dirty;
+}
+
+bool TreeLevels::empty() const
+{
+    return tree_.empty();
+}
+
+Price TreeLevels::best_price() const
+{
+    return tree_.begin()->first;
+}
+
+OrderQueue &TreeLevels::best()
+{
+    return tree_.begin()->second;
+}
+
+void TreeLevels::erase_best()
+{
+    tree_.erase(tree_.begin());
+}
+
+OrderQueue *TreeLevels::find(const Price price)
+{
+    auto node = tree_.find(price);
+    return node != tree_.end() ? &node->second : nullptr;
+}
+
+OrderQueue &TreeLevels::emplace(const Price price)
+{
+    return tree_.try_emplace(price).first->second;
+}
+
+void TreeLevels::erase(const Price price)
+{
+    tree_.erase(price);
+}
+
+void TreeLevels::prefetch(const Price) const
+{
+    /* Nothing to pull in without walking the tree */
+}
+
+template <typename visitor_type>
+void TreeLevels::for_each(visitor_type &&visitor, const std::size_t limit) const
+{
+    auto count = std::size_t{0};
+    for (auto node = tree_.begin(); count < limit && node != tree_.end(); ++node, ++count) {
+        visitor(node->first, node->second);
     }
-    return false;
 }
 
-Quantity OrderQueue::accumulate() const
+template <typename Levels>
+bool BasicOrderBook<Levels>::cancel(const OrderId id)
 {
-    return tbb::parallel_reduce(tbb::blocked_range<OrderQueue::const_iterator>(cbegin(),cend()), 0.0, [](const tbb::blocked_range<OrderQueue::const_iterator> r, Quantity total) {
-        return std::accumulate(r.begin(), r.end(), total,
-        [](const Quantity subtotal, const auto& order) {
-            return subtotal + order->leftover();
-        });
-    }, std::plus<Quantity>());
+    return cancel(id, NullExecutionSink{});
 }
 
-bool OrderBook::cancel(const UUID uuid, const SIDE side, const Price price)
+template <typename Levels>
+template <typename Sink>
+bool BasicOrderBook<Levels>::cancel(const OrderId id, Sink &&sink)
 {
-    auto &tree = side == SIDE::BUY ? buy_tree_ : sell_tree_;
-    try {
-        auto &&order_queue = tree.at(price);
-        auto result = order_queue.remove(uuid);
-        if (order_queue.empty()) /* Drop price node */
-            tree.erase(price);
-        return result;
-    } catch (const std::out_of_range &) { /* No price point exist */
+    auto order = orders_.find(id);
+    if (order == nullptr) /* Not resting in the book */
         return false;
+    auto resting = order->order;
+    orders_.erase(id);
+    const auto price = resting->price();
+    auto &tree = resting->is_buy() ? buy_tree_ : sell_tree_;
+    auto &order_queue = *tree.find(price);
+    sink(ExecutionReport{EXECUTION::CANCEL_ACK, resting->side(), resting->market(), id, 0,
+                         price, resting->leftover(), 0, 0});
+    touch_(resting->side(), price, order_queue);
+    order_queue.erase(*resting);
+    pool_.release(resting);
+    if (order_queue.empty()) { /* Drop price node */
+        order_queue.dirty(false);
+        tree.erase(price);
     }
+    publish_top_();
+    return true;
 }
 
-std::string_view OrderBook::market_name() const
+template <typename Levels>
+bool BasicOrderBook<Levels>::amend(const OrderId id, const Price price, const Quantity quantity)
+{
+    return amend(id, price, quantity, NullExecutionSink{});
+}
+
+template <typename Levels>
+template <typename Sink>
+bool BasicOrderBook<Levels>::amend(const OrderId id, const Price price, const Quantity quantity,
+                                   Sink &&sink)
+{
+    auto order = orders_.find(id);
+    if (order == nullptr) /* Not resting in the book */
+        return false;
+    auto resting = order->order;
+    if (quantity <= resting->quantity() - resting->leftover()) /* That is a cancel */
+        return false;
+    auto &tree = resting->is_buy() ? buy_tree_ : sell_tree_;
+    auto &order_queue = *tree.find(resting->price());
+    touch_(resting->side(), resting->price(), order_queue);
+    if (price == resting->price() && quantity <= resting->quantity()) {
+        order_queue.resize(*resting, quantity);
+        sink(ExecutionReport{EXECUTION::AMEND_ACK, resting->side(), resting->market(), id, 0,
+                             price, resting->leftover(), resting->leftover(), 0});
+        publish_top_();
+        return true;
+    }
+    /* Loses priority; unlink, rewrite in place and treat as incoming */
+    order_queue.erase(*resting);
+    if (order_queue.empty()) {
+        order_queue.dirty(false);
+        tree.erase(resting->price());
+    }
+    resting->amend(price, quantity);
+    sink(ExecutionReport{EXECUTION::AMEND_ACK, resting->side(), resting->market(), id, 0,
+                         price, resting->leftover(), resting->leftover(), 0});
+    cross_(*resting, sink);
+    if (resting->leftover() == 0) {
+        orders_.erase(id);
+        pool_.release(resting);
+    } else {
+        auto &level = tree.emplace(price);
+        touch_(resting->side(), price, level);
+        level.push_back(*resting);
+    }
+    publish_top_();
+    return true;
+}
+
+template <typename Levels>
+std::string_view BasicOrderBook<Levels>::market_name() const
 {
     return market_name_;
 }
 
-bool OrderBook::match(OrderPtr src)
+template <typename Levels>
+const OrderInfo *BasicOrderBook<Levels>::info(const OrderId id) const
+{
+    auto order = orders_.find(id);
+    return order != nullptr ? &order->info : nullptr;
+}
+
+template <typename Levels>
+bool BasicOrderBook<Levels>::match(OrderPtr src)
 {
+    return match(*src);
+}
+
+template <typename Levels>
+bool BasicOrderBook<Levels>::match(Order order, const OrderInfo &info)
+{
+    return match(order, info, NullExecutionSink{});
+}
+
+template <typename Levels>
+template <typename Sink>
+bool BasicOrderBook<Levels>::match(Order order, const OrderInfo &info, Sink &&sink)
+{
+    const auto src = &order;
     auto &&src_tree = src->is_buy() ? buy_tree_ : sell_tree_;
-    auto &&dist_tree = src->is_buy() ? sell_tree_ : buy_tree_;
     src->state(STATE::ACTIVE);
+    cross_(*src, sink);
+    /* Not enough resources to fulfill the order; push to source tree */
+    if (src->leftover() > 0) {
+        sink(ExecutionReport{EXECUTION::REST, src->side(), src->market(), src->id(), 0,
+                             src->price(), src->leftover(), src->leftover(), 0});
+        auto resting = pool_.acquire(*src);
+        auto &level = src_tree.emplace(resting->price());
+        touch_(resting->side(), resting->price(), level);
+        level.push_back(*resting);
+        orders_.insert(resting->id(), {resting, info});
+        publish_top_();
+        return false;
+    }
+    /* Order's been fulfilled */
+    publish_top_();
+    return true;
+}
+
+/* Execute the order against the opposite side for as long as it crosses */
+template <typename Levels>
+template <typename Sink>
+void BasicOrderBook<Levels>::cross_(Order &order, Sink &sink)
+{
+    const auto src = &order;
+    auto &&dist_tree = src->is_buy() ? sell_tree_ : buy_tree_;
 
     auto should_exit_tree = false;
-    for (auto node = dist_tree.begin(), end = dist_tree.end();
-         !should_exit_tree && node != end;) {
-        auto &&dist_queue = node->second;
+    while (!should_exit_tree && !dist_tree.empty()) {
+        const auto node_price = dist_tree.best_price();
         /* Buy cheap; sell expensive – conduct price improvement */
-        if (src->is_buy() ? src->price() >= node->first
-            : src->price() <= node->first) {
+        if (src->is_buy() ? src->price() >= node_price
+            : src->price() <= node_price) {
+            auto &&dist_queue = dist_tree.best();
+            touch_(src->is_buy() ? SIDE::SELL : SIDE::BUY, node_price, dist_queue);
             for (auto exit_queue = false; !exit_queue && !dist_queue.empty();) {
-                auto dist = dist_queue.front().get();
-                auto leftover = dist->leftover() - src->leftover();
+                auto dist = &dist_queue.front();
+                const auto fill = std::min(dist->leftover(), src->leftover());
+                src->execute(fill);
+                dist_queue.execute(*dist, fill);
+                top_.last_price = node_price;
+                top_.last_quantity = fill;
+                traded_ = true;
+                sink(ExecutionReport{src->leftover() == 0 ? EXECUTION::FILL : EXECUTION::PARTIAL_FILL,
+                                     src->side(), src->market(), src->id(), dist->id(),
+                                     node_price, fill, src->leftover(), dist->leftover()});
 
-                /* Fulfilled source; partially or fulfilled dist */
-                if (leftover >= 0) {
-                    src->execute(src->leftover());
-                    src->state(STATE::FULFILLED);
-                    /* Exact match */
-                    if (leftover == 0) {
-                        dist->execute(dist->leftover());
-                    }
-                    /* Partial match */
-                    else {
-                        dist->execute(dist->leftover() - leftover);
-                    }
-                    /* Remove fulfilled order from queue */
-                    if (dist->leftover() == 0) {
-                        dist->state(STATE::FULFILLED);
-                        dist_queue.pop_front();
-                    }
-                    /* Matching is complete */
-                    exit_queue = true;
-                    should_exit_tree = true;
-                }
-                /* Partially-filled source; fulfilled dist */
-                else {
-                    src->execute(dist->leftover());
-                    dist->execute(dist->leftover());
+                /* Remove fulfilled order from queue */
+                if (dist->leftover() == 0) {
                     dist->state(STATE::FULFILLED);
-                    /* Remove fulfilled order from queue */
+                    orders_.erase(dist->id());
                     dist_queue.pop_front();
+                    pool_.release(dist);
                     /* Try next order in the queue */
                 }
+                /* Fulfilled source; matching is complete */
+                if (src->leftover() == 0) {
+                    src->state(STATE::FULFILLED);
+                    exit_queue = true;
+                    should_exit_tree = true;
+                }
             }
             /* Try next price node */
             if (dist_queue.empty()) {
                 /* Purge the price point with empty queue */
-                node = dist_tree.erase(node++);
-            } else {
-                ++node;
+                dist_queue.dirty(false);
+                dist_tree.erase_best();
             }
         } else {
             should_exit_tree = true;
         }
     }
-    /* Not enough resources to fulfill the order; push to source tree */
-    if (src->leftover() > 0) {
-        auto const& node = src_tree.find(src->price());
-        if (node == src_tree.end()) { /* Create new price node */
-            src_tree.emplace_hint(
-                node,
-                src->price(),
-                std::move(src));
-        } else { /* Insert in existing price node */
-            node->second.emplace_back(std::move(src));
+}
+
+template <typename Levels>
+void BasicOrderBook<Levels>::touch_(const SIDE side, const Price price, OrderQueue &queue)
+{
+    /* Flags of dropped levels are cleared, so a re-created level registers again */
+    if (!queue.dirty()) {
+        queue.dirty(true);
+        /* Deferred publications must not let duplicates pile up */
+        if (dirty_.size() == dirty_.capacity())
+            compact_();
+        dirty_.push_back({side, price});
+    }
+}
+
+template <typename Levels>
+void BasicOrderBook<Levels>::compact_()
+{
+    /* A level dropped and re-created since the last publication is listed twice */
+    std::sort(dirty_.begin(), dirty_.end(), [](const dirty_level &lhs, const dirty_level &rhs) {
+        return lhs.side != rhs.side ? lhs.side < rhs.side : lhs.price < rhs.price;
+    });
+    dirty_.erase(std::unique(dirty_.begin(), dirty_.end(), [](const dirty_level &lhs, const dirty_level &rhs) {
+        return lhs.side == rhs.side && lhs.price == rhs.price;
+    }), dirty_.end());
+}
+
+template <typename Levels>
+template <typename Consumer>
+void BasicOrderBook<Levels>::publish(Consumer &&consumer)
+{
+    if (dirty_.empty())
+        return;
+    compact_();
+    for (auto level = dirty_.begin(); level != dirty_.end(); ++level) {
+        auto &tree = level->side == SIDE::BUY ? buy_tree_ : sell_tree_;
+        auto queue = tree.find(level->price);
+        if (queue != nullptr) {
+            queue->dirty(false);
+            consumer(DepthDelta{++sequence_, level->price, queue->quantity(), uint32_t(queue->size()), level->side});
+        } else {
+            consumer(DepthDelta{++sequence_, level->price, 0, 0, level->side});
         }
-        return false;
     }
-    /* Order's been fulfilled */
-    return true;
+    dirty_.clear();
 }
 
-Price OrderBook::best_buy() const
+template <typename Levels>
+std::size_t BasicOrderBook<Levels>::pending() const
+{
+    return dirty_.size();
+}
+
+template <typename Levels>
+uint64_t BasicOrderBook<Levels>::sequence() const
+{
+    return sequence_;
+}
+
+template <typename Levels>
+void BasicOrderBook<Levels>::prefetch_(const Order &order)
+{
+    auto &&src_tree = order.is_buy() ? buy_tree_ : sell_tree_;
+    auto &&dist_tree = order.is_buy() ? sell_tree_ : buy_tree_;
+    /* Level it would rest at, head of the level it would hit and its index slot */
+    src_tree.prefetch(order.price());
+    if (!dist_tree.empty()) {
+        auto &&dist_queue = dist_tree.best();
+        if (!dist_queue.empty())
+            __builtin_prefetch(&dist_queue.front(), 1);
+    }
+    orders_.prefetch(order.id());
+}
+
+template <typename Levels>
+template <typename Iterator, typename Sink>
+std::size_t BasicOrderBook<Levels>::match_batch(Iterator first, const Iterator last, Sink &&sink)
+{
+    std::size_t fulfilled = 0;
+    if (first != last)
+        prefetch_(*first);
+    for (; first != last; ++first) {
+        const auto next = std::next(first);
+        if (next != last)
+            prefetch_(*next);
+        fulfilled += match(*first, OrderInfo{}, sink);
+    }
+    return fulfilled;
+}
+
+template <typename Levels>
+template <typename Iterator>
+std::size_t BasicOrderBook<Levels>::match_batch(Iterator first, const Iterator last)
+{
+    return match_batch(first, last, NullExecutionSink{});
+}
+
+template <typename Levels>
+Price BasicOrderBook<Levels>::best_buy() const
 {
     return !buy_tree_.empty()
-           ? buy_tree_.begin()->first
-           : !sell_tree_.empty() ? sell_tree_.begin()->first : 0;
+           ? buy_tree_.best_price()
+           : !sell_tree_.empty() ? sell_tree_.best_price() : 0;
 }
 
-Price OrderBook::best_sell() const
+template <typename Levels>
+Price BasicOrderBook<Levels>::best_sell() const
 {
     return !sell_tree_.empty()
-           ? sell_tree_.begin()->first
-           : !buy_tree_.empty() ? buy_tree_.begin()->first : 0;
+           ? sell_tree_.best_price()
+           : !buy_tree_.empty() ? buy_tree_.best_price() : 0;
 }
 
-Price OrderBook::quote() const
+template <typename Levels>
+Price BasicOrderBook<Levels>::quote() const
 {
     return (best_buy() + best_sell()) / 2;
 }
 
-Price OrderBook::spread() const
+template <typename Levels>
+double BasicOrderBook<Levels>::spread() const
 {
     auto buy = best_buy();
     auto sell = best_sell();
-    return buy && sell ? (sell - buy) / sell : 0;
+    return buy && sell ? double(sell - buy) / sell * 100 : 0;
+}
+
+template <typename Levels>
+const Seqlock<TopOfBook> &BasicOrderBook<Levels>::top_of_book() const
+{
+    return top_cell_;
 }
 
-std::vector<OrderBook::snapshot_point> OrderBook::snapshot() const
+template <typename Levels>
+void BasicOrderBook<Levels>::publish_top_()
+{
+    const auto bid = buy_tree_.empty() ? 0 : buy_tree_.best_price();
+    const auto bid_quantity = buy_tree_.empty() ? 0 : buy_tree_.best().quantity();
+    const auto ask = sell_tree_.empty() ? 0 : sell_tree_.best_price();
+    const auto ask_quantity = sell_tree_.empty() ? 0 : sell_tree_.best().quantity();
+    /* Deep-book changes leave the cell, and the readers' cache line, alone */
+    if (!traded_ && bid == top_.bid && bid_quantity == top_.bid_quantity
+        && ask == top_.ask && ask_quantity == top_.ask_quantity)
+        return;
+    top_.bid = bid;
+    top_.bid_quantity = bid_quantity;
+    top_.ask = ask;
+    top_.ask_quantity = ask_quantity;
+    ++top_.sequence;
+    traded_ = false;
+    top_cell_.store(top_);
+}
+
+template <typename Levels>
+std::vector<typename BasicOrderBook<Levels>::snapshot_point> BasicOrderBook<Levels>::snapshot(const std::size_t depth) const
 {
     std::vector<snapshot_point> snapshot;
+    snapshot.reserve(std::min<std::size_t>(depth, 1024) * 2);
     auto traverse = [&](const auto &tree, const SIDE &side) {
-        auto limit = 0;
-        for (auto &&node : tree) {
+        tree.for_each([&](const Price price, const OrderQueue &queue) {
             snapshot_point point;
             point.side = side;
-            point.price = node.first;
-            point.cumulative_quantity = node.second.accumulate();
-            point.size = node.second.size();
+            point.price = price;
+            point.cumulative_quantity = queue.quantity();
+            point.size = queue.size();
             snapshot.emplace_back(point);
-            limit++;
-            if (limit >= 20)
-                break;
-        }
+        }, depth);
     };
     traverse(buy_tree_, SIDE::BUY);
     traverse(sell_tree_, SIDE::SELL);
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace matching_engine
+{
+
+/*
+ * Cores of each thread role. Consumer and I/O threads get one core each, in order;
+ * service threads (logging, telemetry, depth replicas) float over their set.
+ * The thread count of a role is the number of its cores, so the machine is never
+ * oversubscribed by default.
+ */
+struct thread_placement {
+    std::vector<unsigned> consumer_cores;
+    std::vector<unsigned> io_cores;
+    std::vector<unsigned> service_cores;
+};
+
+/* CPUs the process is allowed to run on */
+inline std::vector<unsigned> allowed_cores()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<unsigned> cores;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (unsigned core = 0; core < CPU_SETSIZE; ++core) {
+            if (CPU_ISSET(core, &set))
+                cores.push_back(core);
+        }
+    }
+    if (cores.empty())
+        cores.push_back(0);
+    return cores;
+}
+
+/* Core list as accepted by taskset and cpusets, e.g. "0-3,8,10-11" */
+inline std::optional<std::vector<unsigned>> parse_cores(const std::string_view list)
+{
+    std::vector<unsigned> cores;
+    const auto number = [](const std::string_view text) -> std::optional<unsigned> {
+        unsigned value = 0;
+        const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec != std::errc{} || end != text.data() + text.size() || value >= CPU_SETSIZE)
+            return std::nullopt;
+        return value;
+    };
+    for (std::size_t first = 0; first <= list.size();) {
+        auto last = list.find(',', first);
+        if (last == std::string_view::npos)
+            last = list.size();
+        const auto range = list.substr(first, last - first);
+        const auto dash = range.find('-');
+        const auto low = number(range.substr(0, dash));
+        const auto high = dash == std::string_view::npos ? low : number(range.substr(dash + 1));
+        if (!low || !high || *low > *high)
+            return std::nullopt;
+        for (auto core = *low; core <= *high; ++core)
+            cores.push_back(core);
+        first = last + 1;
+    }
+    std::sort(cores.begin(), cores.end());
+    cores.erase(std::unique(cores.begin(), cores.end()), cores.end());
+    return cores;
+}
+
+/* Inverse of parse_cores, for logging */
+inline std::string format_cores(const std::vector<unsigned> &cores)
+{
+    std::string list;
+    for (std::size_t first = 0; first < cores.size();) {
+        auto last = first;
+        while (last + 1 < cores.size() && cores[last + 1] == cores[last] + 1)
+            ++last;
+        if (!list.empty())
+            list += ',';
+        list += std::to_string(cores[first]);
+        if (last != first)
+            list += '-' + std::to_string(cores[last]);
+        first = last + 1;
+    }
+    return list;
+}
+
+/*
+ * First allowed core for service threads, about a quarter of the rest for I/O and the
+ * remainder for consumers. Roles only share cores when there are fewer than three.
+ */
+inline thread_placement default_placement()
+{
+    const auto cores = allowed_cores();
+    thread_placement placement;
+    placement.service_cores = {cores.front()};
+    if (cores.size() < 3) {
+        placement.io_cores = {cores.front()};
+        placement.consumer_cores = {cores.back()};
+        return placement;
+    }
+    const auto io = std::max<std::size_t>(1, (cores.size() - 1) / 4);
+    placement.io_cores.assign(cores.begin() + 1, cores.begin() + 1 + io);
+    placement.consumer_cores.assign(cores.begin() + 1 + io, cores.end());
+    return placement;
+}
+
+/* NUMA node of a core; -1 if the kernel does not say */
+inline int numa_node(const unsigned core)
+{
+    std::error_code ec;
+    const std::filesystem::path cpu{"/sys/devices/system/cpu/cpu" + std::to_string(core)};
+    for (std::filesystem::directory_iterator entry{cpu, ec}, end; !ec && entry != end; entry.increment(ec)) {
+        const auto name = entry->path().filename().string();
+        if (name.size() > 4 && name.compare(0, 4, "node") == 0)
+            return std::stoi(name.substr(4));
+    }
+    return -1;
+}
+
+/* Restrict the calling thread to the cores; false if the kernel refused */
+inline bool pin_thread(const std::vector<unsigned> &cores)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto core : cores)
+        CPU_SET(core, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+inline bool pin_thread(const unsigned core)
+{
+    return pin_thread(std::vector<unsigned> {core});
+}
+
+} // namespace matching_engine
@@ -0,0 +1,395 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <orderbook.hpp>
+
+namespace matching_engine
+{
+
+/* Three-level occupancy bitmap – every bit of an upper level flags a non-empty word below it */
+class OccupancyBitmap
+{
+public:
+    static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+    static constexpr std::size_t max_capacity = 64 * 64 * 64;
+    explicit OccupancyBitmap(std::size_t capacity):
+        leaves_((capacity + 63) / 64),
+        nodes_((leaves_.size() + 63) / 64),
+        root_{0} {}
+    void set(std::size_t index);
+    void reset(std::size_t index);
+    bool test(std::size_t index) const;
+    bool empty() const;
+    std::size_t lowest() const;
+    std::size_t highest() const;
+    /* Closest set bit strictly above/below the index, npos if none */
+    std::size_t next_higher(std::size_t index) const;
+    std::size_t next_lower(std::size_t index) const;
+    void prefetch(std::size_t index) const;
+private:
+    static uint64_t above(uint64_t word, std::size_t bit)
+    {
+        return bit >= 63 ? 0 : word & (~uint64_t{0} << (bit + 1));
+    }
+    static uint64_t below(uint64_t word, std::size_t bit)
+    {
+        return word & ((uint64_t{1} << bit) - 1);
+    }
+    static std::size_t first(uint64_t word)
+    {
+        return __builtin_ctzll(word);
+    }
+    static std::size_t last(uint64_t word)
+    {
+        return 63 - __builtin_clzll(word);
+    }
+    std::vector<uint64_t> leaves_;
+    std::vector<uint64_t> nodes_;
+    uint64_t root_;
+};
+
+/*
+ * Dense array of price levels indexed by (price - base) / tick.
+ *
+ * The window re-centres itself when a price drifts outside of it and the occupied levels
+ * still fit; unaligned or far away prices are parked in an overflow tree.
+ */
+class PriceLadder
+{
+private:
+    using map_allocator = boost::container::adaptive_pool<std::pair<const Price, OrderQueue>>;
+    using overflow_type = boost::container::map<Price, OrderQueue, std::less<Price>, map_allocator>;
+    const SIDE side_;
+    const Price tick_;
+    const std::size_t capacity_;
+    Price base_;
+    std::vector<OrderQueue> levels_;
+    OccupancyBitmap occupancy_;
+    overflow_type overflow_;
+
+    bool in_window_(Price price) const;
+    std::size_t index_(Price price) const;
+    Price price_(std::size_t index) const;
+    bool better_(Price lhs, Price rhs) const;
+    std::size_t best_index_() const;
+    std::size_t next_index_(std::size_t index) const;
+    overflow_type::iterator overflow_best_();
+    bool best_in_ladder_() const;
+    Price centered_base_(Price price) const;
+    bool recenter_(Price price);
+    void rebase_(Price base);
+public:
+    PriceLadder(const SIDE side, const Price tick = 1, const std::size_t window = 4096):
+        side_{side},
+        tick_{std::max(Price{1}, tick)},
+        capacity_{std::min(std::max(window, std::size_t{64}), OccupancyBitmap::max_capacity)},
+        base_{0},
+        levels_(capacity_),
+        occupancy_{capacity_} {}
+    PriceLadder(const PriceLadder &) = delete;
+    PriceLadder& operator=(const PriceLadder&) = delete;
+    bool empty() const;
+    Price best_price() const;
+    OrderQueue &best();
+    void erase_best();
+    OrderQueue *find(Price price);
+    OrderQueue &emplace(Price price);
+    void erase(Price price);
+    void prefetch(Price price) const;
+    template <typename visitor_type>
+    void for_each(visitor_type &&visitor, std::size_t limit) const;
+};
+
+using LadderOrderBook = BasicOrderBook<PriceLadder>;
+
+void OccupancyBitmap::set(const std::size_t index)
+{
+    const auto word = index >> 6;
+    leaves_[word] |= uint64_t{1} << (index & 63);
+    nodes_[word >> 6] |= uint64_t{1} << (word & 63);
+    root_ |= uint64_t{1} << (word >> 6);
+}
+
+void OccupancyBitmap::reset(const std::size_t index)
+{
+    const auto word = index >> 6;
+    leaves_[word] &= ~(uint64_t{1} << (index & 63));
+    if (leaves_[word] == 0) {
+        nodes_[word >> 6] &= ~(uint64_t{1} << (word & 63));
+        if (nodes_[word >> 6] == 0)
+            root_ &= ~(uint64_t{1} << (word >> 6));
+    }
+}
+
+bool OccupancyBitmap::test(const std::size_t index) const
+{
+    return leaves_[index >> 6] & (uint64_t{1} << (index & 63));
+}
+
+bool OccupancyBitmap::empty() const
+{
+    return root_ == 0;
+}
+
+std::size_t OccupancyBitmap::lowest() const
+{
+    const auto node = first(root_);
+    const auto word = node * 64 + first(nodes_[node]);
+    return word * 64 + first(leaves_[word]);
+}
+
+std::size_t OccupancyBitmap::highest() const
+{
+    const auto node = last(root_);
+    const auto word = node * 64 + last(nodes_[node]);
+    return word * 64 + last(leaves_[word]);
+}
+
+void OccupancyBitmap::prefetch(const std::size_t index) const
+{
+    __builtin_prefetch(&leaves_[index >> 6], 1);
+}
+
+std::size_t OccupancyBitmap::next_higher(const std::size_t index) const
+{
+    auto word = index >> 6;
+    if (auto bits = above(leaves_[word], index & 63))
+        return word * 64 + first(bits);
+    auto node = word >> 6;
+    if (auto words = above(nodes_[node], word & 63)) {
+        word = node * 64 + first(words);
+        return word * 64 + first(leaves_[word]);
+    }
+    if (auto nodes = above(root_, node)) {
+        node = first(nodes);
+        word = node * 64 + first(nodes_[node]);
+        return word * 64 + first(leaves_[word]);
+    }
+    return npos;
+}
+
+std::size_t OccupancyBitmap::next_lower(const std::size_t index) const
+{
+    auto word = index >> 6;
+    if (auto bits = below(leaves_[word], index & 63))
+        return word * 64 + last(bits);
+    auto node = word >> 6;
+    if (auto words = below(nodes_[node], word & 63)) {
+        word = node * 64 + last(words);
+        return word * 64 + last(leaves_[word]);
+    }
+    if (auto nodes = below(root_, node)) {
+        node = last(nodes);
+        word = node * 64 + last(nodes_[node]);
+        return word * 64 + last(leaves_[word]);
+    }
+    return npos;
+}
+
+bool PriceLadder::in_window_(const Price price) const
+{
+    return price >= base_ && (price - base_) % tick_ == 0 &&
+           (price - base_) / tick_ < capacity_;
+}
+
+std::size_t PriceLadder::index_(const Price price) const
+{
+    return (price - base_) / tick_;
+}
+
+Price PriceLadder::price_(const std::size_t index) const
+{
+    return base_ + index * tick_;
+}
+
+bool PriceLadder::better_(const Price lhs, const Price rhs) const
+{
+    return side_ == SIDE::BUY ? lhs > rhs : lhs < rhs;
+}
+
+std::size_t PriceLadder::best_index_() const
+{
+    return side_ == SIDE::BUY ? occupancy_.highest() : occupancy_.lowest();
+}
+
+std::size_t PriceLadder::next_index_(const std::size_t index) const
+{
+    return side_ == SIDE::BUY ? occupancy_.next_lower(index) : occupancy_.next_higher(index);
+}
+
+PriceLadder::overflow_type::iterator PriceLadder::overflow_best_()
+{
+    return side_ == SIDE::BUY ? std::prev(overflow_.end()) : overflow_.begin();
+}
+
+bool PriceLadder::best_in_ladder_() const
+{
+    if (occupancy_.empty())
+        return false;
+    if (overflow_.empty())
+        return true;
+    const auto overflow_best = side_ == SIDE::BUY ? overflow_.rbegin()->first : overflow_.begin()->first;
+    return better_(price_(best_index_()), overflow_best);
+}
+
+Price PriceLadder::centered_base_(const Price price) const
+{
+    return price - std::min<Price>(price / tick_, capacity_ / 2) * tick_;
+}
+
+bool PriceLadder::recenter_(const Price price)
+{
+    if (occupancy_.empty()) {
+        rebase_(centered_base_(price));
+        return true;
+    }
+    if (price < base_ ? (base_ - price) % tick_ : (price - base_) % tick_)
+        return false; /* Unaligned price never fits the ladder */
+    const auto low = std::min(price, price_(occupancy_.lowest()));
+    const auto high = std::max(price, price_(occupancy_.highest()));
+    const auto span = (high - low) / tick_;
+    if (span >= capacity_)
+        return false;
+    const auto slack = (capacity_ - 1 - span) / 2;
+    rebase_(low - std::min<Price>(low / tick_, slack) * tick_);
+    return true;
+}
+
+void PriceLadder::rebase_(const Price base)
+{
+    if (base == base_)
+        return;
+    if (!occupancy_.empty()) {
+        /* Shift occupied levels; walk against the shift so that target slots are already vacated */
+        if (base < base_) {
+            const auto shift = (base_ - base) / tick_;
+            for (auto index = occupancy_.highest(); index != OccupancyBitmap::npos;
+                 index = occupancy_.next_lower(index)) {
+                levels_[index].swap(levels_[index + shift]);
+                occupancy_.reset(index);
+                occupancy_.set(index + shift);
+            }
+        } else {
+            const auto shift = (base - base_) / tick_;
+            for (auto index = occupancy_.lowest(); index != OccupancyBitmap::npos;
+                 index = occupancy_.next_higher(index)) {
+                levels_[index].swap(levels_[index - shift]);
+                occupancy_.reset(index);
+                occupancy_.set(index - shift);
+            }
+        }
+    }
+    base_ = base;
+    /* Pull parked levels which now fall inside of the window */
+    const auto ceiling = price_(capacity_ - 1);
+    for (auto node = overflow_.lower_bound(base_), end = overflow_.end();
+         node != end && node->first <= ceiling;) {
+        if (in_window_(node->first)) {
+            const auto index = index_(node->first);
+            levels_[index].swap(node->second);
+            occupancy_.set(index);
+            node = overflow_.erase(node);
+        } else {
+            ++node;
+        }
+    }
+}
+
+bool PriceLadder::empty() const
+{
+    return occupancy_.empty() && overflow_.empty();
+}
+
+Price PriceLadder::best_price() const
+{
+    if (best_in_ladder_())
+        return price_(best_index_());
+    return side_ == SIDE::BUY ? overflow_.rbegin()->first : overflow_.begin()->first;
+}
+
+OrderQueue &PriceLadder::best()
+{
+    if (best_in_ladder_())
+        return levels_[best_index_()];
+    return overflow_best_()->second;
+}
+
+void PriceLadder::erase_best()
+{
+    if (best_in_ladder_())
+        erase(price_(best_index_()));
+    else
+        overflow_.erase(overflow_best_());
+}
+
+OrderQueue *PriceLadder::find(const Price price)
+{
+    if (in_window_(price)) {
+        const auto index = index_(price);
+        return occupancy_.test(index) ? &levels_[index] : nullptr;
+    }
+    auto node = overflow_.find(price);
+    return node != overflow_.end() ? &node->second : nullptr;
+}
+
+OrderQueue &PriceLadder::emplace(const Price price)
+{
+    if (!in_window_(price) && !recenter_(price))
+        return overflow_.try_emplace(price).first->second;
+    const auto index = index_(price);
+    occupancy_.set(index);
+    return levels_[index];
+}
+
+void PriceLadder::erase(const Price price)
+{
+    if (!in_window_(price)) {
+        overflow_.erase(price);
+        return;
+    }
+    occupancy_.reset(index_(price));
+    /* Market drifted away from the window; follow it */
+    if (occupancy_.empty() && !overflow_.empty())
+        rebase_(centered_base_(overflow_best_()->first));
+}
+
+void PriceLadder::prefetch(const Price price) const
+{
+    if (in_window_(price)) {
+        const auto index = index_(price);
+        __builtin_prefetch(&levels_[index], 1);
+        occupancy_.prefetch(index);
+    }
+}
+
+template <typename visitor_type>
+void PriceLadder::for_each(visitor_type &&visitor, const std::size_t limit) const
+{
+    /* Merge parked levels with the window in priority order */
+    std::vector<std::pair<Price, const OrderQueue*>> parked;
+    auto park = [&](auto first, auto last) {
+        for (; parked.size() < limit && first != last; ++first)
+            parked.emplace_back(first->first, &first->second);
+    };
+    if (side_ == SIDE::BUY)
+        park(overflow_.rbegin(), overflow_.rend());
+    else
+        park(overflow_.begin(), overflow_.end());
+    auto index = occupancy_.empty() ? OccupancyBitmap::npos : best_index_();
+    auto next = parked.cbegin();
+    for (auto count = std::size_t{0}; count < limit; ++count) {
+        const auto has_index = index != OccupancyBitmap::npos;
+        if (!has_index && next == parked.cend())
+            break;
+        if (has_index && (next == parked.cend() || better_(price_(index), next->first))) {
+            visitor(price_(index), levels_[index]);
+            index = next_index_(index);
+        } else {
+            visitor(next->first, *next->second);
+            ++next;
+        }
+    }
+}
+
+} // namespace matching_engine
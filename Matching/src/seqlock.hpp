@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace matching_engine
+{
+
+/*
+ * Single-writer/multi-reader cell. The writer never waits; readers retry while a store
+ * is in flight. The value is copied word by word through relaxed atomics so that the
+ * racing reads stay well defined.
+ */
+template <typename T>
+class alignas(64) Seqlock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "value must be POD");
+    static_assert(sizeof(T) % sizeof(uint64_t) == 0, "value must be made of whole words");
+private:
+    static constexpr std::size_t words_ = sizeof(T) / sizeof(uint64_t);
+    std::atomic<uint64_t> sequence_{0}; /* Odd while a store is in flight */
+    std::array<std::atomic<uint64_t>, words_> value_{};
+public:
+    Seqlock() = default;
+    Seqlock(const Seqlock &) = delete;
+    Seqlock& operator=(const Seqlock&) = delete;
+    /* Writer thread only */
+    void store(const T &value);
+    /* Any thread; spins while the writer is in the middle of a store */
+    T load() const;
+    /* Number of completed stores */
+    uint64_t version() const;
+};
+
+template <typename T>
+void Seqlock<T>::store(const T &value)
+{
+    std::array<uint64_t, words_> words;
+    std::memcpy(words.data(), &value, sizeof(T));
+    const auto sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t word = 0; word < words_; ++word)
+        value_[word].store(words[word], std::memory_order_relaxed);
+    sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+template <typename T>
+T Seqlock<T>::load() const
+{
+    std::array<uint64_t, words_> words;
+    for (;;) {
+        const auto before = sequence_.load(std::memory_order_acquire);
+        if (before & 1) {
+            __builtin_ia32_pause();
+            continue;
+        }
+        for (std::size_t word = 0; word < words_; ++word)
+            words[word] = value_[word].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence_.load(std::memory_order_relaxed) == before)
+            break;
+    }
+    T value;
+    std::memcpy(&value, words.data(), sizeof(T));
+    return value;
+}
+
+template <typename T>
+uint64_t Seqlock<T>::version() const
+{
+    return sequence_.load(std::memory_order_acquire) / 2;
+}
+
+} // namespace matching_engine
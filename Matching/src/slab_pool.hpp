@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace matching_engine
+{
+
+/*
+ * Fixed-size object pool carved out of large chunks.
+ *
+ * Released slots are threaded onto an intrusive free list and handed out again
+ * before any new chunk is requested, so a book in steady state never calls malloc.
+ * Objects still alive when the pool dies are not destroyed – keep T trivially disposable.
+ */
+template <typename T, std::size_t chunk_size = 4096>
+class SlabPool
+{
+private:
+    union slot {
+        slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+    std::vector<std::unique_ptr<slot[]>> chunks_;
+    slot *free_;
+    std::size_t used_; /* Slots handed out from the latest chunk */
+    std::size_t live_;
+public:
+    SlabPool(): free_{nullptr}, used_{chunk_size}, live_{0} {}
+    SlabPool(const SlabPool &) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+    template <typename... args>
+    T *acquire(args &&... rest);
+    void release(T *object);
+    std::size_t size() const;
+    std::size_t capacity() const;
+};
+
+template <typename T, std::size_t chunk_size>
+template <typename... args>
+T *SlabPool<T, chunk_size>::acquire(args &&... rest)
+{
+    slot *place;
+    if (free_ != nullptr) { /* Recycle the most recently released (hot) slot */
+        place = free_;
+        free_ = free_->next;
+    } else {
+        if (used_ == chunk_size) {
+            chunks_.emplace_back(new slot[chunk_size]);
+            used_ = 0;
+        }
+        place = &chunks_.back()[used_++];
+    }
+    ++live_;
+    return new (place->storage) T(std::forward<args>(rest)...);
+}
+
+template <typename T, std::size_t chunk_size>
+void SlabPool<T, chunk_size>::release(T *object)
+{
+    object->~T();
+    auto place = reinterpret_cast<slot *>(object);
+    place->next = free_;
+    free_ = place;
+    --live_;
+}
+
+template <typename T, std::size_t chunk_size>
+std::size_t SlabPool<T, chunk_size>::size() const
+{
+    return live_;
+}
+
+template <typename T, std::size_t chunk_size>
+std::size_t SlabPool<T, chunk_size>::capacity() const
+{
+    return chunks_.size() * chunk_size;
+}
+
+} // namespace matching_engine
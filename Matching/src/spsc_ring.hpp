@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+namespace matching_engine
+{
+
+/*
+ * Bounded lock-free queue for exactly one producer and one consumer thread.
+ * Each side caches the other side's index and only reloads it when the ring looks
+ * full (producer) or empty (consumer), so the shared lines are touched rarely.
+ */
+template <typename T, std::size_t capacity>
+class SpscRing
+{
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+    static_assert(std::is_trivially_copyable<T>::value, "elements must be POD");
+private:
+    alignas(64) std::atomic<std::size_t> head_{0}; /* Next slot to read */
+    std::size_t cached_tail_ = 0;                  /* Consumer's view of tail_ */
+    alignas(64) std::atomic<std::size_t> tail_{0}; /* Next slot to write */
+    std::size_t cached_head_ = 0;                  /* Producer's view of head_ */
+    alignas(64) std::array<T, capacity> slots_;
+public:
+    SpscRing() = default;
+    SpscRing(const SpscRing &) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+    /* Producer side; false if full, or if it already holds `limit` elements */
+    bool push(const T &value, std::size_t limit = capacity);
+    /* Slots the producer can fill without failing */
+    std::size_t free();
+    /* Consumer side; nullptr if empty. The element stays valid until pop() */
+    const T *front();
+    void pop();
+    /* Approximate from any other thread */
+    std::size_t size() const;
+    /* Number of elements ever pushed and popped; any thread */
+    std::size_t pushed() const;
+    std::size_t popped() const;
+    static constexpr std::size_t max_size()
+    {
+        return capacity;
+    }
+};
+
+template <typename T, std::size_t capacity>
+bool SpscRing<T, capacity>::push(const T &value, const std::size_t limit)
+{
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ >= limit) {
+        cached_head_ = head_.load(std::memory_order_acquire);
+        if (tail - cached_head_ >= limit)
+            return false;
+    }
+    slots_[tail & (capacity - 1)] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T, std::size_t capacity>
+std::size_t SpscRing<T, capacity>::free()
+{
+    cached_head_ = head_.load(std::memory_order_acquire);
+    return capacity - (tail_.load(std::memory_order_relaxed) - cached_head_);
+}
+
+template <typename T, std::size_t capacity>
+const T *SpscRing<T, capacity>::front()
+{
+    const auto head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+        if (head == cached_tail_)
+            return nullptr;
+    }
+    return &slots_[head & (capacity - 1)];
+}
+
+template <typename T, std::size_t capacity>
+void SpscRing<T, capacity>::pop()
+{
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+template <typename T, std::size_t capacity>
+std::size_t SpscRing<T, capacity>::size() const
+{
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+}
+
+template <typename T, std::size_t capacity>
+std::size_t SpscRing<T, capacity>::pushed() const
+{
+    return tail_.load(std::memory_order_acquire);
+}
+
+template <typename T, std::size_t capacity>
+std::size_t SpscRing<T, capacity>::popped() const
+{
+    return head_.load(std::memory_order_acquire);
+}
+
+} // namespace matching_engine
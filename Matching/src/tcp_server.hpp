@@ -1,13 +1,20 @@
 #pragma once
 
+#include <charconv>
+#include <memory_resource>
+#include <optional>
+#include <type_traits>
 #include <boost/asio.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/container/static_vector.hpp>
 #include <boost/lexical_cast.hpp>
 #include <nlohmann/json.hpp>
 #include <order_router.hpp>
+#include <binary_protocol.hpp>
+#include <event_loop.hpp>
 
 namespace matching_engine
 {
@@ -15,13 +22,127 @@ namespace tcp
 {
 using boost::asio::ip::tcp;
 namespace http = boost::beast::http;
-using request_t = http::request<boost::beast::http::string_body>;
-using response_t = http::response<boost::beast::http::string_body>;
+/* Requests live in an arena of their connection which is reset for every request */
+using arena_allocator = std::pmr::polymorphic_allocator<char>;
+using request_t = http::request<http::basic_string_body<char, std::char_traits<char>, arena_allocator>,
+      http::basic_fields<arena_allocator>>;
+using request_parser_t = http::request_parser<request_t::body_type, arena_allocator>;
 
+/*
+ * Memory for the asynchronous operations of one chain (e.g. the reads of a connection),
+ * of which only a few are alive at a time: a handful of fixed slots, falling back to the
+ * heap when they are taken or too small. Only used from the chain, so not thread-safe.
+ */
+class handler_memory
+{
+public:
+    static constexpr std::size_t slots = 4;
+    static constexpr std::size_t slot_size = 1024;
+    handler_memory() = default;
+    handler_memory(const handler_memory &) = delete;
+    handler_memory& operator=(const handler_memory&) = delete;
+    void *allocate(const std::size_t size)
+    {
+        if (size <= slot_size) {
+            for (std::size_t slot = 0; slot < slots; ++slot) {
+                if (!(used_ & (1u << slot))) {
+                    used_ |= 1u << slot;
+                    return &storage_[slot];
+                }
+            }
+        }
+        return ::operator new(size);
+    }
+    void deallocate(void *pointer)
+    {
+        const auto first = reinterpret_cast<std::uintptr_t>(storage_.data());
+        const auto address = reinterpret_cast<std::uintptr_t>(pointer);
+        if (address >= first && address < first + sizeof(storage_))
+            used_ &= ~(1u << ((address - first) / sizeof(slot_type)));
+        else
+            ::operator delete(pointer);
+    }
+private:
+    using slot_type = std::aligned_storage_t<slot_size, alignof(std::max_align_t)>;
+    std::array<slot_type, slots> storage_;
+    unsigned used_ = 0;
+};
+
+template <typename T>
+class handler_allocator
+{
+public:
+    using value_type = T;
+    explicit handler_allocator(handler_memory &memory): memory_{memory} {}
+    template <typename U>
+    handler_allocator(const handler_allocator<U> &other) noexcept: memory_{other.memory_} {}
+    T *allocate(const std::size_t count)
+    {
+        return static_cast<T *>(memory_.allocate(sizeof(T) * count));
+    }
+    void deallocate(T *pointer, std::size_t)
+    {
+        memory_.deallocate(pointer);
+    }
+    template <typename U>
+    bool operator==(const handler_allocator<U> &other) const noexcept
+    {
+        return &memory_ == &other.memory_;
+    }
+    template <typename U>
+    bool operator!=(const handler_allocator<U> &other) const noexcept
+    {
+        return &memory_ != &other.memory_;
+    }
+private:
+    template <typename> friend class handler_allocator;
+    handler_memory &memory_;
+};
+
+/* Completion handler whose operations are allocated from the given handler_memory */
+template <typename handler_type>
+class memory_bound_handler
+{
+public:
+    using allocator_type = handler_allocator<handler_type>;
+    memory_bound_handler(handler_memory &memory, handler_type handler):
+        memory_{memory}, handler_{std::move(handler)} {}
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type{memory_};
+    }
+    template <typename... argument_types>
+    void operator()(argument_types &&... arguments)
+    {
+        handler_(std::forward<argument_types>(arguments)...);
+    }
+private:
+    handler_memory &memory_;
+    handler_type handler_;
+};
+
+template <typename handler_type>
+memory_bound_handler<std::decay_t<handler_type>> bind_memory(handler_memory &memory, handler_type &&handler)
+{
+    return {memory, std::forward<handler_type>(handler)};
+}
+
+/*
+ * HTTP connection. Once its buffers have grown, a request makes no heap allocation: the
+ * request is parsed into an arena of the connection, path params are views into it,
+ * responses are formatted from preformatted heads into a reused buffer, and operations
+ * are allocated from handler_memory.
+ */
 class connection_handler
     : public std::enable_shared_from_this<connection_handler>
 {
 public:
+    /* Responses waiting for the socket before the connection stops reading requests */
+    static constexpr std::size_t max_pipelined = 64;
+    /* Path segments of a request; further ones are ignored */
+    static constexpr std::size_t max_params = 8;
+    using params_t = boost::container::static_vector<std::string_view, max_params>;
+
     connection_handler(boost::asio::io_context &ioc,
                        const std::shared_ptr<router::dispatcher> dispatcher,
                        const std::shared_ptr<spdlog::logger>& console)
@@ -30,12 +151,21 @@ public:
 
     connection_handler(const connection_handler&) = delete;
 
+    /*
+     * Reads the next request. Keep-alive requests are pipelined: the next one is read as
+     * soon as a request is handled, while responses are written in order behind it.
+     */
     void dispatch()
     {
         auto self = shared_from_this();
+        parser_.reset();
+        arena_.release();
+        parser_.emplace(std::piecewise_construct, std::make_tuple(arena_allocator{&arena_}),
+                        std::make_tuple(arena_allocator{&arena_}));
         http::async_read(
-            socket_, buffer_, request_,
-        [this, self](boost::system::error_code ec, std::size_t) {
+            socket_, buffer_, *parser_,
+        boost::asio::bind_executor(*strand_, bind_memory(read_memory_, [this, self](boost::system::error_code ec,
+        std::size_t) {
             if (ec == http::error::end_of_stream) {
                 return;
             }
@@ -43,39 +173,59 @@ public:
                 console_->error("connection_handler::async_read: {}", ec.message());
                 return;
             }
-            //logger_->info("connection_handler::async_read: {}", request_.target().to_string());
+            const auto &request = parser_->get();
+            //logger_->info("connection_handler::async_read: {}", request.target().to_string());
+            router::command traced{};
+            if (dispatcher_->tracer() != nullptr)
+                traced.origin.read = trace::clock::now();
 
-            std::string_view target = request_.target();
+            std::string_view target = request.target();
             //boost::trim_if(target, [](auto ch) { return ch == '/'; });
-            std::vector<std::string_view> params;
-            //boost::split(params, target, [](auto ch) { return ch == '/'; },
-            //    boost::token_compress_on);
-
-            size_t first = 0;
-            while (first < target.size()) {
-                const auto second = target.find_first_of('/', first);
-                if (first != second) params.emplace_back(target.substr(first, second-first));
-                if (second == std::string_view::npos) break;
-                first = second + 1;
-            }
+            const auto params = split_(target);
 
             //std::ostringstream ss;
-            http::status status;
-            if (params.size() < 4 or target.find(u8"favicon.ico") != std::string_view::npos) {
+            http::status status = http::status::bad_request;
+            body_.clear();
+            /*
+             * /BUY|SELL/market/price/quantity, /AMEND/market/id/price/quantity, /CANCEL/market/id,
+             * /QUOTE/market and /BATCH with one order per body line; markets are registered on admin_server
+             */
+            const auto market = params.size() >= 2 ? dispatcher_->market(params[1]) : nullptr;
+            if (params.size() == 2 and params[0] == u8"QUOTE") {
+                if (market == nullptr) {
+                    console_->warn("connection_handler::async_read: Invalid quote {}", target);
+                } else {
+                    status = http::status::ok;
+                    quote_body_(*market, dispatcher_->top_of_book(market->id));
+                }
+            } else if (params.size() == 1 and params[0] == u8"BATCH") {
+                status = http::status::ok;
+                batch_(request.body(), traced.origin.read);
+            } else if (params.size() < 3 or target.find(u8"favicon.ico") != std::string_view::npos) {
                 console_->warn("connection_handler::async_read: Invalid request");
                 //ss << nlohmann::json::parse("{\"target\":\""+target+"\",\"status\": \"FAILED\",\"origin\":\"" +
                 //    boost::lexical_cast<std::string>(socket_.remote_endpoint()) + "\"}");
-                status = http::status::bad_request;
+            } else if (auto task = command_(params)) {
+                auto origin = parsed_(traced, *task);
+                if (dispatcher_->dispatch(*task, origin)) {
+                    status = http::status::ok;
+                    id_body_(task->id);
+                } else {
+                    /* The market's consumer is saturated; the client may retry later */
+                    status = http::status::service_unavailable;
+                }
             } else {
-                SIDE side = params[0] == u8"BUY" ? SIDE::BUY : SIDE::SELL;
-                std::string_view market = dispatcher_->registered_market_name(params[1]);
-                Price price = std::stod(params[2].data());
-                Quantity quantity = std::stod(params[3].data());
-                dispatcher_->send(std::move(std::make_unique<Order>(market, side, price, quantity)));
-                status = http::status::ok;
+                console_->warn("connection_handler::async_read: Invalid order {}", target);
             }
-            self->strand_->dispatch([self, status] { self->reply(status); });
-        });
+            const auto keep_alive = request.keep_alive();
+            reply(status, request.version(), keep_alive, traced);
+            if (!keep_alive)
+                return;
+            if (queued_ < max_pipelined)
+                dispatch();
+            else
+                paused_ = true; /* The client does not read its responses; resumed by write_() */
+        })));
     }
 
     tcp::socket &socket()
@@ -89,108 +239,665 @@ public:
     }
 
 private:
-    response_t static build_response(http::status status,
-                                     http::request<http::string_body> &req)
+    static params_t split_(const std::string_view target)
     {
-        response_t res{status, req.version()};
-        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-        res.set(http::field::content_type, "application/json");
-        res.keep_alive(req.keep_alive());
-        //res.body() = std::string(msg);
-        res.prepare_payload();
-        return res;
+        params_t params;
+        //boost::split(params, target, [](auto ch) { return ch == '/'; },
+        //    boost::token_compress_on);
+        size_t first = 0;
+        while (first < target.size() && params.size() < max_params) {
+            const auto second = target.find_first_of('/', first);
+            if (first != second) params.emplace_back(target.substr(first, second-first));
+            if (second == std::string_view::npos) break;
+            first = second + 1;
+        }
+        return params;
+    }
+
+    /*
+     * BUY|SELL/market/price/quantity, AMEND/market/id/price/quantity or CANCEL/market/id
+     * as a command; decimal price/quantity are converted into ticks/lots of the market once, here.
+     * nullopt if malformed. A new order gets its id, which later amends and cancels refer to.
+     */
+    std::optional<router::command> command_(const params_t &params) const
+    {
+        const auto market = params.size() >= 3 ? dispatcher_->market(params[1]) : nullptr;
+        if (market == nullptr)
+            return std::nullopt;
+        router::command task{};
+        task.market = market->id;
+        if (params[0] == u8"CANCEL") {
+            const auto id = order_id_(params[2]);
+            if (!id)
+                return std::nullopt;
+            task.type = router::COMMAND::CANCEL;
+            task.id = *id;
+            return task;
+        }
+        if (params[0] == u8"AMEND") {
+            const auto id = params.size() >= 5 ? order_id_(params[2]) : std::nullopt;
+            const auto price = id ? market->ticks(params[3]) : std::nullopt;
+            const auto quantity = id ? market->lots(params[4]) : std::nullopt;
+            if (!price || !quantity || *quantity == 0)
+                return std::nullopt;
+            task.type = router::COMMAND::AMEND;
+            task.id = *id;
+            task.price = *price;
+            task.quantity = *quantity;
+            return task;
+        }
+        if (params[0] != u8"BUY" && params[0] != u8"SELL")
+            return std::nullopt;
+        const auto price = params.size() >= 4 ? market->ticks(params[2]) : std::nullopt;
+        const auto quantity = price ? market->lots(params[3]) : std::nullopt;
+        if (!price || !quantity || *quantity == 0)
+            return std::nullopt;
+        task.type = router::COMMAND::NEW;
+        task.side = params[0] == u8"BUY" ? SIDE::BUY : SIDE::SELL;
+        task.id = next_order_id();
+        task.price = *price;
+        task.quantity = *quantity;
+        return task;
+    }
+
+    /*
+     * Orders of a batch request, one per line in the syntax of the URLs (e.g. BUY/EUR_USD/1.1/2),
+     * dispatched in one pass. Answers [[status,id],...] in the order of the lines.
+     */
+    void batch_(const std::string_view lines, const uint64_t read)
+    {
+        batch_tasks_.clear();
+        batch_valid_.clear();
+        for (std::size_t first = 0; first < lines.size();) {
+            auto last = lines.find('\n', first);
+            if (last == std::string_view::npos)
+                last = lines.size();
+            auto line = lines.substr(first, last - first);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            first = last + 1;
+            if (line.empty())
+                continue;
+            auto task = command_(split_(line));
+            batch_valid_.push_back(task.has_value());
+            if (!task)
+                continue;
+            if (read != 0) {
+                task->origin.read = read;
+                task->origin.parsed = trace::clock::now();
+            }
+            batch_tasks_.push_back(*task);
+        }
+        dispatcher_->dispatch(batch_tasks_, batch_admitted_);
+        body_ += '[';
+        for (std::size_t line = 0, task = 0; line < batch_valid_.size(); ++line) {
+            if (line != 0)
+                body_ += ',';
+            if (!batch_valid_[line]) {
+                body_ += "[400,0]";
+                continue;
+            }
+            fmt::format_to(std::back_inserter(body_), "[{},{}]", batch_admitted_[task] ? 200 : 503,
+                           batch_admitted_[task] ? batch_tasks_[task].id : 0);
+            ++task;
+        }
+        body_ += ']';
     }
 
-    void reply(http::status status)
+    /* Stamps PARSED of a traced request; the stamps to dispatch it with, or nullptr if untraced */
+    static trace::origin *parsed_(router::command &traced, const router::command &task)
+    {
+        if (traced.origin.read == 0)
+            return nullptr;
+        traced.type = task.type;
+        traced.market = task.market;
+        traced.id = task.id;
+        traced.origin.parsed = trace::clock::now();
+        return &traced.origin;
+    }
+
+    static std::optional<OrderId> order_id_(const std::string_view text)
+    {
+        OrderId id = 0;
+        const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), id);
+        if (ec != std::errc{} || end != text.data() + text.size() || id == 0)
+            return std::nullopt;
+        return id;
+    }
+
+    void id_body_(const OrderId id)
+    {
+        fmt::format_to(std::back_inserter(body_), "{{\"id\":{}}}", id);
+    }
+
+    void quote_body_(const market_spec &market, const TopOfBook &top)
+    {
+        fmt::format_to(std::back_inserter(body_), "{{\"bid\":{},\"bid_quantity\":{},\"ask\":{},\"ask_quantity\":{},"
+                       "\"last_price\":{},\"last_quantity\":{},\"sequence\":{}}}",
+                       market.tick.value(top.bid), market.lot.value(top.bid_quantity),
+                       market.tick.value(top.ask), market.lot.value(top.ask_quantity),
+                       market.tick.value(top.last_price), market.lot.value(top.last_quantity),
+                       top.sequence);
+    }
+
+    /* Status line and fixed headers of every status the handler answers with, formatted once */
+    static std::string_view head_(const http::status status)
+    {
+        static const auto heads = [] {
+            std::array<std::string, 3> formatted;
+            const http::status statuses[] = {http::status::ok, http::status::bad_request,
+                                             http::status::service_unavailable
+                                            };
+            for (std::size_t index = 0; index < formatted.size(); ++index) {
+                formatted[index] = fmt::format("{} {}\r\nServer: {}\r\nContent-Type: application/json\r\n",
+                                               unsigned(statuses[index]), http::obsolete_reason(statuses[index]),
+                                               BOOST_BEAST_VERSION_STRING);
+            }
+            return formatted;
+        }();
+        switch (status) {
+        case http::status::ok: return heads[0];
+        case http::status::service_unavailable: return heads[2];
+        default: return heads[1];
+        }
+    }
+
+    /* Appends the response to the current request to the write queue; responses go out in request order */
+    void reply(const http::status status, const unsigned version, const bool keep_alive,
+               const router::command &traced)
+    {
+        pending_ += version == 10 ? "HTTP/1.0 " : "HTTP/1.1 ";
+        pending_ += head_(status);
+        if (version == 10 && keep_alive)
+            pending_ += "Connection: keep-alive\r\n";
+        else if (version != 10 && !keep_alive)
+            pending_ += "Connection: close\r\n";
+        fmt::format_to(std::back_inserter(pending_), "Content-Length: {}\r\n\r\n", body_.size());
+        pending_ += body_;
+        if (traced.origin.enqueued != 0)
+            pending_traced_.push_back(traced);
+        closing_ = !keep_alive;
+        ++queued_;
+        if (!writing_)
+            write_();
+    }
+
+    /* Writes every queued response in one go */
+    void write_()
     {
         auto self = shared_from_this();
-        auto response = std::make_shared<response_t>(
-                            build_response(status, request_));
-        http::async_write(
-            socket_, *response,
-        [this, self, response](boost::system::error_code ec, std::size_t) {
+        written_.swap(pending_);
+        written_traced_.swap(pending_traced_);
+        queued_ = 0;
+        writing_ = true;
+        boost::asio::async_write(
+            socket_, boost::asio::buffer(written_),
+        boost::asio::bind_executor(*strand_, bind_memory(write_memory_, [this, self](boost::system::error_code ec,
+        std::size_t) {
             if (ec) {
                 console_->error("server::async_write: {}", ec.message());
                 return;
             }
-            if (response->need_eof())
+            writing_ = false;
+            written_.clear();
+            if (!written_traced_.empty()) {
+                const auto acked = trace::clock::now();
+                for (const auto &traced : written_traced_) {
+                    const auto &origin = traced.origin;
+                    dispatcher_->tracer()->record_stages(traced.id, traced.market, traced.type, {origin.read,
+                                                         origin.parsed, origin.enqueued, 0, 0, 0, acked});
+                }
+                written_traced_.clear();
+            }
+            if (!pending_.empty())
+                write_();
+            else if (closing_)
                 return;
-
-            if (!ec)
-                self->strand_->dispatch([self] { self->dispatch(); });
-        });
+            if (paused_ && queued_ < max_pipelined) {
+                paused_ = false;
+                dispatch();
+            }
+        })));
     }
 
     tcp::socket socket_;
     std::unique_ptr<boost::asio::io_context::strand> strand_;
     boost::asio::io_context::work work_;
     boost::beast::flat_buffer buffer_;
-    request_t request_;
+    std::array<std::byte, 4096> arena_buffer_;
+    std::pmr::monotonic_buffer_resource arena_{arena_buffer_.data(), arena_buffer_.size()};
+    std::optional<request_parser_t> parser_;
+    std::string body_;                           /* Of the response being built */
+    std::string pending_;                        /* Responses not yet written */
+    std::string written_;                        /* Responses being written */
+    std::vector<router::command> pending_traced_; /* Traced commands of those responses */
+    std::vector<router::command> written_traced_;
+    std::size_t queued_ = 0;                     /* Responses in pending_ */
+    bool writing_ = false;
+    bool paused_ = false;                        /* Not reading while too many responses are queued */
+    bool closing_ = false;                       /* The last response closes the connection */
+    handler_memory read_memory_;
+    handler_memory write_memory_;
+    std::vector<router::command> batch_tasks_;
+    std::vector<bool> batch_valid_;
+    std::vector<bool> batch_admitted_;
     std::shared_ptr<router::dispatcher> dispatcher_;
     const std::shared_ptr<spdlog::logger>& console_;
 };
 
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+/*
+ * Binds and listens on the port with SO_REUSEPORT, so that an acceptor of every I/O thread
+ * can listen on it and the kernel spreads incoming connections over them by their 4-tuple.
+ * Throws boost::system::system_error, e.g. if the port is taken by another process.
+ */
+inline void listen(tcp::acceptor &acceptor, const unsigned short port)
+{
+    const tcp::endpoint endpoint{tcp::v6(), port};
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.set_option(reuse_port(true));
+    acceptor.bind(endpoint);
+    acceptor.listen(boost::asio::socket_base::max_listen_connections);
+}
+
+/*
+ * HTTP order entry sharded by I/O thread: every thread runs an io_context of its own with
+ * its own acceptor on the port, and a connection stays on the thread which accepted it, so
+ * that no two threads touch a connection nor share a reactor. Each thread pushes to the
+ * consumers through its own ingress rings and wakes them once per round of its event loop.
+ */
 class server
 {
 public:
-    server(boost::asio::io_context &ioc,
-           const std::shared_ptr<router::dispatcher> dispatcher,
+    /* Throws boost::system::system_error if the port cannot be bound */
+    server(const std::shared_ptr<router::dispatcher> dispatcher,
            const std::shared_ptr<spdlog::logger> console,
-           const short port = 8080,
-           const uint64_t available_cores = std::max(1u, std::thread::hardware_concurrency() - 1))
-        : ioc_{ioc}, acceptor_{ioc, tcp::endpoint(tcp::v6(), port)},
-          dispatcher_{dispatcher}, console_{console}, pool_{available_cores}
-    {
-        acceptor_.set_option(tcp::acceptor::reuse_address(true));
-        async_start_();
-        /* Start event loop for all threads */
-        for (auto core = available_cores; core > 0; --core) {
-            boost::asio::post(pool_, [&] {ioc.run();});
+           const unsigned short port = 8080,
+           const std::vector<unsigned> &io_cores = default_placement().io_cores,
+           const io_policy &policy = {})
+        : dispatcher_{dispatcher}, console_{console}, policy_{policy}, pool_{io_cores.size()}
+    {
+        for (const auto core : io_cores) {
+            auto &shard = *shards_.emplace_back(std::make_unique<shard_t>(core, policy_));
+            /* Port 0 binds the first shard to an ephemeral port, which the others share */
+            listen(shard.acceptor, shards_.size() == 1 ? port : this->port());
+            async_accept_(shard);
+        }
+        console_->info("server::start: started on {} with {} acceptors",
+                       boost::lexical_cast<std::string>(shards_.front()->acceptor.local_endpoint()), shards_.size());
+        /* Start event loop on one thread per I/O core */
+        for (std::size_t index = 0; index < shards_.size(); ++index) {
+            boost::asio::post(pool_, [this, index] {
+                auto &shard = *shards_[index];
+                if (!pin_thread(shard.core))
+                    console_->warn("server::start: failed to pin I/O thread to core {}", shard.core);
+                console_->info("server::start: I/O thread @{} on core {} (NUMA node {})",
+                               (pid_t) syscall (SYS_gettid), shard.core, numa_node(shard.core));
+                dispatcher_->defer_wakeups();
+                shard.loop.run(shard.ioc, [this] { dispatcher_->flush(); });
+            });
         }
     }
     server(const server&) = delete;
 
-    boost::system::error_code shutdown()
+    /* The bound port, e.g. when constructed with port 0 */
+    unsigned short port() const
     {
-        boost::system::error_code ec;
-        acceptor_.close(ec);
-        return ec;
+        return shards_.front()->acceptor.local_endpoint().port();
     }
 
-private:
-    void async_start_()
-    {
-        const auto endpoint = boost::lexical_cast<std::string>(acceptor_.local_endpoint());
-        acceptor_.listen(boost::asio::socket_base::max_listen_connections);
-        if (acceptor_.is_open()) {
-            console_->info("server::start: started on {}", endpoint);
-        } else {
-            console_->warn("server::start: failed to start on {}", endpoint);
+    /* I/O threads, each with an io_context which further acceptors, e.g. of binary_server, may share */
+    std::size_t shards() const
+    {
+        return shards_.size();
+    }
+
+    boost::asio::io_context &context(const std::size_t index)
+    {
+        return shards_.at(index)->ioc;
+    }
+
+    /* Blocks until the event loop of every I/O thread has returned */
+    void join()
+    {
+        pool_.join();
+    }
+
+    /* Stops accepting; connections are served until they close */
+    void shutdown()
+    {
+        for (auto &shard : shards_) {
+            boost::asio::post(shard->ioc, [&acceptor = shard->acceptor] {
+                boost::system::error_code ec;
+                acceptor.close(ec);
+            });
         }
-        async_accept_();
     }
-    void async_accept_()
+
+    /* Stops the event loop of every I/O thread, abandoning their connections */
+    void stop()
+    {
+        for (auto &shard : shards_)
+            shard->ioc.stop();
+    }
+
+    /* Exporter thread; a point per I/O thread */
+    void report(metrics::line_writer &out) const
+    {
+        for (std::size_t index = 0; index < shards_.size(); ++index)
+            shards_[index]->loop.report(out, index, shards_[index]->core);
+    }
+
+private:
+    struct shard_t {
+        shard_t(const unsigned core, const io_policy &policy): core{core}, loop{policy} {}
+        const unsigned core;
+        boost::asio::io_context ioc{1}; /* Run by its thread only */
+        tcp::acceptor acceptor{ioc};
+        event_loop loop;
+    };
+
+    void async_accept_(shard_t &shard)
     {
-        auto handler = std::make_shared<connection_handler>(ioc_, dispatcher_, console_);
-        acceptor_.async_accept(
-        handler->socket(), [this, handler](boost::system::error_code ec) {
+        auto handler = std::make_shared<connection_handler>(shard.ioc, dispatcher_, console_);
+        shard.acceptor.async_accept(
+        handler->socket(), [this, &shard, handler](boost::system::error_code ec) {
             //logger_->info("server::async_accept: {}",
             //    boost::lexical_cast<std::string>(
             //      handler->socket().remote_endpoint()));
+            if (ec == boost::asio::error::operation_aborted)
+                return;
             if (ec) {
                 console_->error("server::async_accept: {}", ec.message());
             } else {
+                /* Pipelined responses are coalesced already; do not hold them back for acks */
+                handler->socket().set_option(tcp::no_delay(true), ec);
+                if (!busy_poll(handler->socket(), policy_) && !busy_poll_refused_.exchange(true))
+                    console_->warn("server::async_accept: SO_BUSY_POLL refused: {}", std::strerror(errno));
                 handler->dispatch();
             }
+            async_accept_(shard);
+        });
+    }
+
+    std::shared_ptr<router::dispatcher> dispatcher_;
+    const std::shared_ptr<spdlog::logger> console_;
+    const io_policy policy_;
+    std::vector<std::unique_ptr<shard_t>> shards_;
+    std::atomic<bool> busy_poll_refused_{false}; /* Warned once */
+    boost::asio::thread_pool pool_;
+};
+
+/*
+ * Order entry of the native binary protocol (see binary_protocol.hpp), independent of the
+ * transport: decodes what a connection read in place, dispatches it and appends the replies
+ * to out(). Commands in flight are kept in traced() when tracing, until acked().
+ */
+class binary_handler
+{
+public:
+    explicit binary_handler(const std::shared_ptr<router::dispatcher> dispatcher): dispatcher_{dispatcher} {}
+    binary_handler(const binary_handler&) = delete;
+
+    /* READ stamp of data just read; 0 if untraced */
+    uint64_t read_stamp() const
+    {
+        return dispatcher_->tracer() != nullptr ? trace::clock::now() : 0;
+    }
+
+    /* As wire::decode; false once a message is malformed, after which the connection must close */
+    std::pair<std::size_t, bool> handle(const char *data, const std::size_t size, const uint64_t read)
+    {
+        return wire::decode(data, size, [&](const wire::header &head) {
+            return handle_(head, read);
+        });
+    }
+
+    std::vector<char> &out()
+    {
+        return out_;
+    }
+
+    std::vector<router::command> &traced()
+    {
+        return traced_;
+    }
+
+    /* Records ACKED of traced commands whose replies were written, and clears them */
+    void acked(std::vector<router::command> &traced)
+    {
+        if (traced.empty())
+            return;
+        const auto acked = trace::clock::now();
+        for (const auto &task : traced) {
+            const auto &origin = task.origin;
+            dispatcher_->tracer()->record_stages(task.id, task.market, task.type, {origin.read,
+                                                 origin.parsed, origin.enqueued, 0, 0, 0, acked});
+        }
+        traced.clear();
+    }
+
+private:
+    /* False for a message which is not what its header says */
+    bool handle_(const wire::header &head, const uint64_t read)
+    {
+        switch (head.type) {
+        case wire::NEW_ORDER:
+            if (const auto message = wire::view<wire::new_order>(head)) {
+                if (!known_(message->market) || message->side > SIDE::SELL || message->quantity == 0)
+                    return ack_(*message, wire::REJECTED, 0);
+                const auto id = next_order_id();
+                const auto admitted = dispatcher_->send(message->market, SIDE(message->side), message->price,
+                                                        message->quantity, id,
+                                                        parsed_(router::COMMAND::NEW, message->market, id, read));
+                return ack_(*message, admitted ? wire::ACCEPTED : wire::BUSY, id);
+            }
+            return false;
+        case wire::CANCEL_ORDER:
+            if (const auto message = wire::view<wire::cancel_order>(head)) {
+                if (!known_(message->market) || message->order_id == 0)
+                    return ack_(*message, wire::REJECTED, 0);
+                const auto admitted = dispatcher_->cancel(message->market, message->order_id,
+                                      parsed_(router::COMMAND::CANCEL, message->market, message->order_id, read));
+                return ack_(*message, admitted ? wire::ACCEPTED : wire::BUSY, message->order_id);
+            }
+            return false;
+        case wire::AMEND_ORDER:
+            if (const auto message = wire::view<wire::amend_order>(head)) {
+                if (!known_(message->market) || message->order_id == 0 || message->quantity == 0)
+                    return ack_(*message, wire::REJECTED, 0);
+                const auto admitted = dispatcher_->amend(message->market, message->order_id, message->price,
+                                      message->quantity,
+                                      parsed_(router::COMMAND::AMEND, message->market, message->order_id, read));
+                return ack_(*message, admitted ? wire::ACCEPTED : wire::BUSY, message->order_id);
+            }
+            return false;
+        case wire::MARKET_REQUEST:
+            if (const auto message = wire::view<wire::market_request>(head)) {
+                const auto market = dispatcher_->market(wire::name_of(*message));
+                append_(wire::market_reply{wire::head_of<wire::market_reply>(wire::MARKET_REPLY),
+                                           market ? wire::ACCEPTED : wire::REJECTED, 0,
+                                           market ? market->id : MarketId(0), message->client_id});
+                return true;
+            }
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    /* Markets are never removed, so an id below the count stays routable */
+    bool known_(const MarketId market) const
+    {
+        return market < dispatcher_->market_count();
+    }
+
+    /* Stamps PARSED of a traced command; the stamps to dispatch it with, or nullptr if untraced */
+    trace::origin *parsed_(const router::COMMAND type, const MarketId market, const OrderId id, const uint64_t read)
+    {
+        if (read == 0)
+            return nullptr;
+        auto &task = traced_.emplace_back();
+        task.type = type;
+        task.market = market;
+        task.id = id;
+        task.origin.read = read;
+        task.origin.parsed = trace::clock::now();
+        return &task.origin;
+    }
+
+    template <typename message_type>
+    bool ack_(const message_type &message, const wire::ACK_STATUS status, const OrderId id)
+    {
+        append_(wire::ack{wire::head_of<wire::ack>(wire::ACK), status, message.head.type, message.market,
+                          message.client_id, id});
+        return true;
+    }
+
+    template <typename message_type>
+    void append_(const message_type &message)
+    {
+        const auto bytes = reinterpret_cast<const char *>(&message);
+        out_.insert(out_.end(), bytes, bytes + sizeof(message));
+    }
+
+    std::vector<char> out_;
+    std::vector<router::command> traced_; /* Commands of the replies in out_, if traced */
+    std::shared_ptr<router::dispatcher> dispatcher_;
+};
+
+/*
+ * Connection of the native binary protocol on asio. Everything one read brings in is
+ * handled, then the acks of the whole batch go out in one write before the next read.
+ * A malformed message closes the connection.
+ */
+class binary_session
+    : public std::enable_shared_from_this<binary_session>
+{
+public:
+    binary_session(tcp::socket socket,
+                   const std::shared_ptr<router::dispatcher> dispatcher,
+                   const std::shared_ptr<spdlog::logger>& console)
+        : socket_{std::move(socket)}, handler_{dispatcher}, console_{console}
+    {
+        handler_.out().reserve(in_.size());
+    }
+    binary_session(const binary_session&) = delete;
+
+    void start()
+    {
+        boost::system::error_code ec;
+        socket_.set_option(tcp::no_delay(true), ec);
+        read_();
+    }
+
+private:
+    void read_()
+    {
+        socket_.async_read_some(boost::asio::buffer(in_.data() + filled_, in_.size() - filled_),
+        [this, self = shared_from_this()](boost::system::error_code ec, std::size_t size) {
+            if (ec) {
+                if (ec != boost::asio::error::eof)
+                    console_->error("binary_session::async_read: {}", ec.message());
+                return;
+            }
+            filled_ += size;
+            const auto [consumed, valid] = handler_.handle(in_.data(), filled_, handler_.read_stamp());
+            if (!valid) {
+                console_->warn("binary_session::async_read: malformed message, closing");
+                return;
+            }
+            /* A partial message is left over; moved to the front it stays 8-byte aligned */
+            std::memmove(in_.data(), in_.data() + consumed, filled_ - consumed);
+            filled_ -= consumed;
+            if (handler_.out().empty())
+                read_();
+            else
+                write_();
+        });
+    }
+
+    void write_()
+    {
+        boost::asio::async_write(socket_, boost::asio::buffer(handler_.out()),
+        [this, self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+            if (ec) {
+                console_->error("binary_session::async_write: {}", ec.message());
+                return;
+            }
+            handler_.acked(handler_.traced());
+            handler_.out().clear();
+            read_();
+        });
+    }
+
+    tcp::socket socket_;
+    alignas(8) std::array<char, 1 << 16> in_;
+    std::size_t filled_ = 0;
+    binary_handler handler_;
+    const std::shared_ptr<spdlog::logger> console_;
+};
+
+/*
+ * Acceptor of the native binary protocol; its sessions run on the I/O threads of the
+ * io_context. The port may be shared with further binary_servers, e.g. one per shard of
+ * server, among which the kernel spreads connections. Throws boost::system::system_error
+ * if the port cannot be bound.
+ */
+class binary_server
+{
+public:
+    binary_server(boost::asio::io_context &ioc,
+                  const std::shared_ptr<router::dispatcher> dispatcher,
+                  const std::shared_ptr<spdlog::logger> console,
+                  const unsigned short port = 8081,
+                  const io_policy &policy = {})
+        : acceptor_{ioc}, dispatcher_{dispatcher}, console_{console}, policy_{policy}
+    {
+        listen(acceptor_, port);
+        console_->info("binary_server::start: started on {}",
+                       boost::lexical_cast<std::string>(acceptor_.local_endpoint()));
+        async_accept_();
+    }
+    binary_server(const binary_server&) = delete;
+
+    /* The bound port, e.g. when constructed with port 0 */
+    unsigned short port() const
+    {
+        return acceptor_.local_endpoint().port();
+    }
+
+    boost::system::error_code shutdown()
+    {
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+        return ec;
+    }
+
+private:
+    void async_accept_()
+    {
+        acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            if (ec) {
+                console_->error("binary_server::async_accept: {}", ec.message());
+            } else {
+                if (!busy_poll(socket, policy_) && !busy_poll_refused_.exchange(true))
+                    console_->warn("binary_server::async_accept: SO_BUSY_POLL refused: {}", std::strerror(errno));
+                std::make_shared<binary_session>(std::move(socket), dispatcher_, console_)->start();
+            }
             async_accept_();
         });
     }
 
     tcp::acceptor acceptor_;
-    boost::asio::io_context &ioc_;
     std::shared_ptr<router::dispatcher> dispatcher_;
     const std::shared_ptr<spdlog::logger> console_;
-    boost::asio::thread_pool pool_;
+    const io_policy policy_;
+    std::atomic<bool> busy_poll_refused_{false}; /* Warned once */
 };
 } // namespace tcp
 } // namespace matching_engine
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cpuid.h>
+#include <x86intrin.h>
+#include <ingress.hpp>
+#include <metrics.hpp>
+#include <spsc_ring.hpp>
+
+namespace matching_engine
+{
+namespace trace
+{
+
+/*
+ * Cheap timestamps for latency tracing: the time stamp counter where it is invariant, i.e.
+ * runs at a constant rate across cores and sleep states, the monotonic clock elsewhere.
+ * Ticks are only ever subtracted and converted to nanoseconds.
+ */
+class clock
+{
+public:
+    static uint64_t now()
+    {
+        if (calibration_().tsc)
+            return __rdtsc();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    static uint64_t ns(const uint64_t ticks)
+    {
+        return uint64_t(ticks * calibration_().ns_per_tick);
+    }
+    static double ns_per_tick()
+    {
+        return calibration_().ns_per_tick;
+    }
+    /* False if ticks are monotonic nanoseconds */
+    static bool tsc()
+    {
+        return calibration_().tsc;
+    }
+private:
+    struct calibration {
+        bool tsc = false;
+        double ns_per_tick = 1;
+    };
+    /* Measured once, against the monotonic clock over a few milliseconds */
+    static const calibration &calibration_()
+    {
+        static const calibration measured = [] {
+            calibration result;
+            unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+            /* Invariant TSC, CPUID.80000007H:EDX[8] */
+            if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8)))
+                return result;
+            const auto start = std::chrono::steady_clock::now();
+            const auto first = __rdtsc();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            const auto last = __rdtsc();
+            const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            result.tsc = last > first;
+            result.ns_per_tick = result.tsc ? elapsed.count() / (last - first) : 1;
+            return result;
+        }();
+        return measured;
+    }
+};
+
+/* Points in the life of a command, in the order a new order passes them */
+enum STAGE : uint8_t {
+    READ,        /* Request read off the socket */
+    PARSED,      /* Decoded into a command */
+    ENQUEUED,    /* Pushed to the consumer */
+    DEQUEUED,    /* Popped by the consumer */
+    MATCH_START,
+    MATCH_END,
+    ACKED,       /* Response written; concurrent with matching, so measured from ENQUEUED */
+    STAGES
+};
+
+inline const char *stage_name(const STAGE stage)
+{
+    static constexpr const char *names[STAGES] = {
+        "read", "parsed", "enqueued", "dequeued", "match_start", "match_end", "acked"
+    };
+    return names[stage];
+}
+
+/* Stage a latency into the given stage is measured from */
+inline STAGE previous(const STAGE stage)
+{
+    return stage == STAGE::ACKED ? STAGE::ENQUEUED : STAGE(stage - 1);
+}
+
+/* Transport stamps carried with a command; all zero if it is not traced */
+struct origin {
+    uint64_t read = 0;
+    uint64_t parsed = 0;
+    uint64_t enqueued = 0;
+};
+
+/*
+ * Raw trace of a sampled command as dumped to the trace file. The transport and the
+ * consumer each write one for the same order id with the stages they saw, and zero
+ * elsewhere; offline tools join them by id.
+ */
+struct record {
+    uint64_t id;
+    uint16_t market;
+    uint8_t command;
+    uint8_t reserved[5];
+    std::array<uint64_t, STAGES> at; /* clock::now() ticks */
+};
+static_assert(sizeof(record) == 72, "trace record layout is part of the file format");
+
+/* Start of a trace file, followed by records until the end of the file */
+struct file_header {
+    char magic[8];          /* "METRACE1" */
+    double ns_per_tick;     /* Conversion of record ticks */
+    uint64_t origin_ticks;  /* clock::now() at ... */
+    int64_t origin_unix_ns; /* ... this wall clock time */
+    uint32_t stages;
+    uint32_t record_size;
+};
+
+/* Per thread stage latencies and sampled records; written by the owning thread only */
+struct recorder {
+    std::array<metrics::histogram, STAGES> stage_ns; /* Into each stage from its previous(); READ unused */
+    metrics::histogram total_ns;                     /* READ to MATCH_END */
+    SpscRing<record, 4096> sampled;
+    metrics::counter dropped;                        /* Sampled records which found the ring full */
+};
+
+/*
+ * Optional per-stage latency tracing. Every traced command has its stages recorded into
+ * the histograms of the thread which saw them; every sample_every-th order id is also
+ * kept raw and appended to the trace file by report(), off the hot threads.
+ */
+class tracer
+{
+public:
+    /* Threads which may record, as many as may push into an ingress */
+    static constexpr std::size_t max_threads = 256;
+    /* sample_every 0 keeps histograms only; path is only opened when sampling */
+    tracer(const uint64_t sample_every = 0, const std::string &path = "data/trace.bin"):
+        sample_every_{sample_every}
+    {
+        clock::now(); /* Calibrates before any hot thread asks */
+        if (sample_every_ == 0)
+            return;
+        file_ = std::fopen(path.c_str(), "wb");
+        if (file_ == nullptr)
+            return;
+        file_header header{};
+        std::memcpy(header.magic, "METRACE1", sizeof(header.magic));
+        header.ns_per_tick = clock::ns_per_tick();
+        header.origin_ticks = clock::now();
+        header.origin_unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    std::chrono::system_clock::now().time_since_epoch()).count();
+        header.stages = STAGES;
+        header.record_size = sizeof(record);
+        std::fwrite(&header, sizeof(header), 1, file_);
+    }
+    tracer(const tracer &) = delete;
+    tracer& operator=(const tracer&) = delete;
+    ~tracer()
+    {
+        if (file_ != nullptr)
+            std::fclose(file_);
+        for (auto &slot : recorders_)
+            delete slot.load(std::memory_order_relaxed);
+    }
+    /* False if sampling was asked for but the trace file could not be opened */
+    bool writable() const
+    {
+        return sample_every_ == 0 || file_ != nullptr;
+    }
+    bool sampled(const uint64_t id) const
+    {
+        return sample_every_ != 0 && id % sample_every_ == 0;
+    }
+    /* Recorder of the calling thread */
+    recorder &local()
+    {
+        const auto index = router::producer_index();
+        if (index >= recorders_.size())
+            throw std::length_error("tracer: too many threads");
+        auto slot = recorders_[index].load(std::memory_order_relaxed);
+        if (slot == nullptr) {
+            slot = new recorder;
+            recorders_[index].store(slot, std::memory_order_release);
+        }
+        return *slot;
+    }
+    /* Records the latency into each stage stamped in `at` (0 where not seen) and keeps sampled ones */
+    void record_stages(const uint64_t id, const uint16_t market, const uint8_t command,
+                       const std::array<uint64_t, STAGES> &at)
+    {
+        auto &local_recorder = local();
+        for (unsigned stage = STAGE::PARSED; stage < STAGES; ++stage) {
+            const auto from = at[previous(STAGE(stage))];
+            if (at[stage] != 0 && from != 0)
+                local_recorder.stage_ns[stage].record(clock::ns(at[stage] - from));
+        }
+        if (at[STAGE::READ] != 0 && at[STAGE::MATCH_END] != 0)
+            local_recorder.total_ns.record(clock::ns(at[STAGE::MATCH_END] - at[STAGE::READ]));
+        if (sampled(id) && !local_recorder.sampled.push(record{id, market, command, {}, at}))
+            local_recorder.dropped.add_local();
+    }
+    /* Exporter thread; a point per stage, and appends the sampled records to the trace file */
+    void report(metrics::line_writer &out)
+    {
+        std::array<metrics::histogram::snapshot, STAGES + 1> totals{};
+        uint64_t dropped = 0;
+        for (std::size_t index = 0; index < recorders_.size(); ++index) {
+            auto slot = recorders_[index].load(std::memory_order_acquire);
+            if (slot == nullptr)
+                continue;
+            for (unsigned stage = 0; stage <= STAGES; ++stage)
+                add_(totals[stage], stage < STAGES ? slot->stage_ns[stage].take() : slot->total_ns.take());
+            dropped += slot->dropped.value();
+            for (auto sample = slot->sampled.front(); sample != nullptr; sample = slot->sampled.front()) {
+                if (file_ != nullptr)
+                    std::fwrite(sample, sizeof(*sample), 1, file_);
+                slot->sampled.pop();
+            }
+        }
+        if (file_ != nullptr)
+            std::fflush(file_);
+        for (unsigned stage = STAGE::PARSED; stage <= STAGES; ++stage) {
+            out.meas("order_stage")
+            .tag("stage", stage < STAGES ? stage_name(STAGE(stage)) : "total")
+            .field("latency_ns", totals[stage].since(reported_[stage]))
+            .end();
+        }
+        out.meas("order_trace").field("dropped", dropped).end();
+        reported_ = totals;
+    }
+private:
+    static void add_(metrics::histogram::snapshot &total, const metrics::histogram::snapshot &part)
+    {
+        for (std::size_t index = 0; index < total.counts.size(); ++index)
+            total.counts[index] += part.counts[index];
+        total.count += part.count;
+    }
+    const uint64_t sample_every_;
+    std::FILE *file_ = nullptr;
+    std::array<std::atomic<recorder *>, max_threads> recorders_{};
+    std::array<metrics::histogram::snapshot, STAGES + 1> reported_{}; /* Exporter thread */
+};
+
+} // namespace trace
+} // namespace matching_engine
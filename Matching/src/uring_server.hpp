@@ -0,0 +1,631 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <placement.hpp>
+#include <tcp_server.hpp>
+
+namespace matching_engine
+{
+namespace tcp
+{
+
+/*
+ * Minimal io_uring on the raw system calls: the submission and completion rings of one
+ * thread. SQEs are queued with sqe() and submitted together by enter(), so one system
+ * call submits the work of every connection and reaps their completions.
+ */
+class uring
+{
+public:
+    /* Throws std::system_error if the kernel has no io_uring or lacks multishot support (before 6.0) */
+    explicit uring(const unsigned entries)
+    {
+        /*
+         * Only one thread submits, and task work runs when it waits anyway. The ring starts
+         * disabled, so that the thread which enable()s it becomes its single issuer.
+         */
+        const unsigned preferred[] = {
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_R_DISABLED,
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_R_DISABLED
+        };
+        io_uring_params params{};
+        for (const auto flags : preferred) {
+            params = io_uring_params{};
+            params.flags = flags;
+            fd_ = int(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd_ >= 0 || errno != EINVAL)
+                break;
+        }
+        if (fd_ < 0)
+            throw std::system_error(errno, std::system_category(), "io_uring_setup");
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+            ::close(fd_);
+            throw std::system_error(ENOTSUP, std::system_category(), "io_uring features");
+        }
+        ring_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_ = map_(ring_size_, IORING_OFF_SQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe *>(map_(sqes_size_, IORING_OFF_SQES));
+        const auto at = [this](const unsigned offset) {
+            return reinterpret_cast<unsigned *>(static_cast<char *>(ring_) + offset);
+        };
+        sq_head_ = at(params.sq_off.head);
+        sq_tail_ = at(params.sq_off.tail);
+        sq_mask_ = *at(params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        /* SQEs are used in ring order, so the indirection array is the identity */
+        const auto array = at(params.sq_off.array);
+        for (unsigned index = 0; index < sq_entries_; ++index)
+            array[index] = index;
+        cq_head_ = at(params.cq_off.head);
+        cq_tail_ = at(params.cq_off.tail);
+        cq_mask_ = *at(params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(ring_) + params.cq_off.cqes);
+        tail_ = *sq_tail_;
+    }
+    uring(const uring &) = delete;
+    uring& operator=(const uring&) = delete;
+    ~uring()
+    {
+        if (sqes_ != nullptr)
+            munmap(sqes_, sqes_size_);
+        if (ring_ != nullptr)
+            munmap(ring_, ring_size_);
+        ::close(fd_);
+    }
+
+    int fd() const
+    {
+        return fd_;
+    }
+
+    /* From the thread which is to submit, before the first sqe() */
+    void enable()
+    {
+        if (register_with(IORING_REGISTER_ENABLE_RINGS, nullptr, 0) < 0)
+            throw std::system_error(errno, std::system_category(), "io_uring enable");
+    }
+
+    /*
+     * A cleared SQE to fill in before the next call. If the ring is full it submits what is
+     * queued; should the kernel be busy, the entry waits in a backlog which enter() queues
+     * ahead of anything else once the completions have been reaped.
+     */
+    io_uring_sqe &sqe()
+    {
+        if (backlog_.empty() && full_())
+            enter(0);
+        if (!backlog_.empty() || full_())
+            return backlog_.emplace_back();
+        auto &entry = sqes_[tail_++ & sq_mask_];
+        std::memset(&entry, 0, sizeof(entry));
+        return entry;
+    }
+
+    /*
+     * Submits every queued SQE and waits for at least `wait` completions. False if the kernel
+     * is busy, e.g. with completions which overflowed the CQ: reap() them, then enter() again.
+     */
+    bool enter(const unsigned wait)
+    {
+        for (;;) {
+            while (!backlog_.empty() && !full_()) {
+                sqes_[tail_++ & sq_mask_] = backlog_.front();
+                backlog_.pop_front();
+            }
+            __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+            const auto pending = tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            /* The ring is drained on success (SUBMIT_ALL), so a backlog goes in before waiting */
+            const auto more = !backlog_.empty();
+            const auto events = more ? 0u : wait;
+            while (syscall(__NR_io_uring_enter, fd_, pending, events, events != 0 ? IORING_ENTER_GETEVENTS : 0u,
+                           nullptr, std::size_t(0)) < 0) {
+                if (errno == EBUSY || errno == EAGAIN)
+                    return false;
+                if (errno != EINTR)
+                    throw std::system_error(errno, std::system_category(), "io_uring_enter");
+            }
+            if (!more)
+                return true;
+        }
+    }
+
+    /* Hands every completion posted so far to the visitor; returns their number */
+    template <typename visitor_type>
+    unsigned reap(visitor_type &&visitor)
+    {
+        auto head = *cq_head_;
+        const auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        const auto count = tail - head;
+        for (; head != tail; ++head)
+            visitor(cqes_[head & cq_mask_]);
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    /* io_uring_register; -1 with errno on failure */
+    int register_with(const unsigned opcode, void *argument, const unsigned count)
+    {
+        return int(syscall(__NR_io_uring_register, fd_, opcode, argument, count));
+    }
+
+private:
+    bool full_() const
+    {
+        return tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_;
+    }
+
+    void *map_(const std::size_t size, const off_t offset)
+    {
+        const auto mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (mapped == MAP_FAILED) {
+            const auto error = errno;
+            if (ring_ != nullptr)
+                munmap(ring_, ring_size_);
+            ::close(fd_);
+            throw std::system_error(error, std::system_category(), "io_uring mmap");
+        }
+        return mapped;
+    }
+
+    int fd_ = -1;
+    void *ring_ = nullptr;
+    std::size_t ring_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    std::size_t sqes_size_ = 0;
+    unsigned *sq_head_, *sq_tail_, sq_mask_, sq_entries_;
+    unsigned *cq_head_, *cq_tail_, cq_mask_;
+    io_uring_cqe *cqes_;
+    unsigned tail_; /* Of the SQEs queued, published to the kernel by enter() */
+    std::deque<io_uring_sqe> backlog_; /* SQEs which found the ring full and the kernel busy */
+};
+
+/*
+ * Listener of the native binary protocol on io_uring, an alternative to binary_server with
+ * the same protocol and handling. One thread runs the ring: a multishot accept takes the
+ * connections of its SO_REUSEPORT listener, so that one server per I/O core shards them as
+ * tcp::server does, a multishot recv per connection reads into buffers of a ring registered with
+ * the kernel, and all the sends and re-arms of one round of completions go out in a single
+ * io_uring_enter which also waits for the next round.
+ *
+ * A read which ends on a message boundary is handled in place in the kernel-selected buffer;
+ * a partial message is staged in the connection. The acks of a connection accumulate while
+ * its previous send is in flight, and reading stops while too many are waiting.
+ */
+class uring_server
+{
+public:
+    static constexpr unsigned ring_entries = 1024;
+    /* Receive buffers shared by all connections; the kernel picks one per read */
+    static constexpr unsigned buffers = 512;
+    static constexpr std::size_t buffer_size = 16 * 1024;
+    /* Acks waiting behind a send at which a connection stops reading */
+    static constexpr std::size_t max_backlog = 1 << 20;
+
+    /* Throws std::system_error if io_uring is unavailable or the port cannot be bound */
+    uring_server(const std::shared_ptr<router::dispatcher> dispatcher,
+                 const std::shared_ptr<spdlog::logger> console,
+                 const unsigned short port = 8081,
+                 const std::optional<unsigned> core = {})
+        : ring_{ring_entries}, dispatcher_{dispatcher}, console_{console}, core_{core}
+    {
+        setup_buffers_();
+        listen_(port);
+        wake_ = eventfd(0, EFD_CLOEXEC);
+        if (wake_ < 0) {
+            const auto error = errno;
+            ::close(listener_);
+            munmap(buffer_ring_, buffer_ring_size_);
+            throw std::system_error(error, std::system_category(), "eventfd");
+        }
+        console_->info("uring_server::start: started on [::]:{}", port_);
+        thread_ = std::thread([this] {
+            if (core_ && !pin_thread(*core_))
+                console_->warn("uring_server::start: failed to pin I/O thread to core {}", *core_);
+            run_();
+        });
+    }
+    uring_server(const uring_server &) = delete;
+    uring_server& operator=(const uring_server&) = delete;
+    ~uring_server()
+    {
+        shutdown();
+        if (thread_.joinable())
+            thread_.join();
+        for (auto &connection : connections_) {
+            if (connection)
+                ::close(connection->fd);
+        }
+        if (listener_ >= 0)
+            ::close(listener_);
+        if (wake_ >= 0)
+            ::close(wake_);
+        if (buffer_ring_ != nullptr)
+            munmap(buffer_ring_, buffer_ring_size_);
+    }
+
+    /* The bound port, e.g. when constructed with port 0 */
+    unsigned short port() const
+    {
+        return port_;
+    }
+
+    /* Stops the loop; connections are closed with the server */
+    void shutdown()
+    {
+        const uint64_t one = 1;
+        if (wake_ >= 0 && ::write(wake_, &one, sizeof(one)) < 0)
+            console_->error("uring_server::shutdown: {}", std::strerror(errno));
+    }
+
+private:
+    enum OPERATION : uint8_t {
+        ACCEPT,
+        RECV,
+        SEND,
+        CANCEL,
+        WAKE
+    };
+
+    struct connection {
+        explicit connection(const int socket, const std::shared_ptr<router::dispatcher> &dispatcher):
+            fd{socket}, handler{dispatcher} {}
+        int fd;
+        binary_handler handler;
+        alignas(8) std::array<char, buffer_size + wire::max_message> staged; /* A partial message and what follows */
+        std::size_t filled = 0;
+        std::vector<char> sending;                   /* Acks of the send in flight */
+        std::vector<router::command> sending_traced;
+        std::size_t sent = 0;                        /* Of sending, as sends may be short */
+        bool receiving = false;                      /* A multishot recv is armed */
+        bool paused = false;                         /* Not reading until the backlog is sent */
+        bool closing = false;
+    };
+
+    static uint64_t user_data_(const OPERATION operation, const std::size_t slot = 0)
+    {
+        return uint64_t(slot) << 8 | operation;
+    }
+
+    void setup_buffers_()
+    {
+        buffer_ring_size_ = buffers * sizeof(io_uring_buf);
+        const auto mapped = mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (mapped == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(), "buffer ring mmap");
+        buffer_ring_ = static_cast<io_uring_buf *>(mapped);
+        io_uring_buf_reg registration{};
+        registration.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+        registration.ring_entries = buffers;
+        registration.bgid = 0;
+        if (ring_.register_with(IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+            const auto error = errno;
+            munmap(buffer_ring_, buffer_ring_size_);
+            throw std::system_error(error, std::system_category(), "io_uring register buffer ring");
+        }
+        storage_.reset(new buffer_type[buffers]);
+        for (unsigned id = 0; id < buffers; ++id)
+            provide_(id);
+        publish_buffers_();
+    }
+
+    /* Hands a receive buffer back to the kernel; visible to it after publish_buffers_() */
+    void provide_(const unsigned id)
+    {
+        auto &entry = buffer_ring_[buffer_tail_++ & (buffers - 1)];
+        entry.addr = reinterpret_cast<uint64_t>(storage_[id].data());
+        entry.len = buffer_size;
+        entry.bid = uint16_t(id);
+    }
+
+    /* The ring's tail overlays the reserved field of its first entry (io_uring_buf_ring) */
+    void publish_buffers_()
+    {
+        __atomic_store_n(&buffer_ring_[0].resv, buffer_tail_, __ATOMIC_RELEASE);
+    }
+
+    void listen_(const unsigned short port)
+    {
+        listener_ = ::socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener_ < 0) {
+            const auto error = errno;
+            munmap(buffer_ring_, buffer_ring_size_);
+            throw std::system_error(error, std::system_category(), "socket");
+        }
+        const int on = 1;
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        /* One listener per ring on the same port, as the shards of server */
+        setsockopt(listener_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        sockaddr_in6 address{};
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(port);
+        socklen_t length = sizeof(address);
+        if (bind(listener_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0
+            || ::listen(listener_, SOMAXCONN) < 0
+            || getsockname(listener_, reinterpret_cast<sockaddr *>(&address), &length) < 0) {
+            const auto error = errno;
+            ::close(listener_);
+            munmap(buffer_ring_, buffer_ring_size_);
+            throw std::system_error(error, std::system_category(), "bind");
+        }
+        port_ = ntohs(address.sin6_port);
+    }
+
+    void run_()
+    {
+        try {
+            ring_.enable();
+            /* Consumers are woken once per round of completions rather than once per order */
+            dispatcher_->defer_wakeups();
+            arm_accept_();
+            auto &wake = ring_.sqe();
+            wake.opcode = IORING_OP_READ;
+            wake.fd = wake_;
+            wake.addr = reinterpret_cast<uint64_t>(&woken_);
+            wake.len = sizeof(woken_);
+            wake.user_data = user_data_(WAKE);
+            while (!stopping_) {
+                /* Busy, e.g. with an overflowed CQ, the kernel takes nothing until it is reaped */
+                const auto entered = ring_.enter(1);
+                const auto reaped = ring_.reap([this](const io_uring_cqe &completion) {
+                    complete_(completion);
+                });
+                if (!entered && reaped == 0)
+                    std::this_thread::yield();
+                dispatcher_->flush();
+                publish_buffers_();
+                for (auto slot : rearm_)
+                    arm_recv_(slot);
+                rearm_.clear();
+            }
+        } catch (const std::system_error &error) {
+            console_->error("uring_server::run: {}", error.what());
+        }
+    }
+
+    void complete_(const io_uring_cqe &completion)
+    {
+        const auto slot = std::size_t(completion.user_data >> 8);
+        switch (OPERATION(completion.user_data & 0xff)) {
+        case ACCEPT:
+            if (completion.res >= 0)
+                accepted_(completion.res);
+            else if (completion.res != -ECANCELED)
+                console_->error("uring_server::accept: {}", std::strerror(-completion.res));
+            if (!(completion.flags & IORING_CQE_F_MORE) && !stopping_)
+                arm_accept_();
+            break;
+        case RECV:
+            received_(slot, completion);
+            break;
+        case SEND:
+            sent_(slot, completion.res);
+            break;
+        case WAKE:
+            stopping_ = true;
+            break;
+        case CANCEL:
+            break;
+        }
+    }
+
+    void arm_accept_()
+    {
+        auto &accept = ring_.sqe();
+        accept.opcode = IORING_OP_ACCEPT;
+        accept.fd = listener_;
+        accept.ioprio = IORING_ACCEPT_MULTISHOT;
+        accept.accept_flags = SOCK_CLOEXEC;
+        accept.user_data = user_data_(ACCEPT);
+    }
+
+    void accepted_(const int fd)
+    {
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        std::size_t slot = 0;
+        if (free_.empty()) {
+            slot = connections_.size();
+            connections_.emplace_back();
+        } else {
+            slot = free_.back();
+            free_.pop_back();
+        }
+        connections_[slot] = std::make_unique<connection>(fd, dispatcher_);
+        connections_[slot]->handler.out().reserve(buffer_size);
+        connections_[slot]->sending.reserve(buffer_size);
+        arm_recv_(slot);
+    }
+
+    void arm_recv_(const std::size_t slot)
+    {
+        /* The slot may have been released, or even taken by a new connection, since it was queued */
+        if (!connections_[slot])
+            return;
+        auto &peer = *connections_[slot];
+        if (peer.closing || peer.paused || peer.receiving)
+            return;
+        auto &recv = ring_.sqe();
+        recv.opcode = IORING_OP_RECV;
+        recv.fd = peer.fd;
+        recv.ioprio = IORING_RECV_MULTISHOT;
+        recv.flags = IOSQE_BUFFER_SELECT;
+        recv.buf_group = 0;
+        recv.user_data = user_data_(RECV, slot);
+        peer.receiving = true;
+    }
+
+    void received_(const std::size_t slot, const io_uring_cqe &completion)
+    {
+        auto &peer = *connections_[slot];
+        if (!(completion.flags & IORING_CQE_F_MORE))
+            peer.receiving = false;
+        if (completion.flags & IORING_CQE_F_BUFFER) {
+            const auto id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (completion.res > 0 && !peer.closing)
+                handle_(slot, storage_[id].data(), std::size_t(completion.res));
+            provide_(id);
+        }
+        if (completion.res == 0 || (completion.res < 0 && completion.res != -ENOBUFS
+                                    && completion.res != -ECANCELED)) {
+            if (completion.res < 0)
+                console_->error("uring_server::recv: {}", std::strerror(-completion.res));
+            close_(slot);
+        } else if (!peer.receiving && !peer.closing) {
+            /* Out of buffers or cancelled; re-armed once this round has returned its buffers */
+            rearm_.push_back(slot);
+        }
+        release_(slot);
+    }
+
+    /* Handles what one recv brought in, in place unless a partial message is staged */
+    void handle_(const std::size_t slot, const char *data, const std::size_t size)
+    {
+        auto &peer = *connections_[slot];
+        const auto read = peer.handler.read_stamp();
+        if (peer.filled != 0) {
+            std::memcpy(peer.staged.data() + peer.filled, data, size);
+            data = peer.staged.data();
+            peer.filled += size;
+        }
+        const auto total = peer.filled != 0 ? peer.filled : size;
+        const auto [consumed, valid] = peer.handler.handle(data, total, read);
+        if (!valid) {
+            console_->warn("uring_server::recv: malformed message, closing");
+            close_(slot);
+            return;
+        }
+        /* A partial message is left over; moved to the front it stays 8-byte aligned */
+        std::memmove(peer.staged.data(), data + consumed, total - consumed);
+        peer.filled = total - consumed;
+        if (!peer.handler.out().empty() && peer.sending.empty())
+            send_(slot);
+        else if (peer.handler.out().size() >= max_backlog && peer.receiving && !peer.paused)
+            pause_(slot);
+    }
+
+    /* Sends the acks accumulated, or the rest of a short send */
+    void send_(const std::size_t slot)
+    {
+        auto &peer = *connections_[slot];
+        if (peer.sending.empty()) {
+            peer.sending.swap(peer.handler.out());
+            peer.sending_traced.swap(peer.handler.traced());
+            peer.sent = 0;
+        }
+        auto &send = ring_.sqe();
+        send.opcode = IORING_OP_SEND;
+        send.fd = peer.fd;
+        send.addr = reinterpret_cast<uint64_t>(peer.sending.data() + peer.sent);
+        send.len = unsigned(peer.sending.size() - peer.sent);
+        send.msg_flags = MSG_NOSIGNAL;
+        send.user_data = user_data_(SEND, slot);
+    }
+
+    void sent_(const std::size_t slot, const int result)
+    {
+        auto &peer = *connections_[slot];
+        if (result < 0) {
+            if (!peer.closing)
+                console_->error("uring_server::send: {}", std::strerror(-result));
+            peer.sending.clear();
+            close_(slot);
+            release_(slot);
+            return;
+        }
+        peer.sent += std::size_t(result);
+        if (peer.sent < peer.sending.size() && !peer.closing) {
+            send_(slot);
+            return;
+        }
+        peer.handler.acked(peer.sending_traced);
+        peer.sending.clear();
+        if (peer.closing) {
+            release_(slot);
+            return;
+        }
+        if (!peer.handler.out().empty())
+            send_(slot);
+        if (peer.paused && peer.handler.out().size() < max_backlog) {
+            peer.paused = false;
+            arm_recv_(slot);
+        }
+    }
+
+    /* Stops the multishot recv of a connection whose client does not read its acks */
+    void pause_(const std::size_t slot)
+    {
+        auto &cancel = ring_.sqe();
+        cancel.opcode = IORING_OP_ASYNC_CANCEL;
+        cancel.addr = user_data_(RECV, slot);
+        cancel.user_data = user_data_(CANCEL, slot);
+        connections_[slot]->paused = true;
+    }
+
+    /* Shuts the socket down; its operations complete with errors and the slot is released after them */
+    void close_(const std::size_t slot)
+    {
+        auto &peer = *connections_[slot];
+        if (!peer.closing) {
+            peer.closing = true;
+            ::shutdown(peer.fd, SHUT_RDWR);
+        }
+    }
+
+    void release_(const std::size_t slot)
+    {
+        auto &peer = connections_[slot];
+        if (!peer || !peer->closing || peer->receiving || !peer->sending.empty())
+            return;
+        ::close(peer->fd);
+        peer.reset();
+        free_.push_back(slot);
+    }
+
+    using buffer_type = std::array<char, buffer_size>;
+
+    uring ring_;
+    std::shared_ptr<router::dispatcher> dispatcher_;
+    const std::shared_ptr<spdlog::logger> console_;
+    const std::optional<unsigned> core_;
+    /*
+     * Entries of the registered buffer ring. Not io_uring_buf_ring, whose flexible array is
+     * declared after an empty struct, which takes a byte in C++ and shifts every entry.
+     */
+    io_uring_buf *buffer_ring_ = nullptr;
+    std::size_t buffer_ring_size_ = 0;
+    uint16_t buffer_tail_ = 0;
+    std::unique_ptr<buffer_type[]> storage_;
+    int listener_ = -1;
+    unsigned short port_ = 0;
+    int wake_ = -1;
+    uint64_t woken_ = 0;
+    std::vector<std::unique_ptr<connection>> connections_;
+    std::vector<std::size_t> free_;
+    std::vector<std::size_t> rearm_;             /* Connections whose recv ended this round */
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+} // namespace tcp
+} // namespace matching_engine
@@ -4,13 +4,17 @@
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
 #include <boost/asio.hpp>
+#include <charconv>
 #include <chrono>
+#include <cstring>
+#include <cstdlib>
 #include <ctime>
 #include <functional>
 #include <iostream>
 #include <iterator>
 #include <memory>
 #include <numeric>
+#include <optional>
 #include <sstream>
 #include <string_view>
 #include <iostream>
@@ -20,39 +24,223 @@
 #include <sstream>
 #include <orderbook.hpp>
 #include <tcp_server.hpp>
+#include <uring_server.hpp>
+#include <admin_server.hpp>
 #include <order_router.hpp>
+#include <journal.hpp>
 
 using namespace std::chrono_literals;
 namespace me = matching_engine;
 
+/* Core list from the environment, e.g. CONSUMER_CPUS=4-7; the default if unset */
+static std::optional<std::vector<unsigned>> cores_from_env(const char *name, const std::vector<unsigned> &fallback)
+{
+    const auto list = std::getenv(name);
+    if (list == nullptr)
+        return fallback;
+    auto cores = me::parse_cores(list);
+    if (!cores || cores->empty())
+        return std::nullopt;
+    return cores;
+}
+
 int main(int argc, char *argv[])
 {
+    /* Thread placement: CONSUMER_CPUS, IO_CPUS and SERVICE_CPUS override the default split */
+    auto placement = me::default_placement();
+    for (auto [name, cores] : {std::pair{"CONSUMER_CPUS", &placement.consumer_cores},
+                               std::pair{"IO_CPUS", &placement.io_cores},
+                               std::pair{"SERVICE_CPUS", &placement.service_cores}}) {
+        auto parsed = cores_from_env(name, *cores);
+        if (!parsed) {
+            std::cerr << "Invalid " << name << " " << std::getenv(name) << std::endl;
+            return 1;
+        }
+        *cores = std::move(*parsed);
+    }
+    /* Threads inherit the affinity of their creator, so logging and telemetry stay on service cores */
+    me::pin_thread(placement.service_cores);
+
     /* Initialise logging service */
-    spdlog::init_thread_pool(32768, std::max(1u, std::thread::hardware_concurrency() - 1));
+    spdlog::init_thread_pool(32768, 1);
     spdlog::flush_every(1s);
     const auto console = spdlog::create_async<spdlog::sinks::stdout_color_sink_mt>("console");
+    for (auto [role, cores] : {std::pair{"consumer", &placement.consumer_cores},
+                               std::pair{"I/O", &placement.io_cores},
+                               std::pair{"service", &placement.service_cores}}) {
+        std::string nodes;
+        for (const auto core : *cores)
+            nodes += (nodes.empty() ? "" : ",") + std::to_string(me::numa_node(core));
+        console->info("Topology: {} cores {} on NUMA nodes {}", role, me::format_cores(*cores), nodes);
+    }
 
     /* Initialise order dispatching service */
-    const std::vector<std::string_view> markets = {
-        u8"EUR_USD", u8"GBP_USD", u8"AUD_USD", u8"NZD_USD",
-        u8"EUR_GBP",
-        u8"USD_CHF",
-        u8"USD_CAD",
-        u8"EUR_AUD",
-        u8"GBP_JPY", u8"USD_JPY"
+    /* Market, tick size, lot size */
+    const std::vector<me::market_spec> markets = {
+        {u8"EUR_USD", "0.00001", "0.01"}, {u8"GBP_USD", "0.00001", "0.01"},
+        {u8"AUD_USD", "0.00001", "0.01"}, {u8"NZD_USD", "0.00001", "0.01"},
+        {u8"EUR_GBP", "0.00001", "0.01"},
+        {u8"USD_CHF", "0.00001", "0.01"},
+        {u8"USD_CAD", "0.00001", "0.01"},
+        {u8"EUR_AUD", "0.00001", "0.01"},
+        {u8"GBP_JPY", "0.001", "0.01"}, {u8"USD_JPY", "0.001", "0.01"}
+    };
+    /*
+     * Depth deltas replace periodic snapshot files; markets may also be added over HTTP.
+     * Consumers only queue the raw records, which journal threads format and write.
+     */
+    std::shared_ptr<me::router::dispatcher> dispatcher;
+    const auto depth_logger = spdlog::basic_logger_st("depth_log", "data/depth.csv", true);
+    depth_logger->set_pattern("%v");
+    struct depth_record {
+        me::MarketId market;
+        me::DepthDelta delta;
+    };
+    /* Records only follow commands, which only come in once the dispatcher is up */
+    me::journal<depth_record> depth_journal{[&](const depth_record &record) {
+        const auto &spec = dispatcher->market(record.market);
+        const auto &delta = record.delta;
+        depth_logger->info("{},{},{},{},{},{}", spec.name, delta.sequence, delta.side,
+                           spec.tick.value(delta.price), spec.lot.value(delta.quantity), delta.count);
+    }};
+    /* Fills, rests, cancels and amends of every command, as the books report them */
+    const auto execution_logger = spdlog::basic_logger_st("execution_log", "data/executions.csv", true);
+    execution_logger->set_pattern("%v");
+    me::journal<me::ExecutionReport> execution_journal{[&](const me::ExecutionReport &report) {
+        const auto &spec = dispatcher->market(report.market);
+        execution_logger->info("{},{},{},{},{},{},{},{},{}", spec.name, report.type, report.side, report.taker,
+                               report.maker, spec.tick.value(report.price), spec.lot.value(report.quantity),
+                               spec.lot.value(report.taker_leftover), spec.lot.value(report.maker_leftover));
+    }};
+    me::router::depth_feed feed;
+    feed.delta = [&](const me::MarketId market, const me::DepthDelta &delta) {
+        depth_journal({market, delta});
+    };
+    feed.execution = [&](const me::ExecutionReport &report) {
+        execution_journal(report);
     };
-    auto dispatcher = std::make_shared<me::router::dispatcher>(markets, console);
+    /* Idle consumers: WAIT_STRATEGY=spin|yield|block (default) */
+    const auto wait_name = std::getenv("WAIT_STRATEGY");
+    const auto wait = me::router::parse_wait(wait_name ? wait_name : "block");
+    if (!wait) {
+        console->error("Unknown WAIT_STRATEGY {}", wait_name);
+        return 1;
+    }
+    /* Queued commands per consumer at which new orders are answered with 503: ADMISSION_LIMIT=N */
+    auto admission_limit = me::router::consumer::default_admission_limit;
+    if (const auto limit = std::getenv("ADMISSION_LIMIT")) {
+        const auto end = limit + std::strlen(limit);
+        if (std::from_chars(limit, end, admission_limit).ptr != end || *limit == '\0') {
+            console->error("Invalid ADMISSION_LIMIT {}", limit);
+            return 1;
+        }
+    }
+    /*
+     * Stage tracing: TRACE_SAMPLE=0 keeps per-stage latency histograms, TRACE_SAMPLE=N also dumps
+     * every N-th order raw to TRACE_FILE (default data/trace.bin); unset disables it
+     */
+    std::shared_ptr<me::trace::tracer> tracer;
+    if (const auto sample = std::getenv("TRACE_SAMPLE")) {
+        const auto end = sample + std::strlen(sample);
+        uint64_t sample_every = 0;
+        if (std::from_chars(sample, end, sample_every).ptr != end || *sample == '\0') {
+            console->error("Invalid TRACE_SAMPLE {}", sample);
+            return 1;
+        }
+        const auto file = std::getenv("TRACE_FILE");
+        tracer = std::make_shared<me::trace::tracer>(sample_every, file ? file : "data/trace.bin");
+        if (!tracer->writable()) {
+            console->error("Cannot write trace file {}", file ? file : "data/trace.bin");
+            return 1;
+        }
+        console->info("Tracing stages with the {}", me::trace::clock::tsc() ? "TSC" : "monotonic clock");
+    }
+    /* Native order entry: ORDER_ENTRY_BACKEND=asio (default) or io_uring, which falls back to asio where unsupported */
+    const auto backend = std::getenv("ORDER_ENTRY_BACKEND");
+    if (backend != nullptr && std::strcmp(backend, "asio") != 0 && std::strcmp(backend, "io_uring") != 0) {
+        console->error("Unknown ORDER_ENTRY_BACKEND {}", backend);
+        return 1;
+    }
+    const auto use_uring = backend != nullptr && std::strcmp(backend, "io_uring") == 0;
+    /*
+     * I/O threads: IO_WAIT=block (default), poll, or adaptive which polls while the completions
+     * per second of a thread are above IO_POLL_RATE; IO_BUSY_POLL_US sets SO_BUSY_POLL unless blocking
+     */
+    me::tcp::io_policy io_policy;
+    const auto io_wait_name = std::getenv("IO_WAIT");
+    const auto io_wait = me::tcp::parse_io_wait(io_wait_name ? io_wait_name : "block");
+    if (!io_wait) {
+        console->error("Unknown IO_WAIT {}", io_wait_name);
+        return 1;
+    }
+    io_policy.wait = *io_wait;
+    if (const auto rate = std::getenv("IO_POLL_RATE")) {
+        const auto end = rate + std::strlen(rate);
+        if (std::from_chars(rate, end, io_policy.poll_rate).ptr != end || *rate == '\0' || io_policy.poll_rate <= 0) {
+            console->error("Invalid IO_POLL_RATE {}", rate);
+            return 1;
+        }
+    }
+    if (const auto usec = std::getenv("IO_BUSY_POLL_US")) {
+        const auto end = usec + std::strlen(usec);
+        if (std::from_chars(usec, end, io_policy.busy_poll_us).ptr != end || *usec == '\0') {
+            console->error("Invalid IO_BUSY_POLL_US {}", usec);
+            return 1;
+        }
+    }
+    dispatcher = std::make_shared<me::router::dispatcher>(markets, console, feed, *wait, placement, admission_limit,
+                                                          tracer);
 
-    /* Initialise TCP transport layer */
-    boost::asio::io_context ioc{(int)std::thread::hardware_concurrency()};
-    me::tcp::server server(ioc, dispatcher, console);
+    /* Telemetry: METRICS_ENDPOINT=host:port of an InfluxDB UDP listener, METRICS_INTERVAL_MS */
+    const auto endpoint = std::getenv("METRICS_ENDPOINT");
+    const auto interval = std::getenv("METRICS_INTERVAL_MS");
+    auto interval_ms = 250u;
+    if (interval != nullptr && (std::from_chars(interval, interval + std::strlen(interval), interval_ms).ec != std::errc{}
+                                || interval_ms == 0)) {
+        console->error("Invalid METRICS_INTERVAL_MS {}", interval);
+        return 1;
+    }
 
-    ioc.run();
+    /* Initialise TCP transport layer: an io_context and an acceptor per I/O thread */
+    me::tcp::server server(dispatcher, console, 8080, placement.io_cores, io_policy);
+    /* Native order entry: a ring per I/O core, or a listener on each asio shard */
+    std::vector<std::unique_ptr<me::tcp::uring_server>> uring_servers;
+    std::vector<std::unique_ptr<me::tcp::binary_server>> binary_servers;
+    if (use_uring) {
+        try {
+            for (const auto core : placement.io_cores)
+                uring_servers.push_back(std::make_unique<me::tcp::uring_server>(dispatcher, console, 8081, core));
+        } catch (const std::system_error &error) {
+            console->warn("io_uring is unavailable ({}), order entry falls back to asio", error.what());
+            uring_servers.clear();
+        }
+    }
+    for (std::size_t index = 0; uring_servers.empty() && index < server.shards(); ++index)
+        binary_servers.push_back(std::make_unique<me::tcp::binary_server>(server.context(index), dispatcher, console,
+                                 8081, io_policy));
+    /* Market registration; apart from order entry, on the loopback interface only */
+    me::tcp::admin_server admin_server(dispatcher, console, 8082);
 
-    /*
-     * Join threads after event loop termination
-     * TODO notify market consumers to stop
-     * */
+    /* Declared after the servers it reports on, so that it stops before them */
+    me::metrics::exporter exporter{endpoint ? endpoint : "172.17.0.1:8089", std::chrono::milliseconds(interval_ms),
+                                   placement.service_cores};
+    if (!exporter.connected())
+        console->warn("Metrics endpoint {} is unreachable, metrics are dropped", endpoint ? endpoint : "172.17.0.1:8089");
+    exporter.add([dispatcher](me::metrics::line_writer &out) {
+        dispatcher->report(out);
+    });
+    exporter.add([&server](me::metrics::line_writer &out) {
+        server.report(out);
+    });
+    exporter.add([&depth_journal, &execution_journal](me::metrics::line_writer &out) {
+        out.meas("journal").tag("log", "depth").field("dropped", depth_journal.dropped()).end();
+        out.meas("journal").tag("log", "executions").field("dropped", execution_journal.dropped()).end();
+    });
+
+    server.join();
+
+    /* Consumers drain and stop before the journals they write to go away */
+    dispatcher->shutdown();
 
     return 0;
 }
@@ -76,21 +264,5 @@ int main(int argc, char *argv[])
    std::this_thread::sleep_for(500ms);
    }
    };
-   const auto snapshot_writer = [&] {
-   while (true) {
-// Destroy existing snapshot file on every iteration
-auto ob_logger =
-spdlog::create_async<spdlog::sinks::basic_file_sink_mt>(
-"orderbook_log", "data/snapshot.csv", true);
-ob_logger->set_pattern("%v");
-for (auto point : ob->snapshot()) {
-ob_logger->info("{},{},{},{}", point.side, point.price,
-point.cumulative_quantity, point.size);
-}
-spdlog::drop("orderbook_log");
-std::this_thread::sleep_for(500ms);
-}
-};
 boost::asio::post(pool, tick_writer);
-boost::asio::post(pool, snapshot_writer);
 */
\ No newline at end of file
@@ -1,12 +1,41 @@
 #include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
 #include <vector>
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/uuid_generators.hpp>
 #include <orderbook.hpp>
+#include <price_ladder.hpp>
 #include <order_router.hpp>
 #include <tcp_server.hpp>
+#include <uring_server.hpp>
+#include <binary_client.hpp>
 #include "markov.h"
 
 using namespace matching_engine;
 
+/* Heap allocations of the whole process, for benchmarks which report allocations per operation */
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto memory = std::malloc(size ? size : 1))
+        return memory;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
 static auto SimulateMarket(int count)
 {
     double S0 = 80;
@@ -16,15 +45,35 @@ static auto SimulateMarket(int count)
     return geoBrownian(S0, mu, sigma, T, count);
 }
 
-static void OrderCreation(benchmark::State& state)
+/* Order layout before compaction: random UUID, clock read and market name per order */
+struct LegacyOrder {
+    LegacyOrder(const std::string_view &market_name, const SIDE &side, const Price &price,
+                const Quantity &quantity,
+                const boost::uuids::uuid uuid = boost::uuids::random_generator()(),
+                const TimePoint &created = Time::now()):
+        market_name{market_name}, side{side}, price{price}, quantity{quantity}, uuid{uuid},
+        tif{TIF::GTC}, state{STATE::INACTIVE}, executed_quantity{0}, created{created} {}
+    const std::string_view market_name;
+    const SIDE side;
+    const Price price;
+    const Quantity quantity;
+    const boost::uuids::uuid uuid;
+    const TIF tif;
+    STATE state;
+    Quantity executed_quantity;
+    const TimePoint created;
+};
+
+template <typename order_type, typename market_type>
+static void CreateOrders(benchmark::State& state, market_type market)
 {
-    auto market = "USD_JPY";
     auto side = rand() % 2 ? SIDE::BUY : SIDE::SELL;
     Price price = rand() % 100 + 1;
-    Quantity quantity = double(rand() % 100 + 1) / (rand() % 20 + 1);
+    Quantity quantity = rand() % 100 + 1;
     for (auto _ : state) {
         auto start = std::chrono::high_resolution_clock::now();
-        auto order = std::make_unique<Order>(market, side, price, quantity);
+        auto order = std::make_unique<order_type>(market, side, price, quantity);
+        benchmark::DoNotOptimize(order);
         auto end = std::chrono::high_resolution_clock::now();
         auto elapsed_seconds =
             std::chrono::duration_cast<std::chrono::duration<double>>(
@@ -33,6 +82,17 @@ static void OrderCreation(benchmark::State& state)
     }
     state.SetComplexityN(state.range(0));
 }
+
+static void LegacyOrderCreation(benchmark::State& state)
+{
+    CreateOrders<LegacyOrder>(state, std::string_view{"USD_JPY"});
+}
+BENCHMARK(LegacyOrderCreation)->DenseRange(1, 1000, 250)->UseManualTime()->Complexity(benchmark::oN);
+
+static void OrderCreation(benchmark::State& state)
+{
+    CreateOrders<Order>(state, MarketId{0});
+}
 BENCHMARK(OrderCreation)->DenseRange(1, 1000, 250)->UseManualTime()->Complexity(benchmark::oN);
 
 static void OrderMatching(benchmark::State& state)
@@ -44,8 +104,8 @@ static void OrderMatching(benchmark::State& state)
     for(auto _ : state) {
         for (auto price : prices) {
             auto side = rand() % 2 ? SIDE::BUY : SIDE::SELL;
-            auto quantity = double(rand() % 10 + 1) / (rand() % 20 + 1);
-            auto order = std::make_unique<Order>(market, side, price, quantity);
+            Quantity quantity = rand() % 10 + 1;
+            auto order = std::make_unique<Order>(MarketId{0}, side, Price(price * 1000), quantity);
             auto start = std::chrono::high_resolution_clock::now();
             ob.match(std::move(order));
             auto end = std::chrono::high_resolution_clock::now();
@@ -59,25 +119,291 @@ static void OrderMatching(benchmark::State& state)
 }
 BENCHMARK(OrderMatching)->DenseRange(1, 1000, 250)->UseManualTime()->Complexity(benchmark::oLogN);
 
-// TODO Starts and hangs, issue with thread pool. Fix it.
+/* Tree vs dense ladder on the same GBM flow */
+template <typename Book>
+static void BookMatching(benchmark::State& state)
+{
+    std::string market = "USD_JPY";
+    Book ob(market);
+    auto prices = SimulateMarket(state.range(0));
+    for(auto _ : state) {
+        for (auto price : prices) {
+            auto side = rand() % 2 ? SIDE::BUY : SIDE::SELL;
+            Quantity quantity = rand() % 10 + 1;
+            auto order = std::make_unique<Order>(MarketId{0}, side, Price(price * 1000), quantity);
+            auto start = std::chrono::high_resolution_clock::now();
+            ob.match(std::move(order));
+            auto end = std::chrono::high_resolution_clock::now();
+            auto elapsed_seconds =
+                std::chrono::duration_cast<std::chrono::duration<double>>(
+                    end - start);
+            state.SetIterationTime(elapsed_seconds.count());
+        }
+    }
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK_TEMPLATE(BookMatching, OrderBook)->DenseRange(1, 1000, 250)->UseManualTime();
+BENCHMARK_TEMPLATE(BookMatching, LadderOrderBook)->DenseRange(1, 1000, 250)->UseManualTime();
+
+/* Same GBM flow handed to the book in runs of state.range(0) orders */
+template <typename Book>
+static void BatchMatching(benchmark::State& state)
+{
+    std::string market = "USD_JPY";
+    Book ob(market);
+    const std::size_t batch_size = state.range(0);
+    auto prices = SimulateMarket(1000);
+    std::vector<Order> batch;
+    batch.reserve(batch_size);
+    for(auto _ : state) {
+        for (std::size_t first = 0; first < prices.size(); first += batch_size) {
+            batch.clear();
+            for (auto index = first; index < std::min(first + batch_size, prices.size()); ++index) {
+                auto side = rand() % 2 ? SIDE::BUY : SIDE::SELL;
+                Quantity quantity = rand() % 10 + 1;
+                batch.emplace_back(MarketId{0}, side, Price(prices[index] * 1000), quantity);
+            }
+            auto start = std::chrono::high_resolution_clock::now();
+            ob.match_batch(batch.begin(), batch.end());
+            auto end = std::chrono::high_resolution_clock::now();
+            auto elapsed_seconds =
+                std::chrono::duration_cast<std::chrono::duration<double>>(
+                    end - start);
+            state.SetIterationTime(elapsed_seconds.count());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * prices.size());
+}
+BENCHMARK_TEMPLATE(BatchMatching, OrderBook)->Arg(1)->Arg(8)->Arg(64)->UseManualTime();
+BENCHMARK_TEMPLATE(BatchMatching, LadderOrderBook)->Arg(1)->Arg(8)->Arg(64)->UseManualTime();
+
+/*
+ * Matching plus depth publication while state.range(0) readers copy the full depth in a tight loop.
+ * With no reader the replica is drained untimed after every order, so that publication fills and
+ * commits the ring as it does under readers instead of deferring once it is full.
+ */
+static void MatchingUnderSnapshots(benchmark::State& state)
+{
+    router::market_book market{"USD_JPY"};
+    std::atomic_bool stop{false};
+    std::vector<std::thread> readers;
+    for (auto reader = state.range(0); reader > 0; --reader) {
+        readers.emplace_back([&] {
+            std::vector<std::pair<Price, DepthMirror::level>> copy;
+            while (!stop) {
+                market.depth.read([&](const DepthMirror &mirror) {
+                    copy.assign(mirror.bids().begin(), mirror.bids().end());
+                    copy.insert(copy.end(), mirror.asks().begin(), mirror.asks().end());
+                });
+                benchmark::DoNotOptimize(copy.data());
+            }
+        });
+    }
+    auto prices = SimulateMarket(1000);
+    for(auto _ : state) {
+        for (auto price : prices) {
+            auto side = rand() % 2 ? SIDE::BUY : SIDE::SELL;
+            Quantity quantity = rand() % 10 + 1;
+            Order order{MarketId{0}, side, Price(price * 1000), quantity};
+            auto start = std::chrono::high_resolution_clock::now();
+            market.book.match(order);
+            market.depth.publish(market.book, [](const DepthDelta &) {});
+            auto end = std::chrono::high_resolution_clock::now();
+            if (readers.empty())
+                market.depth.drain();
+            auto elapsed_seconds =
+                std::chrono::duration_cast<std::chrono::duration<double>>(
+                    end - start);
+            state.SetIterationTime(elapsed_seconds.count());
+        }
+    }
+    stop = true;
+    for (auto& reader : readers)
+        reader.join();
+    state.SetItemsProcessed(state.iterations() * prices.size());
+}
+BENCHMARK(MatchingUnderSnapshots)->Arg(0)->Arg(1)->Arg(2)->UseManualTime();
+
+/* Producer-side cost of handing orders to a consumer idling with wait strategy state.range(1) */
 static void OrderDispatching(benchmark::State& state)
 {
     // Perform setup here
-    const std::vector<std::string_view> markets = {u8"USD_JPY"};
-    auto dispatcher = std::make_shared<router::dispatcher>(markets);
+    const std::vector<market_spec> markets = {{u8"USD_JPY", "0.001", "0.01"}};
+    /* One consumer, on its own core when there is one to spare */
+    auto placement = default_placement();
+    placement.consumer_cores.resize(1);
+    /* Third argument: stamp every order with stage traces, histograms only */
+    auto tracer = state.range(2) ? std::make_shared<trace::tracer>() : nullptr;
+    auto dispatcher = std::make_shared<router::dispatcher>(markets, nullptr, router::depth_feed{},
+                      router::WAIT(state.range(1)), placement, router::consumer::default_admission_limit, tracer);
     auto prices = SimulateMarket(state.range(0));
     for(auto _ : state) {
         for (auto price : prices) {
+            trace::origin origin;
+            if (tracer != nullptr)
+                origin.read = origin.parsed = trace::clock::now();
             auto side = rand() % 2 ? SIDE::BUY : SIDE::SELL;
-            auto quantity = double(rand() % 10 + 1) / (rand() % 20 + 1);
-            auto order = std::make_unique<Order>(markets[0], side, price, quantity);
-            dispatcher->send(std::move(order));
+            Quantity quantity = rand() % 10 + 1;
+            auto order = std::make_unique<Order>(dispatcher->market(markets[0].name)->id, side, Price(price * 1000), quantity);
+            dispatcher->send(std::move(order), tracer != nullptr ? &origin : nullptr);
         }
     }
+    /* Orders refused by admission control while the consumer was saturated */
+    state.counters["shed"] = dispatcher->admission(0).shed;
     dispatcher->shutdown();
 }
+BENCHMARK(OrderDispatching)->Args({1000, router::WAIT::BUSY_SPIN, 0})->MeasureProcessCPUTime();
+BENCHMARK(OrderDispatching)->Args({1000, router::WAIT::SPIN_YIELD, 0})->MeasureProcessCPUTime();
+BENCHMARK(OrderDispatching)->Args({1000, router::WAIT::BLOCK, 0})->MeasureProcessCPUTime();
+BENCHMARK(OrderDispatching)->Args({1000, router::WAIT::BLOCK, 1})->MeasureProcessCPUTime();
+
+enum ORDER_ENTRY_BACKEND { ASIO, IO_URING };
 
-//BENCHMARK(OrderDispatching)->DenseRange(0, 1000, 250)->MeasureProcessCPUTime();
+/*
+ * Native order entry over loopback on the asio or io_uring listener: a burst of new orders
+ * per flush, then all their acks. p99 is of the latency of an ack from the flush of its burst.
+ */
+static void BinaryOrderEntry(benchmark::State& state)
+{
+    const std::vector<market_spec> markets = {{u8"USD_JPY", "0.001", "0.01"}};
+    auto placement = default_placement();
+    placement.consumer_cores.resize(1);
+    auto dispatcher = std::make_shared<router::dispatcher>(markets, nullptr, router::depth_feed{},
+                      router::WAIT::BLOCK, placement);
+    const auto console = std::make_shared<spdlog::logger>("binary_order_entry");
+    boost::asio::io_context ioc{1};
+    auto work = boost::asio::make_work_guard(ioc);
+    std::unique_ptr<tcp::binary_server> asio_server;
+    std::unique_ptr<tcp::uring_server> uring_server;
+    if (state.range(1) == ORDER_ENTRY_BACKEND::IO_URING) {
+        try {
+            uring_server = std::make_unique<tcp::uring_server>(dispatcher, console, 0);
+        } catch (const std::system_error &error) {
+            state.SkipWithError(error.what());
+            dispatcher->shutdown();
+            return;
+        }
+    } else {
+        asio_server = std::make_unique<tcp::binary_server>(ioc, dispatcher, console, 0);
+    }
+    std::thread io{[&ioc] { ioc.run(); }};
+    wire::client client{"127.0.0.1", asio_server ? asio_server->port() : uring_server->port()};
+    const auto market = *client.market(markets[0].name);
+    auto prices = SimulateMarket(state.range(0));
+    std::size_t busy = 0;
+    metrics::histogram latency_ns;
+    for(auto _ : state) {
+        for (auto price : prices) {
+            auto side = rand() % 2 ? SIDE::BUY : SIDE::SELL;
+            Quantity quantity = rand() % 10 + 1;
+            client.new_order(market, side, Price(price * 1000), quantity);
+        }
+        const auto flushed = std::chrono::steady_clock::now();
+        client.flush();
+        for (std::size_t acks = 0; acks < prices.size();) {
+            const auto read = client.read([&](const wire::ack &reply) {
+                busy += reply.status == wire::BUSY;
+            });
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now() - flushed).count();
+            for (std::size_t ack = 0; ack < read; ++ack)
+                latency_ns.record(elapsed);
+            acks += read;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * prices.size());
+    state.counters["busy"] = busy;
+    state.counters["p99_ns"] = latency_ns.take().quantile(0.99);
+    if (asio_server)
+        asio_server->shutdown();
+    uring_server.reset();
+    work.reset();
+    ioc.stop();
+    io.join();
+    dispatcher->shutdown();
+}
+BENCHMARK(BinaryOrderEntry)->ArgsProduct({{1, 100, 1000}, {ORDER_ENTRY_BACKEND::ASIO, ORDER_ENTRY_BACKEND::IO_URING}})
+->UseRealTime();
+
+/*
+ * Pipelined keep-alive HTTP orders over loopback, a burst per round trip on each of a number
+ * of connections, which the kernel spreads over the acceptors of the I/O threads, buying and
+ * selling at one price so that the book stays flat. The client works on fixed buffers, so
+ * the allocations counted are those of the server, the dispatcher and the consumer.
+ */
+static void HttpOrderEntry(benchmark::State& state)
+{
+    const std::vector<market_spec> markets = {{u8"USD_JPY", "0.001", "0.01"}};
+    auto placement = default_placement();
+    placement.consumer_cores.resize(1);
+    auto dispatcher = std::make_shared<router::dispatcher>(markets, nullptr, router::depth_feed{},
+                      router::WAIT::BLOCK, placement);
+    const auto console = std::make_shared<spdlog::logger>("http_order_entry");
+    /* I/O threads take the I/O cores in turn */
+    std::vector<unsigned> io_cores;
+    for (std::size_t index = 0; index < std::size_t(state.range(2)); ++index)
+        io_cores.push_back(placement.io_cores[index % placement.io_cores.size()]);
+    auto server = std::make_unique<tcp::server>(dispatcher, console, 0, io_cores);
+    boost::asio::io_context client_ioc;
+    std::vector<boost::asio::ip::tcp::socket> clients;
+    for (std::size_t index = 0; index < std::size_t(state.range(1)); ++index) {
+        auto &client = clients.emplace_back(client_ioc);
+        client.connect({boost::asio::ip::make_address("127.0.0.1"), server->port()});
+        client.set_option(boost::asio::ip::tcp::no_delay(true));
+    }
+    const auto burst = std::size_t(state.range(0));
+    std::string requests;
+    for (std::size_t index = 0; index < burst; ++index)
+        requests += index % 2 ? "GET /SELL/USD_JPY/80.123/1 HTTP/1.1\r\nHost: b\r\n\r\n"
+                    : "GET /BUY/USD_JPY/80.123/1 HTTP/1.1\r\nHost: b\r\n\r\n";
+    std::array<char, 1 << 16> responses;
+    /* Reads until every response of the burst is in; Content-Length frames them */
+    const auto read_responses = [&](boost::asio::ip::tcp::socket &client) {
+        std::size_t filled = 0;
+        for (std::size_t read = 0; read < burst;) {
+            filled += client.read_some(boost::asio::buffer(responses.data() + filled, responses.size() - filled));
+            std::string_view pending{responses.data(), filled};
+            std::size_t consumed = 0;
+            for (;;) {
+                const auto end = pending.find("\r\n\r\n", consumed);
+                const auto length = pending.find("Content-Length: ", consumed);
+                if (end == std::string_view::npos || length == std::string_view::npos || length > end)
+                    break;
+                const auto body = std::size_t(std::atoi(pending.data() + length + 16));
+                if (end + 4 + body > filled)
+                    break;
+                consumed = end + 4 + body;
+                ++read;
+            }
+            std::memmove(responses.data(), responses.data() + consumed, filled - consumed);
+            filled -= consumed;
+        }
+    };
+    /* Every connection has a burst in flight before the first is read back */
+    const auto round_trip = [&] {
+        for (auto &client : clients)
+            boost::asio::write(client, boost::asio::buffer(requests));
+        for (auto &client : clients)
+            read_responses(client);
+    };
+    /* Warms up the connections, their buffers and the book */
+    round_trip();
+    const auto allocated = allocations.load();
+    for(auto _ : state)
+        round_trip();
+    const auto orders = state.iterations() * burst * clients.size();
+    state.SetItemsProcessed(orders);
+    state.counters["allocs_per_request"] = double(allocations.load() - allocated) / orders;
+    for (auto &client : clients)
+        client.close();
+    server->shutdown();
+    server->stop();
+    server->join();
+    dispatcher->shutdown();
+}
+/* Burst, connections, I/O threads */
+BENCHMARK(HttpOrderEntry)->Args({1, 1, 1})->Args({16, 1, 1})->Args({128, 1, 1})
+->Args({16, 64, 1})->Args({16, 64, 2})->Args({16, 64, 4})->UseRealTime();
 
 /* Run the benchmark */
 BENCHMARK_MAIN();
@@ -1,9 +1,1000 @@
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <binary_protocol.hpp>
+#include <ingress.hpp>
+#include <journal.hpp>
+#include <market.hpp>
+#include <market_data.hpp>
+#include <order_router.hpp>
+#include <orderbook.hpp>
+#include <price_ladder.hpp>
+
+using namespace matching_engine;
+
+/* Cancel by id through the order index */
+TEST(OrderBookCancel, RemovesRestingOrderById)
+{
+    OrderBook book{"TEST"};
+    book.match(Order{0, SIDE::BUY, 100, 5, 1});
+    book.match(Order{0, SIDE::BUY, 99, 3, 2});
+    std::vector<ExecutionReport> reports;
+    EXPECT_TRUE(book.cancel(1, [&](const ExecutionReport &report) {
+        reports.push_back(report);
+    }));
+    ASSERT_EQ(reports.size(), 1u);
+    EXPECT_EQ(reports[0].type, EXECUTION::CANCEL_ACK);
+    EXPECT_EQ(reports[0].taker, 1u);
+    EXPECT_EQ(reports[0].price, 100u);
+    EXPECT_EQ(reports[0].quantity, 5u);
+    EXPECT_EQ(book.info(1), nullptr);
+    EXPECT_NE(book.info(2), nullptr);
+    EXPECT_EQ(book.top_of_book().load().bid, 99u);
+}
+
+TEST(OrderBookCancel, UnknownOrFilledIdIsRefused)
+{
+    OrderBook book{"TEST"};
+    EXPECT_FALSE(book.cancel(42));
+    book.match(Order{0, SIDE::SELL, 100, 2, 1});
+    book.match(Order{0, SIDE::BUY, 100, 2, 2});
+    EXPECT_FALSE(book.cancel(1));
+    EXPECT_FALSE(book.cancel(2));
+    book.match(Order{0, SIDE::SELL, 100, 2, 3});
+    EXPECT_TRUE(book.cancel(3));
+    EXPECT_FALSE(book.cancel(3));
+}
+
+TEST(OrderBookCancel, KeepsPriorityOfTheRestOfTheLevel)
+{
+    OrderBook book{"TEST"};
+    for (OrderId id = 1; id <= 3; ++id)
+        book.match(Order{0, SIDE::SELL, 100, 1, id});
+    EXPECT_TRUE(book.cancel(2));
+    std::vector<OrderId> makers;
+    book.match(Order{0, SIDE::BUY, 100, 2, 4}, OrderInfo{}, [&](const ExecutionReport &report) {
+        makers.push_back(report.maker);
+    });
+    EXPECT_EQ(makers, (std::vector<OrderId>{1, 3}));
+    const auto depth = book.snapshot(OrderBook::full_depth);
+    EXPECT_TRUE(depth.empty());
+}
+
+/* Price ladder: window re-centring and the overflow tree */
+TEST(PriceLadder, RecentersWhenOccupiedLevelsStillFit)
+{
+    LadderOrderBook book{"TEST", Price{1}, std::size_t{64}};
+    book.match(Order{0, SIDE::BUY, 1000, 1, 1});
+    book.match(Order{0, SIDE::BUY, 1020, 2, 2});
+    book.match(Order{0, SIDE::BUY, 1050, 3, 3}); /* Outside of the first window */
+    book.match(Order{0, SIDE::BUY, 990, 4, 4});
+    const auto depth = book.snapshot(OrderBook::full_depth);
+    ASSERT_EQ(depth.size(), 4u);
+    EXPECT_EQ(depth[0].price, 1050u);
+    EXPECT_EQ(depth[1].price, 1020u);
+    EXPECT_EQ(depth[2].price, 1000u);
+    EXPECT_EQ(depth[3].price, 990u);
+    EXPECT_EQ(depth[0].cumulative_quantity, 3u);
+    EXPECT_EQ(depth[3].cumulative_quantity, 4u);
+    std::vector<OrderId> makers;
+    book.match(Order{0, SIDE::SELL, 990, 10, 5}, OrderInfo{}, [&](const ExecutionReport &report) {
+        makers.push_back(report.maker);
+    });
+    EXPECT_EQ(makers, (std::vector<OrderId>{3, 2, 1, 4}));
+    EXPECT_TRUE(book.snapshot(OrderBook::full_depth).empty());
+}
+
+TEST(PriceLadder, ParksFarAndUnalignedPricesInOverflow)
+{
+    LadderOrderBook book{"TEST", Price{5}, std::size_t{64}};
+    book.match(Order{0, SIDE::SELL, 1000, 1, 1});
+    book.match(Order{0, SIDE::SELL, 1005, 1, 2});
+    book.match(Order{0, SIDE::SELL, 100000, 1, 3}); /* Too far to fit the window */
+    book.match(Order{0, SIDE::SELL, 1002, 1, 4});   /* Off the tick grid */
+    book.match(Order{0, SIDE::SELL, 10, 1, 5});     /* Below the window */
+    EXPECT_EQ(book.top_of_book().load().ask, 10u);
+    const auto depth = book.snapshot(OrderBook::full_depth);
+    std::vector<Price> prices;
+    for (const auto &point : depth)
+        prices.push_back(point.price);
+    EXPECT_EQ(prices, (std::vector<Price>{10, 1000, 1002, 1005, 100000}));
+    std::vector<OrderId> makers;
+    book.match(Order{0, SIDE::BUY, 100000, 5, 6}, OrderInfo{}, [&](const ExecutionReport &report) {
+        makers.push_back(report.maker);
+    });
+    EXPECT_EQ(makers, (std::vector<OrderId>{5, 1, 4, 2, 3}));
+}
+
+TEST(PriceLadder, FollowsTheMarketOnceTheWindowEmpties)
+{
+    LadderOrderBook book{"TEST", Price{1}, std::size_t{64}};
+    book.match(Order{0, SIDE::BUY, 1000, 1, 1});
+    book.match(Order{0, SIDE::BUY, 500000, 1, 2}); /* Parked */
+    EXPECT_TRUE(book.cancel(2));
+    book.match(Order{0, SIDE::BUY, 400000, 1, 3}); /* Parked */
+    EXPECT_TRUE(book.cancel(1));                   /* Window re-centres on the parked level */
+    book.match(Order{0, SIDE::BUY, 400010, 1, 4});
+    book.match(Order{0, SIDE::BUY, 399990, 1, 5});
+    std::vector<OrderId> makers;
+    book.match(Order{0, SIDE::SELL, 1, 3, 6}, OrderInfo{}, [&](const ExecutionReport &report) {
+        makers.push_back(report.maker);
+    });
+    EXPECT_EQ(makers, (std::vector<OrderId>{4, 3, 5}));
+    EXPECT_EQ(book.top_of_book().load().bid, 0u);
+}
+
+/* Decimal prices and quantities in ticks and lots */
+TEST(DecimalScale, ConvertsOnGridDecimals)
+{
+    const decimal_scale tick{"0.05"};
+    EXPECT_EQ(tick.mantissa(), 5u);
+    EXPECT_EQ(tick.exponent(), 2u);
+    EXPECT_EQ(tick.steps("1.15"), 23u);
+    EXPECT_EQ(tick.steps("1.1"), 22u);
+    EXPECT_EQ(tick.steps("2"), 40u);
+    EXPECT_EQ(tick.steps("0.050000"), 1u);
+    EXPECT_DOUBLE_EQ(tick.value(23), 1.15);
+    const decimal_scale lot{"0.010"}; /* Normalised to 1 * 10^-2 */
+    EXPECT_EQ(lot.mantissa(), 1u);
+    EXPECT_EQ(lot.exponent(), 2u);
+    EXPECT_EQ(lot.steps("3.07"), 307u);
+}
+
+TEST(DecimalScale, RejectsOffGridInput)
+{
+    const decimal_scale tick{"0.05"};
+    EXPECT_FALSE(tick.steps("1.12"));
+    EXPECT_FALSE(tick.steps("1.151"));
+    const decimal_scale lot{"0.01"};
+    EXPECT_FALSE(lot.steps("0.001"));
+    EXPECT_EQ(lot.steps("0.010"), 1u);
+}
+
+TEST(DecimalScale, RejectsMalformedInput)
+{
+    const decimal_scale tick{"0.001"};
+    for (const auto text : {"", "abc", "-1", "+1", "1.2.3", "1e3", "1,5", " 1", "1 "})
+        EXPECT_FALSE(tick.steps(text)) << '"' << text << '"';
+    /* More significant digits than fit 64 bits */
+    EXPECT_FALSE(tick.steps("123456789012345678"));
+    EXPECT_TRUE(tick.steps("12345678901234"));
+}
+
+TEST(DecimalScale, RejectsInvalidSteps)
+{
+    for (const auto step : {"0", "0.00", "", "abc", "-0.01", "0.0000000001"})
+        EXPECT_THROW(decimal_scale{step}, std::invalid_argument) << '"' << step << '"';
+    EXPECT_THROW((market_spec{"TEST", "0.01", "0"}), std::invalid_argument);
+}
+
+/* Batch matching has the outcome of matching the same orders one by one */
+template <typename book_type>
+class MatchBatch : public ::testing::Test {};
+using book_types = ::testing::Types<OrderBook, LadderOrderBook>;
+TYPED_TEST_SUITE(MatchBatch, book_types);
+
+TYPED_TEST(MatchBatch, EqualsSequentialMatch)
+{
+    std::mt19937 random{7};
+    std::vector<Order> orders;
+    for (OrderId id = 1; id <= 5000; ++id)
+        orders.emplace_back(0, random() % 2 ? SIDE::BUY : SIDE::SELL, Price(1000 + random() % 40),
+                            Quantity(random() % 10 + 1), id);
+    const auto fields = [](const ExecutionReport &report) {
+        return std::make_tuple(report.type, report.side, report.market, report.taker, report.maker, report.price,
+                               report.quantity, report.taker_leftover, report.maker_leftover);
+    };
+    using fields_type = decltype(fields(std::declval<ExecutionReport>()));
+
+    TypeParam sequential{"TEST"};
+    std::vector<fields_type> sequential_reports;
+    std::size_t sequential_fulfilled = 0;
+    for (const auto &order : orders)
+        sequential_fulfilled += sequential.match(order, OrderInfo{}, [&](const ExecutionReport &report) {
+            sequential_reports.push_back(fields(report));
+        });
+
+    TypeParam batched{"TEST"};
+    std::vector<fields_type> batched_reports;
+    std::size_t batched_fulfilled = 0;
+    for (auto first = orders.begin(); first != orders.end();) {
+        /* Uneven batches, down to single orders */
+        const auto last = first + std::min<std::ptrdiff_t>(random() % 64 + 1, orders.end() - first);
+        batched_fulfilled += batched.match_batch(first, last, [&](const ExecutionReport &report) {
+            batched_reports.push_back(fields(report));
+        });
+        first = last;
+    }
+
+    EXPECT_EQ(batched_fulfilled, sequential_fulfilled);
+    EXPECT_EQ(batched_reports, sequential_reports);
+    const auto sequential_depth = sequential.snapshot(OrderBook::full_depth);
+    const auto batched_depth = batched.snapshot(OrderBook::full_depth);
+    ASSERT_EQ(batched_depth.size(), sequential_depth.size());
+    for (std::size_t level = 0; level < batched_depth.size(); ++level) {
+        EXPECT_EQ(batched_depth[level].side, sequential_depth[level].side);
+        EXPECT_EQ(batched_depth[level].price, sequential_depth[level].price);
+        EXPECT_EQ(batched_depth[level].cumulative_quantity, sequential_depth[level].cumulative_quantity);
+        EXPECT_EQ(batched_depth[level].size, sequential_depth[level].size);
+    }
+}
+
+/* Amend in place: a reduction at the same price keeps time priority, anything else loses it */
+TEST(OrderBookAmend, ReductionKeepsTimePriority)
+{
+    OrderBook book{"TEST"};
+    book.match(Order{0, SIDE::BUY, 100, 5, 1});
+    book.match(Order{0, SIDE::BUY, 100, 5, 2});
+    std::vector<ExecutionReport> reports;
+    const auto record = [&](const ExecutionReport &report) {
+        reports.push_back(report);
+    };
+    EXPECT_TRUE(book.amend(1, 100, 2, record));
+    ASSERT_EQ(reports.size(), 1u);
+    EXPECT_EQ(reports[0].type, EXECUTION::AMEND_ACK);
+    EXPECT_EQ(reports[0].quantity, 2u);
+    reports.clear();
+    book.match(Order{0, SIDE::SELL, 100, 3, 3}, OrderInfo{}, record);
+    ASSERT_EQ(reports.size(), 2u);
+    EXPECT_EQ(reports[0].maker, 1u);
+    EXPECT_EQ(reports[0].quantity, 2u);
+    EXPECT_EQ(reports[1].maker, 2u);
+    EXPECT_EQ(reports[1].quantity, 1u);
+    EXPECT_EQ(book.top_of_book().load().bid_quantity, 4u);
+}
+
+TEST(OrderBookAmend, IncreaseOrPriceChangeLosesTimePriority)
+{
+    OrderBook book{"TEST"};
+    for (OrderId id = 1; id <= 3; ++id)
+        book.match(Order{0, SIDE::SELL, 100, 1, id});
+    EXPECT_TRUE(book.amend(1, 100, 2)); /* Increase; behind 2 and 3 */
+    EXPECT_TRUE(book.amend(2, 101, 1)); /* Away and back; behind 1 */
+    EXPECT_TRUE(book.amend(2, 100, 1));
+    std::vector<OrderId> makers;
+    book.match(Order{0, SIDE::BUY, 100, 4, 4}, OrderInfo{}, [&](const ExecutionReport &report) {
+        makers.push_back(report.maker);
+    });
+    EXPECT_EQ(makers, (std::vector<OrderId>{3, 1, 2}));
+}
+
+TEST(OrderBookAmend, CrossingPriceMatchesAtOnce)
+{
+    OrderBook book{"TEST"};
+    book.match(Order{0, SIDE::SELL, 105, 2, 1});
+    book.match(Order{0, SIDE::BUY, 100, 3, 2});
+    std::vector<ExecutionReport> reports;
+    EXPECT_TRUE(book.amend(2, 105, 3, [&](const ExecutionReport &report) {
+        reports.push_back(report);
+    }));
+    ASSERT_EQ(reports.size(), 2u);
+    EXPECT_EQ(reports[0].type, EXECUTION::AMEND_ACK);
+    EXPECT_EQ(reports[1].type, EXECUTION::PARTIAL_FILL);
+    EXPECT_EQ(reports[1].taker, 2u);
+    EXPECT_EQ(reports[1].maker, 1u);
+    const auto top = book.top_of_book().load();
+    EXPECT_EQ(top.bid, 105u);
+    EXPECT_EQ(top.bid_quantity, 1u);
+    EXPECT_EQ(top.ask, 0u);
+}
+
+TEST(OrderBookAmend, RefusesUnknownOrdersAndNothingLeftOpen)
+{
+    OrderBook book{"TEST"};
+    EXPECT_FALSE(book.amend(1, 100, 1));
+    book.match(Order{0, SIDE::BUY, 100, 5, 1});
+    book.match(Order{0, SIDE::SELL, 100, 3, 2}); /* 3 of 5 executed */
+    EXPECT_FALSE(book.amend(1, 100, 3));
+    EXPECT_TRUE(book.amend(1, 100, 4));
+    EXPECT_EQ(book.top_of_book().load().bid_quantity, 1u);
+}
+
+/* Depth mirrors follow the delta stream, detect gaps and resync from a snapshot */
+TEST(DepthMirror, FollowsDeltasInSequence)
+{
+    OrderBook book{"TEST"};
+    DepthMirror mirror;
+    const auto apply = [&](const DepthDelta &delta) {
+        EXPECT_TRUE(mirror.apply(delta));
+    };
+    book.match(Order{0, SIDE::BUY, 100, 5, 1});
+    book.match(Order{0, SIDE::BUY, 100, 2, 2});
+    book.match(Order{0, SIDE::SELL, 102, 3, 3});
+    book.publish(apply);
+    book.match(Order{0, SIDE::SELL, 100, 5, 4}); /* Takes order 1 and leaves the level at 2 */
+    book.match(Order{0, SIDE::BUY, 102, 3, 5});  /* Empties the ask level */
+    book.publish(apply);
+    EXPECT_EQ(mirror.sequence(), book.sequence());
+    ASSERT_EQ(mirror.bids().size(), 1u);
+    EXPECT_EQ(mirror.bids().begin()->first, 100u);
+    EXPECT_EQ(mirror.bids().begin()->second.quantity, 2u);
+    EXPECT_EQ(mirror.bids().begin()->second.count, 1u);
+    EXPECT_TRUE(mirror.asks().empty());
+}
+
+TEST(DepthMirror, DetectsGapAndResyncs)
+{
+    OrderBook book{"TEST"};
+    std::vector<DepthDelta> deltas;
+    const auto record = [&](const DepthDelta &delta) {
+        deltas.push_back(delta);
+    };
+    book.match(Order{0, SIDE::BUY, 100, 1, 1});
+    book.match(Order{0, SIDE::BUY, 99, 1, 2});
+    book.match(Order{0, SIDE::SELL, 101, 1, 3});
+    book.publish(record);
+    ASSERT_EQ(deltas.size(), 3u);
+
+    DepthMirror mirror;
+    EXPECT_TRUE(mirror.apply(deltas[0]));
+    EXPECT_FALSE(mirror.apply(deltas[2])); /* deltas[1] was lost */
+    EXPECT_EQ(mirror.sequence(), deltas[0].sequence);
+
+    mirror.resync(book.snapshot(OrderBook::full_depth), book.sequence());
+    EXPECT_EQ(mirror.sequence(), book.sequence());
+    EXPECT_EQ(mirror.bids().size(), 2u);
+    EXPECT_EQ(mirror.asks().size(), 1u);
+    /* Deltas already part of the snapshot are skipped */
+    EXPECT_TRUE(mirror.apply(deltas[1]));
+    EXPECT_EQ(mirror.bids().size(), 2u);
+
+    deltas.clear();
+    EXPECT_TRUE(book.cancel(2));
+    book.publish(record);
+    ASSERT_EQ(deltas.size(), 1u);
+    EXPECT_TRUE(mirror.apply(deltas[0]));
+    ASSERT_EQ(mirror.bids().size(), 1u);
+    EXPECT_EQ(mirror.bids().begin()->first, 100u);
+}
+
+/* Ingress keeps the order of every producer, whatever the wait strategy of its consumer */
+TEST(Ingress, KeepsPerProducerOrder)
+{
+    struct item {
+        uint32_t producer;
+        uint32_t sequence;
+    };
+    constexpr uint32_t producers = 4;
+    constexpr uint32_t items = 50000;
+    for (const auto wait : {router::WAIT::BUSY_SPIN, router::WAIT::SPIN_YIELD, router::WAIT::BLOCK}) {
+        router::ingress<item, 256> ingress{wait};
+        std::vector<std::thread> threads;
+        for (uint32_t producer = 0; producer < producers; ++producer) {
+            threads.emplace_back([&ingress, producer] {
+                for (uint32_t sequence = 0; sequence < items; ++sequence) {
+                    while (!ingress.try_push(item{producer, sequence}, 256, sequence % 16 == 15))
+                        std::this_thread::yield(); /* Consumer is behind */
+                }
+                ingress.notify();
+            });
+        }
+        std::array<uint32_t, producers> next{};
+        std::size_t popped = 0;
+        std::size_t out_of_order = 0;
+        for (std::size_t idle = 0; popped < producers * items;) {
+            item value;
+            if (!ingress.pop(value)) {
+                ingress.wait(idle++);
+                continue;
+            }
+            idle = 0;
+            out_of_order += value.sequence != next[value.producer];
+            next[value.producer] = value.sequence + 1;
+            ++popped;
+        }
+        for (auto &thread : threads)
+            thread.join();
+        EXPECT_EQ(out_of_order, 0u) << "wait strategy " << int(wait);
+        for (const auto count : next)
+            EXPECT_EQ(count, items) << "wait strategy " << int(wait);
+        item value;
+        EXPECT_FALSE(ingress.pop(value));
+    }
+}
+
+TEST(Ingress, PriorityLaneOvertakesInOrder)
+{
+    router::ingress<int> ingress;
+    EXPECT_TRUE(ingress.try_push(1));
+    EXPECT_TRUE(ingress.try_push(2));
+    EXPECT_TRUE(ingress.try_push_priority(10));
+    EXPECT_TRUE(ingress.try_push_priority(11));
+    EXPECT_TRUE(ingress.try_push(3));
+    std::vector<int> popped;
+    for (int value; ingress.pop(value);)
+        popped.push_back(value);
+    EXPECT_EQ(popped, (std::vector<int>{10, 11, 1, 2, 3}));
+}
+
+TEST(Ingress, FullLanesRefuseInsteadOfWaiting)
+{
+    router::ingress<int, 16, 256, 8> ingress;
+    for (int value = 0; value < 16; ++value)
+        EXPECT_TRUE(ingress.try_push(value));
+    EXPECT_FALSE(ingress.try_push(16));
+    for (int value = 0; value < 8; ++value)
+        EXPECT_TRUE(ingress.try_push_priority(value));
+    EXPECT_FALSE(ingress.try_push_priority(8));
+    int value;
+    EXPECT_TRUE(ingress.pop(value));
+    EXPECT_TRUE(ingress.try_push_priority(8));
+}
+
+TEST(Ingress, ExitedProducersHandBackTheirSlots)
+{
+    router::ingress<int> ingress;
+    /* Many more threads over time than an ingress has rings, but never many at once */
+    constexpr int threads = 1000;
+    std::size_t highest = 0;
+    for (int thread = 0; thread < threads; ++thread) {
+        std::thread producer{[&] {
+            highest = std::max(highest, router::producer_index());
+            EXPECT_TRUE(ingress.try_push(thread));
+        }};
+        producer.join();
+    }
+    EXPECT_LT(highest, router::ingress<int>::max_producer_threads);
+    /* The ring of a reused slot keeps the order of its successive owners */
+    for (int expected = 0, value; ingress.pop(value); ++expected)
+        EXPECT_EQ(value, expected);
+}
+
+/* Execution reports of the consumers reach the feed, however many one command produces */
+TEST(ExecutionFeed, SweepDeliversEveryFill)
+{
+    constexpr OrderId makers = 10000; /* More than an ExecutionRing holds */
+    std::vector<ExecutionReport> reports;
+    router::depth_feed feed;
+    feed.execution = [&](const ExecutionReport &report) {
+        reports.push_back(report);
+    };
+    auto placement = default_placement();
+    placement.consumer_cores.resize(1);
+    router::dispatcher dispatcher{{{"TEST", "0.01", "1"}}, nullptr, feed, router::WAIT::BLOCK, placement};
+    for (OrderId id = 1; id <= makers; ++id) {
+        while (!dispatcher.send(0, SIDE::SELL, 100, 1, id)) /* Admission limit; wait for the consumer */
+            std::this_thread::yield();
+    }
+    while (!dispatcher.send(0, SIDE::BUY, 100, makers, makers + 1))
+        std::this_thread::yield();
+    dispatcher.shutdown();
+
+    std::vector<OrderId> filled;
+    Quantity quantity = 0;
+    for (const auto &report : reports) {
+        if (report.taker != makers + 1)
+            continue;
+        filled.push_back(report.maker);
+        quantity += report.quantity;
+    }
+    ASSERT_EQ(filled.size(), makers);
+    for (OrderId id = 1; id <= makers; ++id)
+        EXPECT_EQ(filled[id - 1], id);
+    EXPECT_EQ(quantity, makers);
+    EXPECT_EQ(reports.back().type, EXECUTION::FILL);
+    EXPECT_EQ(reports.back().taker_leftover, 0u);
+}
+
+/* Journals write what the matching threads queue on a thread of their own */
+TEST(Journal, WritesEveryQueuedRecordInProducerOrder)
+{
+    constexpr int producers = 3;
+    constexpr int records = 1000; /* All of them fit one ring, which producers coming one after another share */
+    struct record_type {
+        int producer;
+        int sequence;
+    };
+    std::array<std::vector<int>, producers> written;
+    std::thread::id writer;
+    {
+        journal<record_type, 4096> log{[&](const record_type &record) {
+            writer = std::this_thread::get_id();
+            written[record.producer].push_back(record.sequence);
+        }};
+        std::vector<std::thread> threads;
+        for (int producer = 0; producer < producers; ++producer) {
+            threads.emplace_back([&log, producer] {
+                for (int record = 0; record < records; ++record)
+                    log(record_type{producer, record});
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        EXPECT_EQ(log.dropped(), 0u);
+    }
+    EXPECT_NE(writer, std::this_thread::get_id());
+    for (const auto &sequence : written) {
+        ASSERT_EQ(sequence.size(), std::size_t(records));
+        for (int record = 0; record < records; ++record)
+            EXPECT_EQ(sequence[record], record);
+    }
+}
+
+/* Stalls the consumer inside the execution report with the given ordinal until released */
+struct consumer_hold {
+    explicit consumer_hold(std::vector<int> ordinals): ordinals{std::move(ordinals)} {}
+    void operator()(const ExecutionReport &)
+    {
+        const auto ordinal = ++reports;
+        if (std::find(ordinals.begin(), ordinals.end(), ordinal) == ordinals.end())
+            return;
+        held.store(ordinal);
+        while (held.load() == ordinal)
+            std::this_thread::yield();
+    }
+    void wait(const int ordinal) const
+    {
+        while (held.load() != ordinal)
+            std::this_thread::yield();
+    }
+    void release()
+    {
+        held.store(0);
+    }
+    const std::vector<int> ordinals;
+    int reports = 0; /* Consumer thread */
+    std::atomic<int> held{0};
+};
+
+TEST(Admission, ShedsOnceSaturatedAndRecoversBelowLowWatermark)
+{
+    constexpr std::size_t limit = 64; /* The consumer checks its backlog every 64 commands */
+    constexpr int fillers = 3;
+    consumer_hold hold{{1, 65, 129}};
+    router::depth_feed feed;
+    feed.execution = std::ref(hold);
+    auto placement = default_placement();
+    placement.consumer_cores.resize(1);
+    router::dispatcher dispatcher{{{"TEST", "0.01", "1"}}, nullptr, feed, router::WAIT::BLOCK, placement, limit};
+    /* Every order rests, so each command yields exactly one report */
+    std::atomic<OrderId> id{0};
+    ASSERT_TRUE(dispatcher.send(0, SIDE::BUY, 100, 1, ++id));
+    hold.wait(1);
+
+    /* Fill the rings of threads which are all alive at once, so that none shares a ring */
+    std::atomic<int> full{0};
+    std::vector<std::thread> threads;
+    for (int filler = 0; filler < fillers; ++filler) {
+        threads.emplace_back([&] {
+            std::size_t queued = 0;
+            while (dispatcher.send(0, SIDE::BUY, 100, 1, ++id))
+                ++queued;
+            EXPECT_EQ(queued, limit); /* Refused once the thread alone has the limit queued */
+            ++full;
+            while (full.load() != fillers)
+                std::this_thread::yield();
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    auto stats = dispatcher.admission(0);
+    EXPECT_EQ(stats.shed, uint64_t(fillers));
+    EXPECT_FALSE(stats.saturated); /* The consumer has not looked at its backlog yet */
+
+    /* At the 64th command the backlog is twice the limit */
+    hold.release();
+    hold.wait(65);
+    stats = dispatcher.admission(0);
+    EXPECT_TRUE(stats.saturated);
+    EXPECT_GE(stats.peak_backlog, limit);
+    EXPECT_FALSE(dispatcher.send(0, SIDE::BUY, 100, 1, ++id));
+    EXPECT_EQ(dispatcher.admission(0).shed, uint64_t(fillers + 1));
+
+    /* Still above the low watermark of half the limit at the 128th command */
+    hold.release();
+    hold.wait(129);
+    stats = dispatcher.admission(0);
+    EXPECT_GT(stats.backlog, limit / 2);
+    EXPECT_TRUE(stats.saturated);
+    EXPECT_FALSE(dispatcher.send(0, SIDE::BUY, 100, 1, ++id));
+
+    /* Drained, and admitting again */
+    hold.release();
+    while (dispatcher.admission(0).saturated)
+        std::this_thread::yield();
+    EXPECT_TRUE(dispatcher.send(0, SIDE::BUY, 100, 1, ++id));
+    dispatcher.shutdown();
+    EXPECT_EQ(hold.reports, 2 + fillers * int(limit));
+}
+
+TEST(EarlyCancel, OvertakingCancelIsAppliedToItsOrder)
+{
+    consumer_hold hold{{1}};
+    std::vector<ExecutionReport> reports;
+    router::depth_feed feed;
+    feed.execution = [&](const ExecutionReport &report) {
+        reports.push_back(report);
+        hold(report);
+    };
+    auto placement = default_placement();
+    placement.consumer_cores.resize(1);
+    router::dispatcher dispatcher{{{"TEST", "0.01", "1"}}, nullptr, feed, router::WAIT::BLOCK, placement};
+    ASSERT_TRUE(dispatcher.send(0, SIDE::BUY, 100, 1, 1));
+    hold.wait(1);
+    /* The cancel takes the priority lane and reaches the consumer before its order */
+    ASSERT_TRUE(dispatcher.send(0, SIDE::BUY, 101, 7, 2));
+    ASSERT_TRUE(dispatcher.cancel(0, 2));
+    hold.release();
+    dispatcher.shutdown();
+
+    ASSERT_EQ(reports.size(), 2u);
+    EXPECT_EQ(reports[0].type, EXECUTION::REST);
+    EXPECT_EQ(reports[1].type, EXECUTION::CANCEL_ACK);
+    EXPECT_EQ(reports[1].taker, 2u);
+    EXPECT_EQ(reports[1].price, 101u);
+    EXPECT_EQ(reports[1].quantity, 7u);
+    const auto top = dispatcher.top_of_book(0);
+    EXPECT_EQ(top.bid, 100u);
+    EXPECT_EQ(top.bid_quantity, 1u);
+}
+
+TEST(EarlyCancel, ExpiredCancelIsRejected)
+{
+    std::vector<ExecutionReport> reports;
+    std::atomic_bool rejected{false};
+    router::depth_feed feed;
+    feed.execution = [&](const ExecutionReport &report) {
+        reports.push_back(report);
+        if (report.type == EXECUTION::CANCEL_REJECT)
+            rejected = true;
+    };
+    auto placement = default_placement();
+    placement.consumer_cores.resize(1);
+    router::dispatcher dispatcher{{{"TEST", "0.01", "1"}}, nullptr, feed, router::WAIT::BLOCK, placement};
+    constexpr OrderId unknown = 1000;
+    ASSERT_TRUE(dispatcher.cancel(0, unknown));
+    /* Expiry is checked as the consumer works; keep it busy until the rings have passed the cancel */
+    for (OrderId id = 1; !rejected.load(); ++id) {
+        ASSERT_LT(id, unknown);
+        ASSERT_TRUE(dispatcher.send(0, SIDE::BUY, 100, 1, id));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    /* The order itself, once it turns up, is no longer affected */
+    ASSERT_TRUE(dispatcher.send(0, SIDE::SELL, 200, 1, unknown));
+    dispatcher.shutdown();
+
+    const auto reject = std::find_if(reports.begin(), reports.end(), [](const ExecutionReport &report) {
+        return report.type == EXECUTION::CANCEL_REJECT;
+    });
+    ASSERT_NE(reject, reports.end());
+    EXPECT_EQ(reject->taker, unknown);
+    EXPECT_EQ(reject->market, 0u);
+    EXPECT_EQ(std::count_if(reports.begin(), reports.end(), [](const ExecutionReport &report) {
+        return report.type == EXECUTION::CANCEL_REJECT;
+    }), 1);
+    EXPECT_EQ(reports.back().type, EXECUTION::REST);
+    EXPECT_EQ(reports.back().taker, unknown);
+}
+
+/* A market moved between consumers mid-stream ends up as if it had stayed */
+TEST(Migration, KeepsCommandOrderWhileProducerSubmits)
+{
+    constexpr OrderId orders = 40000;
+    constexpr OrderId migrate_every = 4000; /* The producer waits for a migration this often */
+    using fields_type = std::tuple<EXECUTION, SIDE, MarketId, OrderId, OrderId, Price, Quantity, Quantity, Quantity>;
+    using level_type = std::tuple<SIDE, Price, Quantity, uint32_t>;
+    struct outcome {
+        std::vector<fields_type> reports;
+        std::vector<level_type> levels;
+        int migrations = 0;
+    };
+    /* New orders and amends only: cancels take the priority lane, so their order is not the producer's */
+    const auto run = [&](const bool migrating) {
+        outcome result;
+        std::atomic_bool resynced{false};
+        router::depth_feed feed;
+        feed.execution = [&](const ExecutionReport &report) {
+            result.reports.emplace_back(report.type, report.side, report.market, report.taker, report.maker,
+                                        report.price, report.quantity, report.taker_leftover, report.maker_leftover);
+        };
+        feed.snapshot = [&](MarketId, const std::vector<OrderBook::snapshot_point> &snapshot, uint64_t) {
+            for (const auto &point : snapshot)
+                result.levels.emplace_back(point.side, point.price, point.cumulative_quantity, point.size);
+            resynced = true;
+        };
+        auto placement = default_placement();
+        placement.consumer_cores.assign(2, placement.consumer_cores.front());
+        router::dispatcher dispatcher{{{"TEST", "0.01", "1"}}, nullptr, feed, router::WAIT::BLOCK, placement};
+        std::atomic<int> migrations{0};
+        std::atomic_bool done{false};
+        std::thread migrator;
+        if (migrating) {
+            if (!dispatcher.migrate(0, 0) && !dispatcher.migrate(0, 1)) {
+                dispatcher.shutdown();
+                result.migrations = -1;
+                return result;
+            }
+            migrator = std::thread{[&] {
+                for (std::size_t target = 0; !done.load(); ++target) {
+                    if (dispatcher.migrate(0, target % 2))
+                        ++migrations;
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }};
+        }
+        std::mt19937 random{11};
+        for (OrderId id = 1; id <= orders; ++id) {
+            if (migrating && id % migrate_every == 0) {
+                const auto seen = migrations.load();
+                while (migrations.load() == seen)
+                    std::this_thread::yield();
+            }
+            const auto side = random() % 2 ? SIDE::BUY : SIDE::SELL;
+            const auto price = Price(1000 + random() % 20);
+            const auto quantity = Quantity(random() % 10 + 1);
+            while (!dispatcher.send(0, side, price, quantity, id))
+                std::this_thread::yield();
+            if (id > 10 && random() % 4 == 0) {
+                const auto amended = id - random() % 10;
+                const auto amended_price = Price(1000 + random() % 20);
+                const auto amended_quantity = Quantity(random() % 10 + 1);
+                while (!dispatcher.amend(0, amended, amended_price, amended_quantity))
+                    std::this_thread::yield();
+            }
+        }
+        done = true;
+        if (migrator.joinable())
+            migrator.join();
+        /* Queued behind everything above, wherever the market is by then */
+        while (!dispatcher.resync(0))
+            std::this_thread::yield();
+        while (!resynced.load())
+            std::this_thread::yield();
+        dispatcher.shutdown();
+        result.migrations = migrations.load();
+        return result;
+    };
+    const auto reference = run(false);
+    const auto migrated = run(true);
+    if (migrated.migrations < 0)
+        GTEST_SKIP() << "membarrier(2) is unavailable";
+    EXPECT_GE(migrated.migrations, int(orders / migrate_every) - 1);
+    ASSERT_FALSE(reference.levels.empty());
+    ASSERT_EQ(migrated.reports.size(), reference.reports.size());
+    EXPECT_TRUE(migrated.reports == reference.reports);
+    EXPECT_EQ(migrated.levels, reference.levels);
+}
+
+/* Markets registered while running, from several threads at once */
+TEST(AddMarket, ConcurrentRegistrationsGetDenseIdsAndRouteAtOnce)
+{
+    constexpr int registrars = 4;
+    constexpr int per_registrar = 25;
+    std::mutex reports_mutex;
+    std::vector<ExecutionReport> reports;
+    router::depth_feed feed;
+    feed.execution = [&](const ExecutionReport &report) {
+        std::lock_guard<std::mutex> lock{reports_mutex};
+        reports.push_back(report);
+    };
+    auto placement = default_placement();
+    placement.consumer_cores.assign(2, placement.consumer_cores.front());
+    router::dispatcher dispatcher{{{"BASE", "0.01", "1"}}, nullptr, feed, router::WAIT::BLOCK, placement};
+
+    std::array<std::vector<std::pair<std::string, MarketId>>, registrars> added;
+    std::atomic<int> shared_taken{0};
+    std::vector<std::thread> threads;
+    for (int registrar = 0; registrar < registrars; ++registrar) {
+        threads.emplace_back([&, registrar] {
+            for (int market = 0; market < per_registrar; ++market) {
+                /* Every registrar also races for the one name all of them want */
+                if (market == per_registrar / 2 && dispatcher.add_market({"SHARED", "0.01", "1"}))
+                    ++shared_taken;
+                auto name = "M" + std::to_string(registrar) + "_" + std::to_string(market);
+                const auto id = dispatcher.add_market({name, "0.01", "1"});
+                ASSERT_TRUE(id);
+                EXPECT_FALSE(dispatcher.add_market({name, "0.01", "1"}));
+                /* Routable as soon as it is returned: a maker and a taker which crosses it */
+                const OrderId maker = OrderId(*id) * 2;
+                while (!dispatcher.send(*id, SIDE::SELL, 100, 3, maker))
+                    std::this_thread::yield();
+                while (!dispatcher.send(*id, SIDE::BUY, 100, 3, maker + 1))
+                    std::this_thread::yield();
+                added[registrar].emplace_back(std::move(name), *id);
+            }
+        });
+    }
+    /* Lookups of the base market go on meanwhile and never miss it */
+    std::atomic_bool registering{true};
+    std::thread reader{[&] {
+        while (registering.load()) {
+            const auto base = dispatcher.market("BASE");
+            ASSERT_NE(base, nullptr);
+            EXPECT_EQ(base->id, 0u);
+        }
+    }};
+    for (auto &thread : threads)
+        thread.join();
+    registering = false;
+    reader.join();
+
+    EXPECT_EQ(shared_taken.load(), 1);
+    const auto markets = 1 + registrars * per_registrar + 1;
+    ASSERT_EQ(dispatcher.market_count(), std::size_t(markets));
+    std::vector<bool> seen(markets, false);
+    seen[0] = true;
+    seen[dispatcher.market("SHARED")->id] = true;
+    for (const auto &names : added) {
+        for (const auto &[name, id] : names) {
+            ASSERT_LT(id, markets);
+            EXPECT_FALSE(seen[id]) << name;
+            seen[id] = true;
+            EXPECT_EQ(dispatcher.market(id).name, name);
+            ASSERT_NE(dispatcher.market(name), nullptr);
+            EXPECT_EQ(dispatcher.market(name)->id, id);
+        }
+    }
+    EXPECT_EQ(std::count(seen.begin(), seen.end(), true), markets);
+    dispatcher.shutdown();
+
+    std::vector<Quantity> filled(markets, 0);
+    for (const auto &report : reports) {
+        if (report.type != EXECUTION::FILL)
+            continue;
+        EXPECT_EQ(report.taker, OrderId(report.market) * 2 + 1);
+        EXPECT_EQ(report.maker, OrderId(report.market) * 2);
+        filled[report.market] += report.quantity;
+    }
+    for (const auto &names : added) {
+        for (const auto &market : names)
+            EXPECT_EQ(filled[market.second], 3u) << market.first;
+    }
+}
+
+/* Native order entry: framing of the read buffer and in-place views */
+struct wire_buffer {
+    template <typename message_type>
+    void append(const message_type &message)
+    {
+        std::memcpy(data + size, &message, sizeof(message));
+        size += sizeof(message);
+    }
+    alignas(8) char data[512] = {};
+    std::size_t size = 0;
+};
+
+TEST(BinaryProtocol, RoundTripsEveryRequest)
+{
+    wire::new_order order{wire::head_of<wire::new_order>(wire::NEW_ORDER), 3, SIDE::SELL, 0, 11, 1005, 7};
+    wire::cancel_order cancel{wire::head_of<wire::cancel_order>(wire::CANCEL_ORDER), 3, 0, 12, 42};
+    wire::amend_order amend{wire::head_of<wire::amend_order>(wire::AMEND_ORDER), 3, 0, 13, 42, 1004, 9};
+    wire::market_request request{wire::head_of<wire::market_request>(wire::MARKET_REQUEST), 0, 14, {}};
+    ASSERT_TRUE(wire::set_name(request, "EUR_USD"));
+    wire_buffer buffer;
+    buffer.append(order);
+    buffer.append(cancel);
+    buffer.append(amend);
+    buffer.append(request);
+
+    std::vector<uint8_t> types;
+    const auto [consumed, ok] = wire::decode(buffer.data, buffer.size, [&](const wire::header &head) {
+        /* In place, and aligned for every field */
+        EXPECT_EQ(reinterpret_cast<std::uintptr_t>(&head) % 8, 0u);
+        types.push_back(head.type);
+        switch (head.type) {
+        case wire::NEW_ORDER: {
+            const auto message = wire::view<wire::new_order>(head);
+            EXPECT_EQ(wire::view<wire::cancel_order>(head), nullptr);
+            EXPECT_NE(message, nullptr);
+            return message != nullptr && message->market == 3 && message->side == SIDE::SELL
+                   && message->client_id == 11 && message->price == 1005 && message->quantity == 7;
+        }
+        case wire::CANCEL_ORDER: {
+            const auto message = wire::view<wire::cancel_order>(head);
+            EXPECT_NE(message, nullptr);
+            return message != nullptr && message->client_id == 12 && message->order_id == 42;
+        }
+        case wire::AMEND_ORDER: {
+            const auto message = wire::view<wire::amend_order>(head);
+            EXPECT_NE(message, nullptr);
+            return message != nullptr && message->client_id == 13 && message->order_id == 42
+                   && message->price == 1004 && message->quantity == 9;
+        }
+        case wire::MARKET_REQUEST: {
+            const auto message = wire::view<wire::market_request>(head);
+            EXPECT_NE(message, nullptr);
+            return message != nullptr && message->client_id == 14 && wire::name_of(*message) == "EUR_USD";
+        }
+        default:
+            return false;
+        }
+    });
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(consumed, buffer.size);
+    EXPECT_EQ(types, (std::vector<uint8_t>{wire::NEW_ORDER, wire::CANCEL_ORDER, wire::AMEND_ORDER,
+                                           wire::MARKET_REQUEST}));
+}
+
+TEST(BinaryProtocol, WaitsForTheRestOfAMessage)
+{
+    wire_buffer buffer;
+    buffer.append(wire::cancel_order{wire::head_of<wire::cancel_order>(wire::CANCEL_ORDER), 0, 0, 1, 1});
+    buffer.append(wire::amend_order{wire::head_of<wire::amend_order>(wire::AMEND_ORDER), 0, 0, 2, 1, 100, 1});
+    const auto complete = sizeof(wire::cancel_order);
+    /* Cut anywhere in the second message, its header included */
+    for (auto size = complete; size < buffer.size; ++size) {
+        int visited = 0;
+        const auto [consumed, ok] = wire::decode(buffer.data, size, [&](const wire::header &) {
+            return ++visited != 0;
+        });
+        EXPECT_TRUE(ok) << size;
+        EXPECT_EQ(consumed, complete) << size;
+        EXPECT_EQ(visited, 1) << size;
+    }
+    EXPECT_EQ(wire::decode(buffer.data, 0, [](const wire::header &) {
+        return true;
+    }), std::make_pair(std::size_t{0}, true));
+}
+
+TEST(BinaryProtocol, RejectsMalformedHeaders)
+{
+    const wire::cancel_order valid{wire::head_of<wire::cancel_order>(wire::CANCEL_ORDER), 0, 0, 1, 1};
+    const auto framed = [&](const wire::header head) {
+        wire_buffer buffer;
+        buffer.append(valid);
+        auto bad = wire::market_request{head, 0, 0, {}};
+        buffer.append(bad);
+        int visited = 0;
+        const auto result = wire::decode(buffer.data, buffer.size, [&](const wire::header &) {
+            ++visited;
+            return true;
+        });
+        EXPECT_EQ(visited, result.second ? 2 : 1); /* Messages before a bad header are still handed out */
+        return result;
+    };
+    const auto rejected = std::make_pair(sizeof(valid), false);
+    EXPECT_EQ(framed(wire::header{0, wire::CANCEL_ORDER, wire::protocol_version}), rejected);
+    EXPECT_EQ(framed(wire::header{uint16_t(sizeof(wire::header)), wire::CANCEL_ORDER, wire::protocol_version}),
+              rejected);
+    /* Not a multiple of 8, so the next message would be misaligned */
+    EXPECT_EQ(framed(wire::header{28, wire::NEW_ORDER, wire::protocol_version}), rejected);
+    EXPECT_EQ(framed(wire::header{uint16_t(wire::max_message + 8), wire::NEW_ORDER, wire::protocol_version}),
+              rejected);
+    EXPECT_EQ(framed(wire::header{uint16_t(~0u), wire::NEW_ORDER, wire::protocol_version}), rejected);
+    EXPECT_EQ(framed(wire::header{32, wire::NEW_ORDER, wire::protocol_version + 1}), rejected);
+    /* A well-framed message of the wrong size for its type is left to view() */
+    EXPECT_EQ(framed(wire::header{uint16_t(wire::max_message), wire::NEW_ORDER, wire::protocol_version}),
+              std::make_pair(sizeof(valid) + wire::max_message, true));
+    const auto head = wire::head_of<wire::market_request>(wire::NEW_ORDER);
+    EXPECT_EQ(wire::view<wire::new_order>(head), nullptr);
+}
+
+TEST(BinaryProtocol, StopsWhereTheVisitorRefuses)
+{
+    wire_buffer buffer;
+    for (uint64_t client = 1; client <= 3; ++client)
+        buffer.append(wire::cancel_order{wire::head_of<wire::cancel_order>(wire::CANCEL_ORDER), 0, 0, client, 1});
+    const auto [consumed, ok] = wire::decode(buffer.data, buffer.size, [](const wire::header &head) {
+        return wire::view<wire::cancel_order>(head)->client_id != 2;
+    });
+    EXPECT_FALSE(ok);
+    EXPECT_EQ(consumed, sizeof(wire::cancel_order));
+}
+
+TEST(BinaryProtocol, NamesMustFitTheRequest)
+{
+    wire::market_request request{};
+    EXPECT_TRUE(wire::set_name(request, std::string(sizeof(request.name) - 1, 'X')));
+    EXPECT_EQ(wire::name_of(request).size(), sizeof(request.name) - 1);
+    EXPECT_FALSE(wire::set_name(request, std::string(sizeof(request.name), 'X')));
+    EXPECT_TRUE(wire::set_name(request, "A"));
+    EXPECT_EQ(wire::name_of(request), "A");
+}
 
 int main(int argc, char **argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
 }
-
-
@@ -51,7 +51,7 @@ std::vector<double> geoBrownian(double S0,double mu,double sigma, double T, int
     std::vector<double> myVec = brownian(mu - (pow(sigma,2)/2),sigma,T,steps);
     // and map each element
     for(auto i = myVec.size(); i > 0; --i) {
-        myVec[i] = S0*exp(myVec[i]);
+        myVec[i - 1] = S0*exp(myVec[i - 1]);
     }
     return myVec;
 }
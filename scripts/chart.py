@@ -9,6 +9,8 @@ import matplotlib.dates as mdate
 
 register_matplotlib_converters()
 
+MARKET = "EUR_USD"
+
 fig, (feed_chart, ob_chart) = plt.subplots(2,figsize=(15,5))
 ob_chart.grid()
 feed_chart.autoscale(tight=True)
@@ -16,7 +18,11 @@ ob_chart.autoscale(tight=True)
 
 def fetch_prices(i):
     try:
-        ob = pd.read_csv("./data/snapshot.csv", header=None, error_bad_lines=False, warn_bad_lines=False)
+        # Replay depth deltas (market, sequence, side, price, quantity, count) into the latest book
+        depth = pd.read_csv("./data/depth.csv", header=None, error_bad_lines=False, warn_bad_lines=False)
+        depth = depth[depth[0] == MARKET].sort_values(1).drop_duplicates([2, 3], keep='last')
+        ob = depth[depth[4] > 0][[2, 3, 4]]
+        ob.columns = [0, 1, 2]
         feed = pd.read_csv("./data/feed.csv", header=None, error_bad_lines=False, warn_bad_lines=False, parse_dates=[0])
         feed[0] = pd.to_datetime(feed[0], unit='ms')
         